@@ -0,0 +1,275 @@
+#ifndef __INDEXES_BITMAP_HPP
+#define __INDEXES_BITMAP_HPP
+
+#include "greylock/key.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// returns true if posting references document ordinal (see @document_dictionary), ordinal is put into @ordinal
+static inline bool posting_ordinal(const key &k, uint64_t *ordinal) {
+	if ((k.id.size() != sizeof(uint64_t)) || (k.id[0] != 0))
+		return false;
+
+	*ordinal = key::prefix(k.id);
+	return true;
+}
+
+// Compressed set of document ordinals in the spirit of Roaring bitmaps.
+//
+// Ordinals are split by their upper bits into chunks of 65536 values, every chunk is a container
+// which is either a sorted array of the lower 16 bits (while it has at most @array_max values)
+// or a plain 65536-bit bitmap. Sparse chunks take 2 bytes per ordinal, dense ones take 8 kilobytes,
+// membership test is a binary search over containers followed by either a binary search or a single bit test.
+//
+// Bitmap is either saved whole by @save(), or sharded by containers: @directory lists the containers,
+// and every container is saved by @save_container() into its own object, so that modification
+// only rewrites the containers it has touched (see @index::dense()).
+class ordinal_bitmap {
+public:
+	enum {
+		// whole bitmap
+		serialization_version_1 = 1,
+		// directory of the containers
+		serialization_version_2,
+	};
+
+	static const size_t array_max = 4096;
+	static const size_t bitmap_words = 65536 / 64;
+
+	bool contains(uint64_t ordinal) const {
+		auto c = find(ordinal >> 16);
+		if (c == m_containers.end())
+			return false;
+
+		uint16_t low = ordinal & 0xffff;
+		if (c->bits.empty())
+			return std::binary_search(c->array.begin(), c->array.end(), low);
+
+		return (c->bits[low / 64] >> (low % 64)) & 1;
+	}
+
+	// returns false if ordinal is already present
+	bool add(uint64_t ordinal) {
+		uint64_t high = ordinal >> 16;
+		uint16_t low = ordinal & 0xffff;
+
+		auto c = std::lower_bound(m_containers.begin(), m_containers.end(), high,
+				[] (const container &c, uint64_t h) {return c.high < h;});
+		if ((c == m_containers.end()) || (c->high != high)) {
+			container tmp;
+			tmp.high = high;
+			c = m_containers.insert(c, tmp);
+		}
+
+		if (!c->bits.empty()) {
+			uint64_t mask = 1ULL << (low % 64);
+			if (c->bits[low / 64] & mask)
+				return false;
+
+			c->bits[low / 64] |= mask;
+			++m_cardinality;
+			return true;
+		}
+
+		auto it = std::lower_bound(c->array.begin(), c->array.end(), low);
+		if ((it != c->array.end()) && (*it == low))
+			return false;
+
+		c->array.insert(it, low);
+		++m_cardinality;
+
+		if (c->array.size() > array_max) {
+			c->bits.assign(bitmap_words, 0);
+			for (auto v: c->array) {
+				c->bits[v / 64] |= 1ULL << (v % 64);
+			}
+			c->array.clear();
+		}
+
+		return true;
+	}
+
+	// returns false if there was no such ordinal
+	bool remove(uint64_t ordinal) {
+		uint64_t high = ordinal >> 16;
+		uint16_t low = ordinal & 0xffff;
+
+		auto c = std::lower_bound(m_containers.begin(), m_containers.end(), high,
+				[] (const container &c, uint64_t h) {return c.high < h;});
+		if ((c == m_containers.end()) || (c->high != high))
+			return false;
+
+		if (!c->bits.empty()) {
+			uint64_t mask = 1ULL << (low % 64);
+			if (!(c->bits[low / 64] & mask))
+				return false;
+
+			c->bits[low / 64] &= ~mask;
+			--m_cardinality;
+
+			size_t count = 0;
+			for (auto w: c->bits) {
+				count += __builtin_popcountll(w);
+			}
+
+			if (count <= array_max) {
+				for (size_t i = 0; i < bitmap_words; ++i) {
+					for (uint64_t w = c->bits[i]; w; w &= w - 1) {
+						c->array.push_back(i * 64 + __builtin_ctzll(w));
+					}
+				}
+				c->bits.clear();
+			}
+		} else {
+			auto it = std::lower_bound(c->array.begin(), c->array.end(), low);
+			if ((it == c->array.end()) || (*it != low))
+				return false;
+
+			c->array.erase(it);
+			--m_cardinality;
+		}
+
+		if (c->array.empty() && c->bits.empty())
+			m_containers.erase(c);
+
+		return true;
+	}
+
+	uint64_t cardinality() const {
+		return m_cardinality;
+	}
+
+	std::string save() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+		return ss.str();
+	}
+
+	void load(const void *data, size_t size) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		result.get().convert(this);
+
+		update_cardinality();
+	}
+
+	std::string str() const {
+		std::ostringstream ss;
+		ss << "containers: " << m_containers.size() << ", cardinality: " << m_cardinality;
+		return ss.str();
+	}
+
+	struct container {
+		uint64_t high = 0;
+		std::vector<uint16_t> array;
+		std::vector<uint64_t> bits;
+
+		MSGPACK_DEFINE(high, array, bits);
+	};
+
+	struct directory {
+		int version = serialization_version_2;
+		std::vector<uint64_t> containers;
+
+		MSGPACK_DEFINE(version, containers);
+
+		std::string save() const {
+			std::stringstream ss;
+			msgpack::pack(ss, *this);
+			return ss.str();
+		}
+
+		void load(const void *data, size_t size) {
+			msgpack::unpacked result;
+			msgpack::unpack(&result, (const char *)data, size);
+			result.get().convert(this);
+		}
+	};
+
+	// returns version of the stored object, i.e. whether it is the whole bitmap or the directory
+	static int stored_version(const void *data, size_t size) {
+		stored_header h;
+
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		result.get().convert(&h);
+		return h.version;
+	}
+
+	static std::string save_container(const container &c) {
+		std::stringstream ss;
+		msgpack::pack(ss, c);
+		return ss.str();
+	}
+
+	static void load_container(const void *data, size_t size, container &c) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		result.get().convert(&c);
+	}
+
+	// returns NULL if there is no container for the ordinals with given upper bits
+	const container *find_container(uint64_t high) const {
+		auto c = find(high);
+		if (c == m_containers.end())
+			return NULL;
+
+		return &(*c);
+	}
+
+	// replaces content of the bitmap with the containers listed in the directory
+	void assign(std::vector<container> &&containers) {
+		std::sort(containers.begin(), containers.end(),
+				[] (const container &c1, const container &c2) {return c1.high < c2.high;});
+
+		version = serialization_version_2;
+		m_containers = std::move(containers);
+		update_cardinality();
+	}
+
+	int version = serialization_version_1;
+	std::vector<container> m_containers;
+
+	MSGPACK_DEFINE(version, m_containers);
+
+private:
+	uint64_t m_cardinality = 0;
+
+	// both stored objects start with the version
+	struct stored_header {
+		int version = 0;
+
+		MSGPACK_DEFINE(version);
+	};
+
+	void update_cardinality() {
+		m_cardinality = 0;
+		for (auto &c: m_containers) {
+			if (c.bits.empty()) {
+				m_cardinality += c.array.size();
+			} else {
+				for (auto w: c.bits)
+					m_cardinality += __builtin_popcountll(w);
+			}
+		}
+	}
+
+	std::vector<container>::const_iterator find(uint64_t high) const {
+		auto c = std::lower_bound(m_containers.begin(), m_containers.end(), high,
+				[] (const container &c, uint64_t h) {return c.high < h;});
+		if ((c != m_containers.end()) && (c->high != high))
+			return m_containers.end();
+
+		return c;
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_BITMAP_HPP
@@ -0,0 +1,176 @@
+#ifndef __INDEXES_BLOCK_HPP
+#define __INDEXES_BLOCK_HPP
+
+#include "greylock/key.hpp"
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+namespace ioremap { namespace greylock { namespace block {
+
+// Sorted keys of the decoded leaf or posting list as two columns of fixed-width sort words,
+// timestamps and id prefixes (see @key::id_prefix), so that many keys can be compared with the given one at once.
+//
+// Order of (timestamp, prefix) pairs is the order of the keys, except that keys with equal pairs
+// have to be ordered by whole ids.
+struct columns {
+	std::vector<uint64_t> timestamps;
+	std::vector<uint64_t> prefixes;
+
+	void assign(const std::vector<key> &keys) {
+		timestamps.resize(keys.size());
+		prefixes.resize(keys.size());
+
+		for (size_t i = 0; i < keys.size(); ++i) {
+			timestamps[i] = keys[i].timestamp;
+			prefixes[i] = keys[i].has_prefix ? keys[i].id_prefix : key::prefix(keys[i].id);
+		}
+	}
+
+	void clear() {
+		timestamps.clear();
+		prefixes.clear();
+	}
+
+	size_t size() const {
+		return timestamps.size();
+	}
+
+	bool empty() const {
+		return timestamps.empty();
+	}
+
+	bool less(size_t pos, uint64_t t, uint64_t p) const {
+		return (timestamps[pos] < t) || ((timestamps[pos] == t) && (prefixes[pos] < p));
+	}
+};
+
+#if defined(__AVX2__)
+static const size_t block_size = 4;
+#elif defined(__SSE4_2__)
+static const size_t block_size = 2;
+#else
+static const size_t block_size = 1;
+#endif
+
+// Returns the number of entries in [@first, @last) which are less than (@t, @p), entries must be sorted.
+//
+// Entries are compared a block at a time, signed 64-bit comparisons are turned into unsigned ones
+// by flipping the sign bit of both operands. Scan stops at the first block which is not less as a whole.
+static inline size_t count_less(const columns &c, size_t first, size_t last, uint64_t t, uint64_t p) {
+	size_t pos = first;
+
+#if defined(__AVX2__)
+	const __m256i sign = _mm256_set1_epi64x(0x8000000000000000LL);
+	const __m256i vt = _mm256_xor_si256(_mm256_set1_epi64x(t), sign);
+	const __m256i vp = _mm256_xor_si256(_mm256_set1_epi64x(p), sign);
+
+	for (; pos + 4 <= last; pos += 4) {
+		__m256i ts = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(c.timestamps.data() + pos)), sign);
+		__m256i ps = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(c.prefixes.data() + pos)), sign);
+
+		__m256i less = _mm256_or_si256(_mm256_cmpgt_epi64(vt, ts),
+				_mm256_and_si256(_mm256_cmpeq_epi64(vt, ts), _mm256_cmpgt_epi64(vp, ps)));
+
+		int mask = _mm256_movemask_pd(_mm256_castsi256_pd(less));
+		if (mask != 0xf)
+			return pos - first + __builtin_popcount(mask);
+	}
+#elif defined(__SSE4_2__)
+	const __m128i sign = _mm_set1_epi64x(0x8000000000000000LL);
+	const __m128i vt = _mm_xor_si128(_mm_set1_epi64x(t), sign);
+	const __m128i vp = _mm_xor_si128(_mm_set1_epi64x(p), sign);
+
+	for (; pos + 2 <= last; pos += 2) {
+		__m128i ts = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(c.timestamps.data() + pos)), sign);
+		__m128i ps = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(c.prefixes.data() + pos)), sign);
+
+		__m128i less = _mm_or_si128(_mm_cmpgt_epi64(vt, ts),
+				_mm_and_si128(_mm_cmpeq_epi64(vt, ts), _mm_cmpgt_epi64(vp, ps)));
+
+		int mask = _mm_movemask_pd(_mm_castsi128_pd(less));
+		if (mask != 0x3)
+			return pos - first + __builtin_popcount(mask);
+	}
+#endif
+
+	for (; pos < last; ++pos) {
+		if (!c.less(pos, t, p))
+			break;
+	}
+
+	return pos - first;
+}
+
+// narrows [@lo, @hi) down to a few blocks by binary search and scans the rest,
+// all entries before @lo must be less than (@t, @p), the bound must not be after @hi
+static inline size_t scan(const columns &c, size_t lo, size_t hi, uint64_t t, uint64_t p) {
+	while (hi - lo > 4 * block_size) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (c.less(mid, t, p))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo + count_less(c, lo, hi, t, p);
+}
+
+// Position of the first entry in [@first, @last) which is not less than (@t, @p).
+// Cursors usually move by a few keys, so the bound is galloped to from @first.
+static inline size_t lower_bound(const columns &c, size_t first, size_t last, uint64_t t, uint64_t p) {
+	size_t lo = first;
+	size_t step = block_size;
+	while ((lo + step < last) && c.less(lo + step - 1, t, p)) {
+		lo += step;
+		step *= 2;
+	}
+
+	return scan(c, lo, std::min(last, lo + step), t, p);
+}
+
+// the same as @lower_bound(), but the bound is galloped to from @last, it is used by reverse cursors
+static inline size_t lower_bound_back(const columns &c, size_t first, size_t last, uint64_t t, uint64_t p) {
+	size_t hi = last;
+	size_t step = block_size;
+	while ((hi >= first + step) && !c.less(hi - step, t, p)) {
+		hi -= step;
+		step *= 2;
+	}
+
+	size_t lo = (hi >= first + step) ? hi - step + 1 : first;
+	return scan(c, lo, hi, t, p);
+}
+
+// position of the first key in [@first, keys.size()) which is not less than @k,
+// @c must be built from @keys
+static inline size_t lower_bound(const std::vector<key> &keys, const columns &c, size_t first, const key &k) {
+	uint64_t p = k.has_prefix ? k.id_prefix : key::prefix(k.id);
+	size_t pos = lower_bound(c, first, keys.size(), k.timestamp, p);
+
+	// keys with the same timestamp and prefix are ordered by whole ids
+	while ((pos < keys.size()) && (keys[pos] < k))
+		++pos;
+
+	return pos;
+}
+
+// position of the largest key in [0, @last] which is not greater than @k, -1 if there is no such key
+static inline ssize_t rlower_bound(const std::vector<key> &keys, const columns &c, ssize_t last, const key &k) {
+	uint64_t p = k.has_prefix ? k.id_prefix : key::prefix(k.id);
+	ssize_t pos = lower_bound_back(c, 0, last + 1, k.timestamp, p);
+
+	while ((pos <= last) && (keys[pos] <= k))
+		++pos;
+
+	return pos - 1;
+}
+
+}}} // namespace ioremap::greylock::block
+
+#endif // __INDEXES_BLOCK_HPP
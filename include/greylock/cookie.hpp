@@ -0,0 +1,141 @@
+#ifndef __INDEXES_COOKIE_HPP
+#define __INDEXES_COOKIE_HPP
+
+#include "greylock/key.hpp"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Position of the paginated iteration within single index.
+//
+// @start is the first key which has not yet been returned to the client,
+// its @id and @timestamp are exactly those of the key in the index, while @start.url
+// is not a document url, but url of the leaf page which hosted this key when cookie was created.
+//
+// Generation number is the index generation at cookie creation time. If index has not been
+// modified since then, leaf page at @start.url still contains @start and iteration can be resumed
+// directly from that page without descending from the root.
+//
+// If @finished is true, all keys of the index have already been iterated over, @start is not used.
+struct index_position {
+	key start;
+	unsigned long long generation_number_sec = 0;
+	unsigned long long generation_number_nsec = 0;
+	bool finished = false;
+
+	MSGPACK_DEFINE(start, generation_number_sec, generation_number_nsec, finished);
+
+	std::string str() const {
+		std::ostringstream ss;
+		ss << "start: " << start.str() <<
+			", generation: " << generation_number_sec << "." << generation_number_nsec <<
+			", finished: " << finished;
+		return ss.str();
+	}
+};
+
+// Opaque pagination token returned to the client in search reply.
+// Every entry in @positions corresponds to the index with the same position in the intersection request.
+struct cookie {
+	enum {
+		serialization_version_1 = 1,
+		serialization_version_2,
+	};
+
+	int version = serialization_version_2;
+	std::vector<index_position> positions;
+
+	// cookie can only be used to continue iteration in the same direction
+	bool reverse = false;
+
+	MSGPACK_DEFINE(version, positions, reverse);
+
+	bool empty() const {
+		return positions.empty();
+	}
+
+	// packed cookie is hex-encoded, so that it can be put into JSON reply as is
+	std::string encode() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+
+		const std::string &raw = ss.str();
+
+		static const char hex[] = "0123456789abcdef";
+		std::string ret;
+		ret.resize(raw.size() * 2);
+		for (size_t i = 0; i < raw.size(); ++i) {
+			unsigned char c = raw[i];
+			ret[2 * i] = hex[c >> 4];
+			ret[2 * i + 1] = hex[c & 0xf];
+		}
+
+		return ret;
+	}
+
+	// returns false if @data is not a cookie created by @encode(),
+	// for example when old client provides bare document ID as a paging start
+	//
+	// Cookie of the version this code does not know is still a cookie, it is decoded without positions,
+	// so that iteration starts from the beginning instead of looking for the document with such ID.
+	bool decode(const std::string &data) {
+		positions.clear();
+
+		if (data.empty() || (data.size() % 2))
+			return false;
+
+		auto unhex = [] (char c) -> int {
+			if (c >= '0' && c <= '9')
+				return c - '0';
+			if (c >= 'a' && c <= 'f')
+				return c - 'a' + 10;
+			return -1;
+		};
+
+		std::string raw;
+		raw.resize(data.size() / 2);
+		for (size_t i = 0; i < raw.size(); ++i) {
+			int hi = unhex(data[2 * i]);
+			int lo = unhex(data[2 * i + 1]);
+			if (hi < 0 || lo < 0)
+				return false;
+
+			raw[i] = (hi << 4) | lo;
+		}
+
+		try {
+			msgpack::unpacked result;
+			msgpack::unpack(&result, raw.data(), raw.size());
+			result.get().convert(this);
+		} catch (const std::exception &e) {
+			positions.clear();
+			return false;
+		}
+
+		switch (version) {
+		case serialization_version_1:
+			// version 1 cookies were only created for queries without unions and excluded indexes,
+			// they have one position per required index and no completion flag, which is unpacked as false:
+			// iteration over required indexes stopped as soon as any of them finished
+			for (auto &pos: positions) {
+				pos.finished = false;
+			}
+			version = serialization_version_2;
+			break;
+		case serialization_version_2:
+			break;
+		default:
+			positions.clear();
+			break;
+		}
+
+		return true;
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_COOKIE_HPP
@@ -0,0 +1,184 @@
+#ifndef __INDEXES_DICTIONARY_HPP
+#define __INDEXES_DICTIONARY_HPP
+
+#include "greylock/index.hpp"
+
+#include <stdint.h>
+#include <string>
+
+namespace ioremap { namespace greylock {
+
+// Per-mailbox dictionary of documents, which maps document ids to dense ordinals.
+//
+// Posting of the document which has an ordinal does not carry document id and url: its id is the ordinal id,
+// i.e. 8-byte big-endian ordinal, whose first byte is always zero (ids received from clients never contain
+// zero bytes), and its url is empty. Thus leaf keys are several times smaller, and since ordinal id
+// is exactly the key prefix (see @key::id_prefix), postings are ordered by integer comparisons only.
+// Original id and url are stored once in the dictionary and are only restored for the returned documents.
+//
+// Dictionary is an ordinary index with three kinds of keys:
+//	(timestamp, id) -> positions[0] is the ordinal of the document
+//	(timestamp, ordinal id + id) -> url is the url of the document, id is after the ordinal id
+//	(0, zero byte) -> positions[0] is the next ordinal to assign
+//
+// Caller has to serialize writers of the same dictionary.
+class document_dictionary {
+public:
+	document_dictionary(ebucket::bucket_processor &bp, const eurl &name) : m_bp(bp), m_name(name) {}
+
+	static const size_t ordinal_id_size = sizeof(uint64_t);
+
+	// ordinal must be less than 2^56
+	static std::string ordinal_id(uint64_t ordinal) {
+		std::string ret(ordinal_id_size, 0);
+		for (size_t i = 1; i < ordinal_id_size; ++i) {
+			ret[i] = (ordinal >> (56 - 8 * i)) & 0xff;
+		}
+
+		return ret;
+	}
+
+	static bool is_ordinal_id(const std::string &id) {
+		return (id.size() == ordinal_id_size) && (id[0] == 0);
+	}
+
+	// Turns @doc into the posting which references its ordinal,
+	// document which is already in the dictionary (with the same timestamp) keeps its ordinal.
+	// If @num_documents is not null, it is set to the number of documents which have been assigned ordinals
+	// (see @num_documents()), it is read from the same opened dictionary.
+	elliptics::error_info assign(key &doc, uint64_t *num_documents = NULL) {
+		read_write_index dict(m_bp, m_name);
+
+		key counter = counter_key();
+		key next = dict.search(counter);
+		uint64_t ordinal = (next && !next.positions.empty()) ? next.positions[0] : 0;
+		if (num_documents)
+			*num_documents = ordinal;
+
+		key found = dict.search(doc);
+		if (found && !found.positions.empty()) {
+			set_ordinal(doc, found.positions[0]);
+			return elliptics::error_info();
+		}
+
+		counter.positions.assign(1, ordinal + 1);
+		elliptics::error_info err = dict.insert(counter);
+		if (err)
+			return err;
+
+		key url;
+		url.timestamp = doc.timestamp;
+		url.id = ordinal_id(ordinal) + doc.id;
+		url.url = doc.url;
+		err = dict.insert(url);
+		if (err)
+			return err;
+
+		key id;
+		id.timestamp = doc.timestamp;
+		id.id = doc.id;
+		id.positions.assign(1, ordinal);
+		err = dict.insert(id);
+		if (err)
+			return err;
+
+		set_ordinal(doc, ordinal);
+		if (num_documents)
+			*num_documents = ordinal + 1;
+		return elliptics::error_info();
+	}
+
+	// removes document with given timestamp and id, its ordinal is never assigned again
+	elliptics::error_info erase(const key &doc) {
+		read_write_index dict(m_bp, m_name);
+
+		key found = dict.search(doc);
+		if (!found || found.positions.empty())
+			return elliptics::error_info();
+
+		key url;
+		url.timestamp = doc.timestamp;
+		url.id = ordinal_id(found.positions[0]) + doc.id;
+		elliptics::error_info err = dict.remove(url);
+		if (err && (err.code() != -ENOENT))
+			return err;
+
+		return dict.remove(found);
+	}
+
+	// the number of documents which have been assigned ordinals, zero if dictionary does not exist
+	uint64_t num_documents() const {
+		try {
+			read_only_index dict(m_bp, m_name);
+
+			key next = dict.search(counter_key());
+			if (next && !next.positions.empty())
+				return next.positions[0];
+		} catch (const std::exception &e) {
+		}
+
+		return 0;
+	}
+
+	// restores id and url of the document returned by intersection, document without ordinal is not changed
+	elliptics::error_info hydrate(key &doc) const {
+		if (!is_ordinal_id(doc.id))
+			return elliptics::error_info();
+
+		try {
+			read_only_index dict(m_bp, m_name);
+			return hydrate(dict, doc);
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-ENOENT, "dictionary: %s: could not open dictionary: %s",
+					m_name.str().c_str(), e.what());
+		}
+	}
+
+	// the same as above, but uses dictionary index which has already been opened by the caller,
+	// so that many documents of the same result are restored without reopening it
+	elliptics::error_info hydrate(const read_only_index &dict, key &doc) const {
+		if (!is_ordinal_id(doc.id))
+			return elliptics::error_info();
+
+		try {
+			// url key is the first one which is not less than the bare ordinal id
+			key start;
+			start.timestamp = doc.timestamp;
+			start.id = doc.id;
+
+			auto it = dict.begin(start);
+			if ((it == dict.end()) || (it->timestamp != doc.timestamp) ||
+					(it->id.compare(0, ordinal_id_size, doc.id) != 0)) {
+				return elliptics::create_error(-ENOENT, "dictionary: %s: there is no document %s",
+						m_name.str().c_str(), doc.str().c_str());
+			}
+
+			doc.url = it->url;
+			doc.set_id(it->id.substr(ordinal_id_size));
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EIO, "dictionary: %s: could not read document %s: %s",
+					m_name.str().c_str(), doc.str().c_str(), e.what());
+		}
+
+		return elliptics::error_info();
+	}
+
+private:
+	ebucket::bucket_processor &m_bp;
+	eurl m_name;
+
+	static key counter_key() {
+		key ret;
+		ret.id.assign(1, 0);
+		return ret;
+	}
+
+	static void set_ordinal(key &doc, uint64_t ordinal) {
+		doc.set_id(ordinal_id(ordinal));
+		doc.url = eurl();
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_DICTIONARY_HPP
@@ -0,0 +1,152 @@
+#ifndef __INDEXES_FILTER_HPP
+#define __INDEXES_FILTER_HPP
+
+#include "greylock/key.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Bloom filter over document ids of a single leaf page.
+//
+// Filter is rebuilt from the leaf keys every time leaf is written, so it never has stale ids
+// and its size follows the number of keys. Id lookup checks filters of all leaves of the index,
+// so false positives add up: @bits_per_key bits and @num_hashes probes give about 0.01% per leaf
+// at the cost of 2.5 bytes per key.
+struct id_filter {
+	enum {
+		bits_per_key = 20,
+		num_hashes = 14,
+	};
+
+	std::vector<uint64_t> bits;
+
+	MSGPACK_DEFINE(bits);
+
+	// filters are stored, hash must not depend on the platform or the standard library
+	static uint64_t hash(const std::string &id) {
+		uint64_t h = 14695981039346656037ULL;
+		for (auto c: id) {
+			h ^= (unsigned char)c;
+			h *= 1099511628211ULL;
+		}
+
+		// final mix of the bits, FNV-1a alone is weak in the upper bits used by the second probe hash
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	void assign(const std::vector<key> &keys) {
+		size_t num_bits = std::max<size_t>(64, keys.size() * bits_per_key);
+		bits.assign((num_bits + 63) / 64, 0);
+
+		for (const auto &k: keys) {
+			probe(k.id, [this] (size_t bit) {
+					bits[bit / 64] |= 1ULL << (bit % 64);
+					return true;
+				});
+		}
+	}
+
+	// returns false if there is no key with given @id in the leaf
+	bool may_contain(const std::string &id) const {
+		if (bits.empty())
+			return false;
+
+		return probe(id, [this] (size_t bit) {
+				return (bits[bit / 64] >> (bit % 64)) & 1;
+			});
+	}
+
+private:
+	// Calls @fn for every bit of the @id until it returns false.
+	// Bits are generated by enhanced double hashing: plain h1 + i * h2 repeats bits when h2 shares
+	// a divisor with the filter size, which is always a multiple of 64.
+	template <typename Fn>
+	bool probe(const std::string &id, const Fn &fn) const {
+		const uint64_t num_bits = bits.size() * 64;
+		const uint64_t h = hash(id);
+		uint64_t a = (h & 0xffffffff) % num_bits;
+		uint64_t b = (h >> 32) % num_bits;
+
+		for (uint64_t i = 0; i < num_hashes; ++i) {
+			if (!fn(a))
+				return false;
+
+			a = (a + b) % num_bits;
+			b = (b + i + 1) % num_bits;
+		}
+
+		return true;
+	}
+};
+
+// Filters of the leaves which belong to one shard of the index (see @index::enable_filters()),
+// leaf belongs to the shard selected by the hash of its url.
+struct filter_shard {
+	enum {
+		serialization_version_1 = 1,
+	};
+
+	int version = serialization_version_1;
+	std::vector<eurl> leaves;
+	std::vector<id_filter> filters;
+
+	MSGPACK_DEFINE(version, leaves, filters);
+
+	static size_t shard_of(const eurl &leaf, size_t num_shards) {
+		return id_filter::hash(leaf.key) % num_shards;
+	}
+
+	void set(const eurl &leaf, const std::vector<key> &keys) {
+		auto it = std::find(leaves.begin(), leaves.end(), leaf);
+		if (it == leaves.end()) {
+			leaves.push_back(leaf);
+			filters.emplace_back();
+			it = leaves.end() - 1;
+		}
+
+		filters[it - leaves.begin()].assign(keys);
+	}
+
+	void erase(const eurl &leaf) {
+		auto it = std::find(leaves.begin(), leaves.end(), leaf);
+		if (it == leaves.end())
+			return;
+
+		filters.erase(filters.begin() + (it - leaves.begin()));
+		leaves.erase(it);
+	}
+
+	// appends leaves which may host key with given @id to @ret
+	void candidates(const std::string &id, std::vector<eurl> &ret) const {
+		for (size_t i = 0; i < leaves.size(); ++i) {
+			if (filters[i].may_contain(id))
+				ret.push_back(leaves[i]);
+		}
+	}
+
+	std::string save() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+		return ss.str();
+	}
+
+	void load(const void *data, size_t size) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		result.get().convert(this);
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_FILTER_HPP
@@ -0,0 +1,235 @@
+#ifndef __INDEXES_FORWARD_HPP
+#define __INDEXES_FORWARD_HPP
+
+#include "greylock/dictionary.hpp"
+#include "greylock/index.hpp"
+
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Indexes of the document recorded in the forward index, it is stored in its own object next to the tree.
+struct forward_record {
+	enum {
+		serialization_version_1 = 1,
+	};
+
+	int version = serialization_version_1;
+	std::vector<eurl> indexes;
+
+	MSGPACK_DEFINE(version, indexes);
+
+	std::string save() const {
+		std::stringstream ss;
+		msgpack::pack(ss, *this);
+		return ss.str();
+	}
+
+	void load(const void *data, size_t size) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, (const char *)data, size);
+		result.get().convert(this);
+	}
+};
+
+// Per-mailbox forward index, which maps document ids to the indexes the document has been inserted into,
+// so that document can be removed without tokenizing it again.
+//
+// Forward index is an ordinary index with one key per document:
+//	(timestamp, id) -> url is the url of the document, positions[0] is the ordinal of the posting if it has one
+// the list of indexes is stored in the @forward_record object whose name is built from the key (see @record_key()),
+// thus indexing the document costs one tree insertion and one write no matter how many indexes it has.
+// Record is written before the key and removed after it.
+// Documents are found by id without timestamp with the help of the index filters (see @index::enable_filters()),
+// which are turned on when forward index is created.
+//
+// Caller has to serialize writers of the same forward index.
+class forward_index {
+public:
+	forward_index(ebucket::bucket_processor &bp, const eurl &name) : m_bp(bp), m_name(name) {}
+
+	struct document {
+		// document as it has been indexed
+		key doc;
+
+		// key inserted into every index of the document, it references ordinal if the document has one
+		key posting;
+
+		std::vector<eurl> indexes;
+	};
+
+	// records that @doc has been inserted into @indexes as @posting
+	elliptics::error_info insert(const key &doc, const key &posting, const std::vector<eurl> &indexes) {
+		read_write_index fwd(m_bp, m_name);
+
+		if (!fwd.has_filters()) {
+			elliptics::error_info err = fwd.enable_filters();
+			if (err)
+				return err;
+		}
+
+		key dk;
+		dk.timestamp = doc.timestamp;
+		dk.id = doc.id;
+		dk.url = doc.url;
+
+		uint64_t ordinal;
+		if (posting_ordinal(posting, &ordinal))
+			dk.positions.assign(1, ordinal);
+
+		forward_record rec;
+		rec.indexes = indexes;
+
+		const eurl rkey = record_key(dk);
+		elliptics::error_info err = written(io::write(m_bp, rkey, rec.save(), 0, false));
+		if (err) {
+			return elliptics::create_error(err.code(), "forward index: %s: could not write record %s: %s",
+					m_name.str().c_str(), rkey.str().c_str(), err.message().c_str());
+		}
+
+		return fwd.insert(dk);
+	}
+
+	// puts all documents with given @id into @ret, there are several if it has been indexed with different timestamps
+	elliptics::error_info find(const std::string &id, std::vector<document> &ret) const {
+		ret.clear();
+
+		std::unique_ptr<read_only_index> fwd;
+		try {
+			fwd.reset(new read_only_index(m_bp, m_name));
+		} catch (const std::exception &e) {
+			// there is no forward index, nothing has been indexed yet
+			return elliptics::error_info();
+		}
+
+		std::vector<key> docs;
+		elliptics::error_info err = fwd->find_id(id, docs);
+		if (err)
+			return err;
+
+		// records of all versions are read in parallel
+		std::vector<elliptics::async_read_result> reads;
+		for (const auto &dk: docs) {
+			reads.emplace_back(io::read_data(m_bp, record_key(dk), false));
+		}
+
+		for (size_t i = 0; i < docs.size(); ++i) {
+			const key &dk = docs[i];
+
+			document d;
+			d.doc.timestamp = dk.timestamp;
+			d.doc.id = dk.id;
+			d.doc.url = dk.url;
+
+			d.posting = d.doc;
+			if (!dk.positions.empty()) {
+				d.posting.id = document_dictionary::ordinal_id(dk.positions[0]);
+				d.posting.url = eurl();
+			}
+
+			forward_record rec;
+			err = load_record(dk, reads[i], rec);
+			if (err)
+				return err;
+
+			d.indexes = std::move(rec.indexes);
+			ret.emplace_back(std::move(d));
+		}
+
+		return elliptics::error_info();
+	}
+
+	// removes document found by @find()
+	elliptics::error_info remove(const document &d) {
+		read_write_index fwd(m_bp, m_name);
+
+		key dk;
+		dk.timestamp = d.doc.timestamp;
+		dk.id = d.doc.id;
+
+		elliptics::error_info err = fwd.remove(dk);
+		if (err)
+			return err;
+
+		io::remove(m_bp, record_key(dk)).wait();
+		return elliptics::error_info();
+	}
+
+	// removes all documents whose keys are within [@start, @end) range
+	elliptics::error_info remove_range(const key &start, const key &end, size_t *num_removed = NULL) {
+		read_write_index fwd(m_bp, m_name);
+
+		std::vector<eurl> records;
+		for (auto it = fwd.begin(start), e = fwd.end(); (it != e) && (*it < end); ++it) {
+			records.push_back(record_key(*it));
+		}
+
+		elliptics::error_info err = fwd.remove_range(start, end, num_removed);
+		if (err)
+			return err;
+
+		for (const auto &rkey: records) {
+			io::remove(m_bp, rkey).wait();
+		}
+
+		return elliptics::error_info();
+	}
+
+private:
+	ebucket::bucket_processor &m_bp;
+	eurl m_name;
+
+	eurl record_key(const key &dk) const {
+		eurl ret;
+		ret.bucket = m_name.bucket;
+		ret.key = "greylock.r." + m_name.key + "." + std::to_string(dk.timestamp) + "." + dk.id;
+		return ret;
+	}
+
+	static elliptics::error_info written(elliptics::async_write_result &&wr) {
+		elliptics::error_info last;
+		for (auto r = wr.begin(), end = wr.end(); r != end; ++r) {
+			if (!r->error())
+				return elliptics::error_info();
+
+			last = r->error();
+		}
+
+		return elliptics::create_error(last.code() ? last.code() : -ENOENT,
+				"there are no writeable groups, last error: %s", last.message().c_str());
+	}
+
+	elliptics::error_info load_record(const key &dk, elliptics::async_read_result &async, forward_record &rec) const {
+		const eurl rkey = record_key(dk);
+		if (async.error() || !async.is_valid()) {
+			return elliptics::create_error(async.error().code() ? async.error().code() : -ENOENT,
+					"forward index: %s: could not read record %s: %s [%d]",
+					m_name.str().c_str(), rkey.str().c_str(),
+					async.error().message().c_str(), async.error().code());
+		}
+
+		elliptics::read_result_entry ent = async.get_one();
+		if (ent.error() || !ent.is_valid()) {
+			return elliptics::create_error(ent.error().code() ? ent.error().code() : -ENOENT,
+					"forward index: %s: could not read record %s, entry: is_valid: %d, error: %s [%d]",
+					m_name.str().c_str(), rkey.str().c_str(), ent.is_valid(),
+					ent.error().message().c_str(), ent.error().code());
+		}
+
+		try {
+			rec.load(ent.file().data(), ent.file().size());
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "forward index: %s: failed to unpack record %s, data size: %ld: %s",
+					m_name.str().c_str(), rkey.str().c_str(), ent.file().size(), e.what());
+		}
+
+		return elliptics::error_info();
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_FORWARD_HPP
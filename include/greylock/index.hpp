@@ -1,11 +1,18 @@
 #ifndef __INDEXES_INDEX_HPP
 #define __INDEXES_INDEX_HPP
 
+#include "greylock/bitmap.hpp"
+#include "greylock/cookie.hpp"
+#include "greylock/filter.hpp"
 #include "greylock/io.hpp"
 #include "greylock/page.hpp"
 
 #include <atomic>
+#include <functional>
+#include <future>
 #include <map>
+#include <mutex>
+#include <set>
 
 namespace ioremap { namespace greylock {
 
@@ -15,9 +22,16 @@ typedef blackhole::wrapper_t<logger_base> logger;
 
 struct index_meta {
 	enum {
-		serialization_version_6 = 6
+		serialization_version_6 = 6,
+		serialization_version_7,
+		serialization_version_8,
+		serialization_version_9,
+		serialization_version_10,
 	};
 
+	// @max_positions of the index whose metadata was written before it has been tracked
+	static const unsigned long long max_positions_unknown = ~0ULL;
+
 	index_meta() {
 		page_index = 0;
 		num_pages = 0;
@@ -25,6 +39,9 @@ struct index_meta {
 		generation_number_sec = 0;
 		generation_number_nsec = 0;
 		num_keys = 0;
+		max_positions = 0;
+		dense = 0;
+		filter_shards = 0;
 	}
 
 	index_meta(const index_meta &o) {
@@ -38,6 +55,9 @@ struct index_meta {
 		generation_number_sec = o.generation_number_sec.load();
 		generation_number_nsec = o.generation_number_nsec.load();
 		num_keys = o.num_keys.load();
+		max_positions = o.max_positions.load();
+		dense = o.dense.load();
+		filter_shards = o.filter_shards.load();
 
 		return *this;
 	}
@@ -49,6 +69,24 @@ struct index_meta {
 	std::atomic<unsigned long long> generation_number_nsec;
 	std::atomic<unsigned long long> num_keys;
 
+	// the largest number of positions any key has ever been inserted with,
+	// it is not decreased when keys are removed, thus it is an upper bound of the term frequency
+	// of every document in the index.
+	// Metadata written by older version did not store it, keys inserted before the upgrade could have
+	// any number of positions, so such index gets @max_positions_unknown which is never updated.
+	std::atomic<unsigned long long> max_positions;
+
+	bool max_positions_known() const {
+		return max_positions != max_positions_unknown;
+	}
+
+	// non-zero if index keeps the bitmap of the ordinals of its documents next to the tree (see @index::make_dense())
+	std::atomic<unsigned long long> dense;
+
+	// the number of objects the per-leaf filters of document ids are spread over (see @index::enable_filters()),
+	// zero means index has no filters
+	std::atomic<unsigned long long> filter_shards;
+
 	void update_generation_number() {
 		struct timespec ts;
 		clock_gettime(CLOCK_REALTIME, &ts);
@@ -63,17 +101,38 @@ struct index_meta {
 				(num_leaf_pages != other.num_leaf_pages) ||
 				(generation_number_sec != other.generation_number_sec) ||
 				(generation_number_nsec != other.generation_number_nsec) ||
-				(num_keys != other.num_keys)
+				(num_keys != other.num_keys) ||
+				(max_positions != other.max_positions) ||
+				(dense != other.dense) ||
+				(filter_shards != other.filter_shards)
 			);
 	}
 
+	// Number of keys estimated for query planning.
+	// Older metadata did not store @num_keys, it is loaded as zero and is only updated since then,
+	// so it is only trusted when it is consistent with the number of leaf pages.
+	unsigned long long estimated_keys() const {
+		unsigned long long leaves = num_leaf_pages;
+		unsigned long long keys = num_keys;
+
+		// every leaf hosts at least one key, key can not be smaller than its timestamp
+		unsigned long long max_keys_per_leaf = max_page_size / sizeof(uint64_t) + 1;
+		if (keys >= leaves && keys <= leaves * max_keys_per_leaf)
+			return keys;
+
+		return leaves;
+	}
+
 	std::string str() const {
 		std::ostringstream ss;
 		ss << "page_index: " << page_index <<
 			", num_pages: " << num_pages <<
 			", num_leaf_pages: " << num_leaf_pages <<
 			", generation_number: " << generation_number_sec << "." << generation_number_nsec <<
-			", num_keys: " << num_keys
+			", num_keys: " << num_keys <<
+			", max_positions: " << max_positions <<
+			", dense: " << dense <<
+			", filter_shards: " << filter_shards
 			;
 		return ss.str();
 	}
@@ -87,6 +146,40 @@ struct recursion {
 struct remove_recursion {
 	key page_start;
 	bool removed = false;
+
+	// pages being processed at the upper levels, from the root down to the parent of the current page
+	std::vector<eurl> path;
+
+	// removed page can follow one of the pages in @path in the linked list of pages (the first leaf
+	// is linked to the internal page), that page keeps its own copy which is written back after the removal,
+	// so its new @next link is applied to that copy instead of the storage
+	eurl relink_page;
+	eurl relink_next;
+};
+
+struct range_removal {
+	// the first and the last removed page at every tree level, root level is 0,
+	// removed pages form contiguous run at every level, since removed keys are contiguous
+	std::vector<std::pair<eurl, eurl>> runs;
+
+	// pages are removed from the storage only after linked list has been fixed
+	std::vector<eurl> pages;
+
+	size_t num_keys = 0;
+	size_t num_leaf_pages = 0;
+
+	// leaves which are fully covered by the range are removed without being read,
+	// their keys are estimated by the average number of keys per leaf
+	size_t num_covered_leaves = 0;
+	double keys_per_leaf = 0;
+
+	// tree level of the leaves, it is known once the first leaf has been read, zero means unknown
+	size_t leaf_level = 0;
+
+	// ordinals of the removed documents, they are only collected for dense indexes
+	bool collect_ordinals = false;
+	std::vector<uint64_t> ordinals;
+	bool root_emptied = false;
 };
 
 static inline const char *greylock_print_time(const struct dnet_time *t, char *dst, int dsize)
@@ -108,12 +201,16 @@ public:
 			m_bp(bp), m_log(bp.logger()), m_index_name(sk), m_read_only(read_only) {
 		m_start_key = generate_start_key(m_index_name);
 		m_meta_key = generate_meta_key(m_index_name);
+		m_bitmap_key = generate_bitmap_key(m_index_name);
 
+		bool recovered = false;
 		if (!m_read_only) {
 			if (need_recovery()) {
 				elliptics::error_info err = index_recovery();
 				if (err)
 					err.throw_error();
+
+				recovered = true;
 			}
 		}
 
@@ -168,10 +265,35 @@ public:
 			elliptics::throw_error(-EINVAL, "failed to unpack start page: %s, data size: %ld",
 					meta_key().str().c_str(), file.size());
 		}
+
+		// bitmap and filters are written at destruction time, they may not match the recovered leaves
+		if (recovered && m_meta.dense)
+			bitmap_recovery();
+		if (recovered && m_meta.filter_shards)
+			filters_recovery();
+	}
+
+	// read-only index whose metadata has already been read, no storage operation is performed
+	index(ebucket::bucket_processor &bp, const eurl &sk, const index_meta &meta) :
+			m_bp(bp), m_log(bp.logger()), m_index_name(sk), m_read_only(true), m_meta(meta) {
+		m_start_key = generate_start_key(m_index_name);
+		m_meta_key = generate_meta_key(m_index_name);
+		m_bitmap_key = generate_bitmap_key(m_index_name);
 	}
 
 	~index() {
 		if (!m_read_only && m_modified) {
+			// sidecars are written before metadata, which tells whether they are valid,
+			// index whose bitmap or filters could not be written does not have them anymore
+			if (!m_bitmap_modified.empty() || m_bitmap_directory_modified) {
+				if (bitmap_write())
+					m_meta.dense = 0;
+			}
+			if (!m_filters_modified.empty()) {
+				if (filters_write())
+					m_meta.filter_shards = 0;
+			}
+
 			// only sync index metadata at destruction time for performance
 			meta_write();
 		}
@@ -181,12 +303,316 @@ public:
 		return m_meta;
 	}
 
+	// returns true if index did not exist and has been created by this object
+	bool created() const {
+		return m_created;
+	}
+
+	// Dense index keeps the set of ordinals of its documents (see @document_dictionary) in the bitmap
+	// stored next to the tree, so that intersection can check whether the index contains given document
+	// without descending the tree. Tree remains the only source of postings and positions,
+	// bitmap is maintained by every modification, postings without ordinal are not in the bitmap.
+	// Bitmap is stored sharded by its containers, i.e. by ranges of 65536 ordinals (see @ordinal_bitmap),
+	// modification only rewrites the containers of the ordinals it has added or removed.
+	bool dense() const {
+		return m_meta.dense != 0;
+	}
+
+	// builds the bitmap from all postings of the index and marks the index dense
+	elliptics::error_info make_dense() {
+		if (m_read_only)
+			return elliptics::create_error(-EPERM, "can not make read-only index %s dense", m_index_name.str().c_str());
+
+		auto bm = std::make_shared<ordinal_bitmap>();
+
+		uint64_t ordinal;
+		for (auto it = begin(), e = end(); it != e; ++it) {
+			if (posting_ordinal(*it, &ordinal))
+				bm->add(ordinal);
+		}
+
+		m_bitmap = std::move(bm);
+		for (const auto &c: m_bitmap->m_containers) {
+			m_bitmap_modified.insert(c.high);
+		}
+		m_bitmap_directory_modified = true;
+
+		elliptics::error_info err = bitmap_write();
+		if (err) {
+			m_bitmap.reset();
+			m_bitmap_modified.clear();
+			m_bitmap_directory_modified = false;
+			return err;
+		}
+
+		m_meta.dense = 1;
+		m_modified = true;
+
+		BH_LOG(m_log, INDEXES_LOG_INFO, "index: make_dense: %s: bitmap: %s, meta: %s",
+				m_index_name.str().c_str(), m_bitmap->str().c_str(), m_meta.str().c_str());
+		return elliptics::error_info();
+	}
+
+	typedef std::function<void (const elliptics::error_info &, const std::shared_ptr<const ordinal_bitmap> &)> bitmap_handler;
+
+	// reads bitmap of the dense index, @handler is called from elliptics I/O thread
+	//
+	// Directory is read first, then all containers are read in parallel.
+	// Bitmap written as a single object by older versions is read whole.
+	void bitmap_async(const bitmap_handler &handler) const {
+		if (!m_meta.dense) {
+			handler(elliptics::create_error(-ENOENT, "index: %s is not dense", m_index_name.str().c_str()),
+					std::shared_ptr<const ordinal_bitmap>());
+			return;
+		}
+
+		ebucket::bucket_processor &bp = m_bp;
+		const eurl name = m_index_name;
+		const eurl bkey = bitmap_key();
+		io::read_data_async(bp, bkey, false, [&bp, name, bkey, handler]
+				(const elliptics::error_info &err, const elliptics::data_pointer &data) {
+			if (err) {
+				handler(err, std::shared_ptr<const ordinal_bitmap>());
+				return;
+			}
+
+			auto bm = std::make_shared<ordinal_bitmap>();
+			ordinal_bitmap::directory dir;
+			try {
+				if (ordinal_bitmap::stored_version(data.data(), data.size()) == ordinal_bitmap::serialization_version_1) {
+					bm->load(data.data(), data.size());
+					handler(elliptics::error_info(), bm);
+					return;
+				}
+
+				dir.load(data.data(), data.size());
+			} catch (const std::exception &e) {
+				handler(elliptics::create_error(-EINVAL, "failed to unpack bitmap: %s, data size: %ld: %s",
+							bkey.str().c_str(), data.size(), e.what()), std::shared_ptr<const ordinal_bitmap>());
+				return;
+			}
+
+			if (dir.containers.empty()) {
+				bm->assign(std::vector<ordinal_bitmap::container>());
+				handler(elliptics::error_info(), bm);
+				return;
+			}
+
+			struct read_state {
+				std::mutex lock;
+				std::vector<ordinal_bitmap::container> containers;
+				size_t pending;
+				elliptics::error_info error;
+			};
+			auto rs = std::make_shared<read_state>();
+			rs->containers.resize(dir.containers.size());
+			rs->pending = dir.containers.size();
+
+			for (size_t i = 0; i < dir.containers.size(); ++i) {
+				const eurl ckey = generate_bitmap_container_key(name, dir.containers[i]);
+				io::read_data_async(bp, ckey, false, [rs, bm, i, ckey, handler]
+						(const elliptics::error_info &err, const elliptics::data_pointer &data) {
+					std::unique_lock<std::mutex> guard(rs->lock);
+					if (err) {
+						rs->error = err;
+					} else {
+						try {
+							ordinal_bitmap::load_container(data.data(), data.size(), rs->containers[i]);
+						} catch (const std::exception &e) {
+							rs->error = elliptics::create_error(-EINVAL,
+									"failed to unpack bitmap container: %s, data size: %ld: %s",
+									ckey.str().c_str(), data.size(), e.what());
+						}
+					}
+
+					if (--rs->pending != 0)
+						return;
+					guard.unlock();
+
+					if (rs->error) {
+						handler(rs->error, std::shared_ptr<const ordinal_bitmap>());
+						return;
+					}
+
+					bm->assign(std::move(rs->containers));
+					handler(elliptics::error_info(), bm);
+				});
+			}
+		});
+	}
+
+	// synchronous counterpart of @bitmap_async(), returns empty pointer if bitmap could not be read
+	std::shared_ptr<const ordinal_bitmap> bitmap() const {
+		std::promise<std::shared_ptr<const ordinal_bitmap>> promise;
+		std::future<std::shared_ptr<const ordinal_bitmap>> future = promise.get_future();
+
+		bitmap_async([&promise] (const elliptics::error_info &, const std::shared_ptr<const ordinal_bitmap> &bm) {
+				promise.set_value(bm);
+			});
+
+		return future.get();
+	}
+
+	// Index with filters keeps a Bloom filter of the document ids of every leaf page, filters are stored
+	// in @index_meta::filter_shards objects next to the tree, leaf belongs to the shard selected by the hash
+	// of its url. Filter of the leaf is rebuilt from its keys every time leaf is written, so only the shards
+	// of the written leaves are rewritten by the modification. Filters allow to check whether index contains
+	// given document and to find its keys without knowing the timestamp by reading only a few leaves,
+	// see @find_id().
+	bool has_filters() const {
+		return m_meta.filter_shards != 0;
+	}
+
+	// builds filters of all leaves, shards are sized by the current number of leaves,
+	// the same call rebuilds filters with more shards when index has grown (see @insert())
+	elliptics::error_info enable_filters() {
+		if (m_read_only)
+			return elliptics::create_error(-EPERM, "can not build filters of read-only index %s",
+					m_index_name.str().c_str());
+
+		size_t num_shards = std::max<size_t>(1, (m_meta.num_leaf_pages + filter_shard_leaves - 1) / filter_shard_leaves);
+
+		std::map<size_t, std::shared_ptr<filter_shard>> filters;
+		for (size_t i = 0; i < num_shards; ++i) {
+			filters[i] = std::make_shared<filter_shard>();
+		}
+
+		for (auto it = page_begin(), end = page_end(); it != end; ++it) {
+			if (it->is_leaf())
+				filters[filter_shard::shard_of(it.url(), num_shards)]->set(it.url(), it->objects);
+		}
+
+		m_filters = std::move(filters);
+		m_filters_modified.clear();
+		for (size_t i = 0; i < num_shards; ++i) {
+			m_filters_modified.insert(i);
+		}
+		m_meta.filter_shards = num_shards;
+
+		elliptics::error_info err = filters_write();
+		if (err) {
+			m_filters.clear();
+			m_filters_modified.clear();
+			m_meta.filter_shards = 0;
+			return err;
+		}
+
+		m_modified = true;
+
+		BH_LOG(m_log, INDEXES_LOG_INFO, "index: enable_filters: %s: meta: %s",
+				m_index_name.str().c_str(), m_meta.str().c_str());
+		return elliptics::error_info();
+	}
+
+	// returns false if index definitely has no key with given document @id,
+	// @id is the id of the posting, i.e. ordinal id if document has an ordinal (see @document_dictionary)
+	bool may_contain_id(const std::string &id) const {
+		if (!m_meta.filter_shards)
+			return true;
+
+		std::vector<eurl> leaves;
+		if (filter_candidates(id, leaves))
+			return true;
+
+		return !leaves.empty();
+	}
+
+	// Puts all keys with given document @id into @ret in key order, there are several keys
+	// if document has been inserted with different timestamps.
+	// Only leaves whose filters may contain @id are read, index without filters is scanned whole.
+	elliptics::error_info find_id(const std::string &id, std::vector<key> &ret) const {
+		ret.clear();
+
+		if (!m_meta.filter_shards) {
+			for (auto it = begin(), e = end(); it != e; ++it) {
+				if (it->id == id)
+					ret.push_back(*it);
+			}
+
+			return elliptics::error_info();
+		}
+
+		std::vector<eurl> leaves;
+		elliptics::error_info err = filter_candidates(id, leaves);
+		if (err)
+			return err;
+
+		for (const auto &url: leaves) {
+			page p;
+			err = page_reader::instance().read(m_bp, url, p);
+			if (err)
+				return err;
+
+			for (const auto &k: p.objects) {
+				if (k.id == id)
+					ret.push_back(k);
+			}
+		}
+
+		std::sort(ret.begin(), ret.end());
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: find_id: %s: id: %s, candidate leaves: %d, found keys: %d",
+				m_index_name.str().c_str(), id.c_str(), leaves.size(), ret.size());
+		return elliptics::error_info();
+	}
+
+	// removes all pages of the index and its metadata,
+	// this takes one storage operation per page instead of one tree traversal per key
+	//
+	// index object must not be used after this call
+	elliptics::error_info drop() {
+		if (m_read_only)
+			return elliptics::create_error(-EPERM, "can not drop read-only index %s", m_index_name.str().c_str());
+
+		std::vector<eurl> urls;
+		for (auto it = page_begin(), end = page_end(); it != end; ++it) {
+			urls.push_back(it.url());
+		}
+
+		for (auto it = urls.begin(), end = urls.end(); it != end; ++it) {
+			elliptics::error_info err = check(io::remove(m_bp, *it));
+			if (err) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: drop: %s: could not remove page %s: %s [%d]",
+						m_index_name.str().c_str(), it->str().c_str(), err.message().c_str(), err.code());
+				return err;
+			}
+		}
+
+		elliptics::error_info err = check(io::remove(m_bp, meta_key()));
+		if (err)
+			return err;
+
+		if (m_meta.dense) {
+			std::shared_ptr<const ordinal_bitmap> bm = m_bitmap;
+			if (!bm)
+				bm = bitmap();
+			if (bm) {
+				for (const auto &c: bm->m_containers) {
+					check(io::remove(m_bp, bitmap_container_key(c.high)));
+				}
+			}
+
+			check(io::remove(m_bp, bitmap_key()));
+		}
+		for (size_t i = 0; i < m_meta.filter_shards; ++i) {
+			check(io::remove(m_bp, filter_key(i)));
+		}
+
+		// there is no metadata to update at destruction time anymore
+		m_modified = false;
+
+		BH_LOG(m_log, INDEXES_LOG_INFO, "index: drop: %s: removed pages: %d, meta: %s",
+				m_index_name.str().c_str(), urls.size(), m_meta.str().c_str());
+		return elliptics::error_info();
+	}
+
 	const eurl &start_key() const {
 		return m_start_key;
 	}
 
 	key search(const key &obj) const {
-		auto found = search(start_key(), obj);
+		eurl unused;
+		auto found = search(start_key(), obj, unused);
 		if (found.second < 0)
 			return key();
 
@@ -211,7 +637,25 @@ public:
 		if (err)
 			return err;
 
+		unsigned long long num_positions = obj.positions.size();
+		if (m_meta.max_positions_known() && (num_positions > m_meta.max_positions))
+			m_meta.max_positions = num_positions;
+
+		uint64_t ordinal;
+		if (m_meta.dense && posting_ordinal(obj, &ordinal))
+			bitmap_update(ordinal, true);
+
 		m_meta.update_generation_number();
+
+		// shards are rewritten whole, keep them small when index grows
+		if (m_meta.filter_shards && (m_meta.num_leaf_pages > m_meta.filter_shards * filter_shard_leaves * 4)) {
+			elliptics::error_info ferr = enable_filters();
+			if (ferr) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: %s: could not rebuild filters: %s [%d]",
+						m_index_name.str().c_str(), ferr.message().c_str(), ferr.code());
+			}
+		}
+
 		return err;
 	}
 
@@ -233,21 +677,258 @@ public:
 		if (err)
 			return err;
 
+		uint64_t ordinal;
+		if (m_meta.dense && posting_ordinal(obj, &ordinal))
+			bitmap_update(ordinal, false);
+
 		m_meta.update_generation_number();
 		return err;
 	}
 
+	elliptics::error_info remove_range(const key &from, const key &to, size_t *num_removed = NULL) const {
+		(void) num_removed;
+		return elliptics::create_error(-EPERM, "can not remove range [%s, %s) from constant index",
+				from.str().c_str(), to.str().c_str());
+	}
+
+	// removes all keys within [@from, @to) range
+	//
+	// Tree is walked once, only subtrees which overlap with the range are read,
+	// pages which become empty are removed and unlinked from their parents, boundary pages are trimmed,
+	// every page is written at most once, and the linked list of pages is fixed once per tree level.
+	// Leaves which are fully covered by the range are not read (unless their ordinals are needed
+	// to update the bitmap of the dense index), so the number of removed keys is estimated for them,
+	// @num_removed and @index_meta::num_keys are approximate in this case.
+	elliptics::error_info remove_range(const key &from, const key &to, size_t *num_removed = NULL) {
+		if (m_read_only)
+			return elliptics::create_error(-EPERM, "can not remove range [%s, %s) from read-only index",
+					from.str().c_str(), to.str().c_str());
+
+		if (!(from < to))
+			return elliptics::error_info();
+
+		m_modified = true;
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "remove_range: start: sk: %s, range: [%s, %s)",
+				start_key().str().c_str(), from.str().c_str(), to.str().c_str());
+
+		range_removal rr;
+		rr.collect_ordinals = m_meta.dense;
+		if (m_meta.num_leaf_pages)
+			rr.keys_per_leaf = (double)m_meta.estimated_keys() / (double)m_meta.num_leaf_pages;
+		remove_recursion tmp;
+		elliptics::error_info err = remove_range(start_key(), from, to, 0, tmp, rr);
+		if (!err)
+			err = remove_range_unlink(rr);
+
+		size_t removed = rr.num_keys + (size_t)(rr.num_covered_leaves * rr.keys_per_leaf + 0.5);
+		removed = std::min<size_t>(removed, m_meta.num_keys);
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "remove_range: completed: sk: %s, range: [%s, %s), "
+				"removed keys: %d, covered leaves: %d, removed pages: %d, err: %s [%d]",
+				start_key().str().c_str(), from.str().c_str(), to.str().c_str(),
+				removed, rr.num_covered_leaves, rr.pages.size(), err.message(), err.code());
+
+		m_meta.num_keys -= removed;
+		if (removed || !rr.pages.empty())
+			m_meta.update_generation_number();
+
+		for (auto ordinal: rr.ordinals) {
+			bitmap_update(ordinal, false);
+		}
+
+		if (num_removed)
+			*num_removed = removed;
+
+		return err;
+	}
+
 	iterator begin(const std::string &k) const {
 		key zero;
 		zero.id = k;
 
-		auto found = search(start_key(), zero);
+		eurl unused;
+		auto found = search(start_key(), zero, unused);
 		if (found.second < 0)
 			found.second = 0;
 
 		return iterator(m_bp, found.first, found.second);
 	}
 
+	// returns iterator pointing to the first key which is not less than @k
+	iterator begin(const key &k) const {
+		eurl url;
+		auto found = search(start_key(), k, url);
+		return leaf_iterator(found.first, url, k);
+	}
+
+	// resumes iteration from the position saved in pagination cookie
+	//
+	// If index has not been modified since position was created, leaf page which hosts
+	// starting key is read directly, otherwise we have to descend from the root.
+	iterator begin(const index_position &pos) const {
+		if (!pos.start.url.empty() &&
+				(pos.generation_number_sec == m_meta.generation_number_sec) &&
+				(pos.generation_number_nsec == m_meta.generation_number_nsec)) {
+			page p;
+			elliptics::error_info err = page_reader::instance().read(m_bp, pos.start.url, p);
+			if (!err && p.is_leaf() && !p.is_empty() && (p.objects.front() <= pos.start)) {
+				BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: begin: %s: resuming from leaf: %s -> %s",
+						pos.str().c_str(), pos.start.url.str().c_str(), p.str().c_str());
+				return leaf_iterator(p, pos.start.url, pos.start);
+			}
+
+			BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: begin: %s: could not resume from leaf: %s -> %s, "
+					"error: %s [%d], falling back to tree search",
+					pos.str().c_str(), pos.start.url.str().c_str(), p.str().c_str(),
+					err.message().c_str(), err.code());
+		}
+
+		return begin(pos.start);
+	}
+
+	// returns position of the iterator, which can be saved into pagination cookie
+	// and later used to resume iteration via @begin(const index_position &)
+	index_position position(iterator &it) const {
+		return make_position(*it, it.url());
+	}
+
+	index_position position(reverse_iterator &it) const {
+		return make_position(*it, it.url());
+	}
+
+	// returns reverse iterator pointing to the largest key which is not greater than @k
+	reverse_iterator rbegin(const key &k) const {
+		eurl url;
+		auto found = search(start_key(), k, url);
+		return reverse_leaf_iterator(found.first, url, k);
+	}
+
+	// returns reverse iterator pointing to the last key in the index
+	reverse_iterator rbegin() const {
+		key last;
+		last.timestamp = ~0ULL;
+		return rbegin(last);
+	}
+
+	// resumes reverse iteration from the position saved in pagination cookie,
+	// leaf page is read directly if index has not been modified since position was created
+	reverse_iterator rbegin(const index_position &pos) const {
+		if (!pos.start.url.empty() &&
+				(pos.generation_number_sec == m_meta.generation_number_sec) &&
+				(pos.generation_number_nsec == m_meta.generation_number_nsec)) {
+			page p;
+			elliptics::error_info err = page_reader::instance().read(m_bp, pos.start.url, p);
+			if (!err && p.is_leaf() && !p.is_empty() && (p.objects.front() <= pos.start)) {
+				BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: rbegin: %s: resuming from leaf: %s -> %s",
+						pos.str().c_str(), pos.start.url.str().c_str(), p.str().c_str());
+				return reverse_leaf_iterator(p, pos.start.url, pos.start);
+			}
+
+			BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: rbegin: %s: could not resume from leaf: %s -> %s, "
+					"error: %s [%d], falling back to tree search",
+					pos.str().c_str(), pos.start.url.str().c_str(), p.str().c_str(),
+					err.message().c_str(), err.code());
+		}
+
+		return rbegin(pos.start);
+	}
+
+	reverse_iterator rend() const {
+		page p;
+		return reverse_iterator(m_bp, start_key(), p, eurl(), 0);
+	}
+
+	// Asynchronous counterparts of @begin() and @rbegin(): every page of the tree descent is read
+	// in elliptics callback of the previous read, so no thread waits for the storage.
+	// If the starting key lies past the found leaf, the neighbour leaf is read the same way,
+	// so the handler gets an iterator which does not need to read anything to be dereferenced.
+	// Handler is called from elliptics I/O thread, iterator points to the end if there was an error.
+	// Only positioning is asynchronous, returned iterator reads the next leaf synchronously when it crosses
+	// the leaf boundary, modifications (@insert(), @remove()) are synchronous as well.
+	//
+	// Index object must outlive the operation.
+	typedef std::function<void (const elliptics::error_info &, const iterator &)> iterator_handler;
+	typedef std::function<void (const elliptics::error_info &, const reverse_iterator &)> reverse_iterator_handler;
+
+	void begin_async(const std::string &k, const iterator_handler &handler) const {
+		key zero;
+		zero.id = k;
+
+		search_async(start_key(), zero, [this, handler] (const elliptics::error_info &err, page &p, int pos, const eurl &) {
+			if (err) {
+				handler(err, end());
+				return;
+			}
+
+			handler(err, iterator(m_bp, p, pos < 0 ? 0 : pos));
+		});
+	}
+
+	void begin_async(const key &k, const iterator_handler &handler) const {
+		search_async(start_key(), k, [this, k, handler] (const elliptics::error_info &err, page &p, int, const eurl &url) {
+			if (err) {
+				handler(err, end());
+				return;
+			}
+
+			leaf_iterator_async(p, url, k, handler);
+		});
+	}
+
+	void begin_async(const index_position &pos, const iterator_handler &handler) const {
+		resume_async(pos, [this, pos, handler] (page &p) {
+				if (p.is_empty()) {
+					begin_async(pos.start, handler);
+					return;
+				}
+
+				leaf_iterator_async(p, pos.start.url, pos.start, handler);
+			});
+	}
+
+	void rbegin_async(const key &k, const reverse_iterator_handler &handler) const {
+		search_async(start_key(), k, [this, k, handler] (const elliptics::error_info &err, page &p, int, const eurl &url) {
+			if (err) {
+				handler(err, rend());
+				return;
+			}
+
+			reverse_leaf_iterator_async(p, url, k, handler);
+		});
+	}
+
+	void rbegin_async(const index_position &pos, const reverse_iterator_handler &handler) const {
+		resume_async(pos, [this, pos, handler] (page &p) {
+				if (p.is_empty()) {
+					rbegin_async(pos.start, handler);
+					return;
+				}
+
+				reverse_leaf_iterator_async(p, pos.start.url, pos.start, handler);
+			});
+	}
+
+	typedef std::function<void (const elliptics::error_info &, std::vector<std::pair<eurl, page>> &&)> leaves_handler;
+
+	// reads all leaf pages of the index in key order following @next links, every leaf is read
+	// in the callback of the previous one, @handler gets leaves together with their urls
+	//
+	// Index object must outlive the operation.
+	void leaves_async(const leaves_handler &handler) const {
+		key zero;
+		search_async(start_key(), zero, [this, handler] (const elliptics::error_info &err, page &p, int, const eurl &url) {
+			std::vector<std::pair<eurl, page>> leaves;
+			if (err) {
+				handler(err, std::move(leaves));
+				return;
+			}
+
+			leaves.emplace_back(url, p);
+			next_leaves_async(std::make_shared<std::vector<std::pair<eurl, page>>>(std::move(leaves)), handler);
+		});
+	}
+
 	iterator begin() const {
 		return begin(std::string("\0"));
 	}
@@ -307,6 +988,18 @@ public:
 		return generate_greylock_key(index_name.bucket, "greylock.m", index_name.key);
 	}
 
+	static greylock::eurl generate_bitmap_key(const greylock::eurl &index_name) {
+		return generate_greylock_key(index_name.bucket, "greylock.b", index_name.key);
+	}
+
+	static greylock::eurl generate_bitmap_container_key(const greylock::eurl &index_name, uint64_t high) {
+		return generate_greylock_key(index_name.bucket, "greylock.bc", index_name.key + "." + std::to_string(high));
+	}
+
+	static greylock::eurl generate_filter_key(const greylock::eurl &index_name, size_t shard) {
+		return generate_greylock_key(index_name.bucket, "greylock.f", index_name.key + "." + std::to_string(shard));
+	}
+
 	static greylock::eurl generate_page_key(const std::string &bucket, const std::string &key) {
 		return generate_greylock_key(bucket, "greylock.p", key);
 	}
@@ -317,10 +1010,28 @@ private:
 	eurl m_index_name;
 	eurl m_start_key;
 	eurl m_meta_key;
+	eurl m_bitmap_key;
 
 	// when true, there was index modification, update its metadata
 	bool m_modified = false;
 
+	// bitmap of the dense index, it is read by the first modification, containers which have been modified
+	// are written at destruction time, directory is only written when containers have been created or removed
+	std::shared_ptr<ordinal_bitmap> m_bitmap;
+	std::set<uint64_t> m_bitmap_modified;
+	bool m_bitmap_directory_modified = false;
+
+	// filter shards which have been read or built by this object and those which have to be written
+	// at destruction time
+	std::map<size_t, std::shared_ptr<filter_shard>> m_filters;
+	std::set<size_t> m_filters_modified;
+
+	// the number of leaves per filter shard when filters are built
+	static const size_t filter_shard_leaves = 64;
+
+	// when true, index did not exist and has been created by this object
+	bool m_created = false;
+
 	// when true, metadata for new index will NOT be created and updated at destruction time
 	// should be TRUE for read-only indexes, for example for indexes created to read metadata
 	// or for search and indexes intersection
@@ -332,6 +1043,18 @@ private:
 		return m_meta_key;
 	}
 
+	const eurl &bitmap_key() const {
+		return m_bitmap_key;
+	}
+
+	eurl bitmap_container_key(uint64_t high) const {
+		return generate_bitmap_container_key(m_index_name, high);
+	}
+
+	eurl filter_key(size_t shard) const {
+		return generate_filter_key(m_index_name, shard);
+	}
+
 	static greylock::eurl generate_greylock_key(const std::string &bucket, const std::string &prefix, const std::string &key) {
 		char tmp[prefix.size() + 1 + key.size() + 1];
 		int sz = snprintf(tmp, sizeof(tmp), "%s.%s", prefix.c_str(), key.c_str());
@@ -354,29 +1077,252 @@ private:
 			return err;
 		}
 
-		std::ostringstream ss;
-		ss << m_index_name.key << "." << m_meta.page_index.fetch_add(1);
-		url = generate_page_key(bucket, ss.str());
+		std::ostringstream ss;
+		ss << m_index_name.key << "." << m_meta.page_index.fetch_add(1);
+		url = generate_page_key(bucket, ss.str());
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: generated key url: %s", url.str().c_str());
+		return elliptics::error_info();
+	}
+
+
+	void meta_write() {
+		std::stringstream ss;
+		msgpack::pack(ss, m_meta);
+
+		std::string ms = ss.str();
+		io::write(m_bp, meta_key(), ms, 0, true);
+
+		BH_LOG(m_log, INDEXES_LOG_INFO, "index: meta updated: key: %s, meta: %s, size: %d",
+				meta_key().str(), m_meta.str().c_str(), ms.size());
+	}
+
+	// Writes modified containers and then the directory if it has changed, so that directory never lists
+	// container which has not been written yet. Containers which have become empty are removed
+	// after the directory does not list them anymore.
+	elliptics::error_info bitmap_write() {
+		std::vector<uint64_t> removed;
+		size_t written = 0;
+
+		for (auto high: m_bitmap_modified) {
+			const ordinal_bitmap::container *c = m_bitmap->find_container(high);
+			if (!c) {
+				removed.push_back(high);
+				continue;
+			}
+
+			const eurl ckey = bitmap_container_key(high);
+			std::string data = ordinal_bitmap::save_container(*c);
+			elliptics::error_info err = check(io::write(m_bp, ckey, data, 0, true));
+			if (err) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: could not write bitmap container: key: %s, size: %d: %s [%d]",
+						ckey.str(), data.size(), err.message(), err.code());
+				return err;
+			}
+
+			written++;
+		}
+
+		if (m_bitmap_directory_modified) {
+			ordinal_bitmap::directory dir;
+			for (const auto &c: m_bitmap->m_containers) {
+				dir.containers.push_back(c.high);
+			}
+
+			std::string data = dir.save();
+			elliptics::error_info err = check(io::write(m_bp, bitmap_key(), data, 0, true));
+			if (err) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: could not write bitmap: key: %s, bitmap: %s, size: %d: %s [%d]",
+						bitmap_key().str(), m_bitmap->str().c_str(), data.size(), err.message(), err.code());
+				return err;
+			}
+		}
+
+		for (auto high: removed) {
+			check(io::remove(m_bp, bitmap_container_key(high)));
+		}
+
+		BH_LOG(m_log, INDEXES_LOG_INFO, "index: bitmap updated: key: %s, bitmap: %s, "
+				"containers written: %d, removed: %d, directory written: %d",
+				bitmap_key().str(), m_bitmap->str().c_str(), written, removed.size(), m_bitmap_directory_modified);
+
+		m_bitmap_modified.clear();
+		m_bitmap_directory_modified = false;
+		return elliptics::error_info();
+	}
+
+	// Adds or removes ordinal of the dense index, bitmap is read by the first update.
+	// Bitmap which can not be read is rebuilt from the tree, if that fails too,
+	// index is not dense anymore and intersection falls back to the tree.
+	void bitmap_update(uint64_t ordinal, bool add) {
+		if (!m_bitmap) {
+			std::shared_ptr<const ordinal_bitmap> bm = bitmap();
+			if (bm) {
+				m_bitmap = std::make_shared<ordinal_bitmap>(*bm);
+
+				// bitmap written as a single object by older versions is sharded by the first write
+				if (m_bitmap->version == ordinal_bitmap::serialization_version_1) {
+					for (const auto &c: m_bitmap->m_containers) {
+						m_bitmap_modified.insert(c.high);
+					}
+					m_bitmap_directory_modified = true;
+				}
+			} else if (make_dense()) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: %s: could not read or rebuild bitmap, index is not dense anymore",
+						m_index_name.str().c_str());
+				m_bitmap.reset();
+				m_meta.dense = 0;
+				return;
+			} else {
+				// rebuilt bitmap already reflects the tree
+				return;
+			}
+		}
+
+		size_t num_containers = m_bitmap->m_containers.size();
+		bool changed = add ? m_bitmap->add(ordinal) : m_bitmap->remove(ordinal);
+		if (!changed)
+			return;
+
+		m_bitmap_modified.insert(ordinal >> 16);
+		if (m_bitmap->m_containers.size() != num_containers)
+			m_bitmap_directory_modified = true;
+	}
+
+	// appends leaves whose filters may contain @id, shards which have not been read by this object
+	// are read in parallel
+	elliptics::error_info filter_candidates(const std::string &id, std::vector<eurl> &leaves) const {
+		std::vector<std::pair<size_t, elliptics::async_read_result>> reads;
+		for (size_t i = 0; i < m_meta.filter_shards; ++i) {
+			auto it = m_filters.find(i);
+			if (it != m_filters.end()) {
+				it->second->candidates(id, leaves);
+				continue;
+			}
+
+			reads.emplace_back(i, io::read_data(m_bp, filter_key(i), false));
+		}
+
+		for (auto &r: reads) {
+			filter_shard fs;
+			elliptics::error_info err = load_filter(r.first, r.second, fs);
+			if (err)
+				return err;
+
+			fs.candidates(id, leaves);
+		}
+
+		return elliptics::error_info();
+	}
+
+	elliptics::error_info load_filter(size_t shard, elliptics::async_read_result &async, filter_shard &fs) const {
+		const eurl fkey = filter_key(shard);
+		if (async.error() || !async.is_valid()) {
+			return elliptics::create_error(async.error().code() ? async.error().code() : -ENOENT,
+					"index: %s: could not read filter shard %s: %s [%d]",
+					m_index_name.str().c_str(), fkey.str().c_str(),
+					async.error().message().c_str(), async.error().code());
+		}
+
+		elliptics::read_result_entry ent = async.get_one();
+		if (ent.error() || !ent.is_valid()) {
+			return elliptics::create_error(ent.error().code() ? ent.error().code() : -ENOENT,
+					"index: %s: could not read filter shard %s, entry: is_valid: %d, error: %s [%d]",
+					m_index_name.str().c_str(), fkey.str().c_str(), ent.is_valid(),
+					ent.error().message().c_str(), ent.error().code());
+		}
+
+		try {
+			fs.load(ent.file().data(), ent.file().size());
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "index: %s: failed to unpack filter shard %s, data size: %ld: %s",
+					m_index_name.str().c_str(), fkey.str().c_str(), ent.file().size(), e.what());
+		}
+
+		return elliptics::error_info();
+	}
+
+	elliptics::error_info filters_write() {
+		for (auto shard: m_filters_modified) {
+			const eurl fkey = filter_key(shard);
+			const auto &fs = m_filters[shard];
+
+			std::string data = fs->save();
+			elliptics::error_info err = check(io::write(m_bp, fkey, data, 0, true));
+			if (err) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: could not write filter shard: key: %s, leaves: %d, size: %d: %s [%d]",
+						fkey.str(), fs->leaves.size(), data.size(), err.message(), err.code());
+				return err;
+			}
+
+			BH_LOG(m_log, INDEXES_LOG_INFO, "index: filter shard updated: key: %s, leaves: %d, size: %d",
+					fkey.str(), fs->leaves.size(), data.size());
+		}
+
+		m_filters_modified.clear();
+		return elliptics::error_info();
+	}
+
+	// Sets filter of the leaf page @p at @url, @p is NULL when page is removed.
+	// Shard is read by the first update, if it can not be read, index does not have filters anymore
+	// and @find_id() falls back to the scan, filters are rebuilt by @enable_filters().
+	void filter_update(const eurl &url, const page *p) {
+		if (!m_meta.filter_shards)
+			return;
+
+		size_t shard = filter_shard::shard_of(url, m_meta.filter_shards);
+
+		auto it = m_filters.find(shard);
+		if (it == m_filters.end()) {
+			auto fs = std::make_shared<filter_shard>();
+
+			elliptics::async_read_result async = io::read_data(m_bp, filter_key(shard), false);
+			elliptics::error_info err = load_filter(shard, async, *fs);
+			if (err) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: %s: %s, index does not have filters anymore",
+						m_index_name.str().c_str(), err.message().c_str());
+				m_filters.clear();
+				m_filters_modified.clear();
+				m_meta.filter_shards = 0;
+				return;
+			}
+
+			it = m_filters.insert(std::make_pair(shard, fs)).first;
+		}
+
+		if (p)
+			it->second->set(url, p->objects);
+		else
+			it->second->erase(url);
 
-		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: generated key url: %s", url.str().c_str());
-		return elliptics::error_info();
+		m_filters_modified.insert(shard);
 	}
 
+	// every tree page whose keys have been changed is written and removed by these helpers, which also maintain filters,
+	// inner pages never have filters since page url is never reused by the page of the other kind
+	elliptics::error_info write_page(const eurl &url, const page &p, bool cache) {
+		elliptics::error_info err = check(io::write(m_bp, url, p.save(), default_reserve_size, cache));
+		if (err)
+			return err;
 
-	void meta_write() {
-		std::stringstream ss;
-		msgpack::pack(ss, m_meta);
+		if (p.is_leaf())
+			filter_update(url, &p);
+		return elliptics::error_info();
+	}
 
-		std::string ms = ss.str();
-		io::write(m_bp, meta_key(), ms, 0, true);
+	elliptics::error_info remove_page(const eurl &url) {
+		elliptics::error_info err = check(io::remove(m_bp, url));
+		if (err)
+			return err;
 
-		BH_LOG(m_log, INDEXES_LOG_INFO, "index: meta updated: key: %s, meta: %s, size: %d",
-				meta_key().str(), m_meta.str().c_str(), ms.size());
+		filter_update(url, NULL);
+		return elliptics::error_info();
 	}
 
 	void start_page_init() {
 		page start_page;
 		m_modified = true;
+		m_created = true;
 
 		BH_LOG(m_log, INDEXES_LOG_INFO, "index: writing start page: %s", start_key().str());
 		io::write(m_bp, start_key(), start_page.save(), 0, true);
@@ -416,6 +1362,43 @@ private:
 		return elliptics::error_info();
 	}
 
+	// rebuilds bitmap from the recovered leaves, if that fails, index is not dense anymore
+	// and intersection checks the tree instead of the bitmap
+	void bitmap_recovery() {
+		elliptics::error_info err = make_dense();
+		if (err) {
+			BH_LOG(m_log, INDEXES_LOG_ERROR, "index: %s: could not rebuild bitmap after recovery: %s [%d], "
+					"index is not dense anymore",
+					m_index_name.str().c_str(), err.message().c_str(), err.code());
+
+			// metadata of not dense index is written at destruction time
+			m_meta.dense = 0;
+			m_modified = true;
+			return;
+		}
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: %s: bitmap has been rebuilt after recovery: %s",
+				m_index_name.str().c_str(), m_bitmap->str().c_str());
+	}
+
+	// rebuilds filters from the recovered leaves, if that fails, filters are dropped
+	// and @find_id() falls back to the scan until @enable_filters() is called again
+	void filters_recovery() {
+		elliptics::error_info err = enable_filters();
+		if (err) {
+			BH_LOG(m_log, INDEXES_LOG_ERROR, "index: %s: could not rebuild filters after recovery: %s [%d], "
+					"index does not have filters anymore",
+					m_index_name.str().c_str(), err.message().c_str(), err.code());
+
+			// metadata without filters is written at destruction time
+			m_modified = true;
+			return;
+		}
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: %s: filters have been rebuilt after recovery: shards: %d",
+				m_index_name.str().c_str(), m_meta.filter_shards.load());
+	}
+
 	bool need_recovery() {
 		elliptics::async_lookup_result lookup = io::prepare_latest(m_bp, start_key());
 		lookup.wait();
@@ -461,28 +1444,183 @@ private:
 	}
 
 
-	std::pair<page, int> search(const eurl &page_key, const key &obj) const {
+	elliptics::error_info read_page(const eurl &page_key, page &p) const {
 		elliptics::async_read_result async = io::read_data(m_bp, page_key, false);
-		elliptics::read_result_entry ent = async.get_one();
-
 		if (async.error() || !async.is_valid()) {
-			BH_LOG(m_log, INDEXES_LOG_ERROR, "index: search: %s: page: %s, could not read page, "
+			return elliptics::create_error(async.error().code(), "index: read_page: %s: could not read page, "
 					"async: is_valid: %d, error: %s [%d]",
-				obj.str().c_str(), page_key.str().c_str(),
-				async.is_valid(), async.error().message(), async.error().code());
-			return std::make_pair(page(), async.error().code());
+					page_key.str().c_str(), async.is_valid(),
+					async.error().message().c_str(), async.error().code());
 		}
 
+		elliptics::read_result_entry ent = async.get_one();
 		if (ent.error() || !ent.is_valid()) {
-			BH_LOG(m_log, INDEXES_LOG_ERROR, "index: search: %s: page: %s, could not read page, "
-					"entry: is_valid: %d, error: %s [%d]",
-				obj.str().c_str(), page_key.str().c_str(),
-				ent.is_valid(), ent.error().message(), ent.error().code());
-			return std::make_pair(page(), ent.error().code());
+			return elliptics::create_error(ent.error().code() ? ent.error().code() : -ENOENT,
+					"index: read_page: %s: could not read page, entry: is_valid: %d, error: %s [%d]",
+					page_key.str().c_str(), ent.is_valid(),
+					ent.error().message().c_str(), ent.error().code());
 		}
 
-		page p;
 		p.load(ent.file().data(), ent.file().size());
+		return elliptics::error_info();
+	}
+
+	index_position make_position(const key &k, const eurl &leaf_url) const {
+		index_position pos;
+		pos.start.id = k.id;
+		pos.start.timestamp = k.timestamp;
+		pos.start.url = leaf_url;
+		pos.generation_number_sec = m_meta.generation_number_sec;
+		pos.generation_number_nsec = m_meta.generation_number_nsec;
+		return pos;
+	}
+
+	// reads page at @page_url, calls @update() and writes it back,
+	// it is used to update links in the neighbour pages, their keys and filters are not changed
+	elliptics::error_info update_page(const eurl &page_url, const std::function<void (page &)> &update) {
+		page p;
+		elliptics::error_info err = read_page(page_url, p);
+		if (err)
+			return err;
+
+		update(p);
+
+		return check(io::write(m_bp, page_url, p.save(), default_reserve_size, true));
+	}
+
+	// creates reverse iterator pointing to the largest key in the leaf page @p which is not greater than @k,
+	// if all keys in given leaf are greater than @k, iterator will point to the end of the previous page
+	reverse_iterator reverse_leaf_iterator(page &p, const eurl &url, const key &k) const {
+		if (!p.is_leaf())
+			return rend();
+
+		auto it = std::upper_bound(p.objects.begin(), p.objects.end(), k);
+		return reverse_iterator(m_bp, start_key(), p, url, (it - p.objects.begin()) - 1);
+	}
+
+	// creates iterator pointing to the first key in the leaf page @p which is not less than @k,
+	// if all keys in given leaf are less than @k, iterator will point to the beginning of the next page
+	iterator leaf_iterator(page &p, const eurl &url, const key &k) const {
+		if (!p.is_leaf())
+			return iterator(m_bp, p, url, 0);
+
+		auto it = std::lower_bound(p.objects.begin(), p.objects.end(), k);
+		return iterator(m_bp, p, url, it - p.objects.begin());
+	}
+
+	// the same as @leaf_iterator(), but if all keys in the leaf are less than @k,
+	// the next leaf is read asynchronously instead of by the iterator constructor
+	void leaf_iterator_async(page &p, const eurl &url, const key &k, const iterator_handler &handler) const {
+		size_t pos = 0;
+		if (p.is_leaf())
+			pos = std::lower_bound(p.objects.begin(), p.objects.end(), k) - p.objects.begin();
+
+		if (!p.is_leaf() || (pos < p.objects.size()) || p.next.empty()) {
+			handler(elliptics::error_info(), iterator(m_bp, p, url, pos));
+			return;
+		}
+
+		const eurl next = p.next;
+		page_reader::instance().read_async(m_bp, next, [this, next, handler]
+				(const elliptics::error_info &err, const std::shared_ptr<const page> &loaded) {
+			if (err) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: leaf_iterator_async: %s: could not read next leaf: %s: %s [%d]",
+						m_index_name.str().c_str(), next.str().c_str(), err.message(), err.code());
+				handler(err, end());
+				return;
+			}
+
+			page np = *loaded;
+			handler(err, iterator(m_bp, np, next, 0));
+		});
+	}
+
+	// the same as @reverse_leaf_iterator(), but if all keys in the leaf are greater than @k,
+	// the previous leaf is read asynchronously instead of by the iterator constructor
+	void reverse_leaf_iterator_async(page &p, const eurl &url, const key &k,
+			const reverse_iterator_handler &handler) const {
+		if (!p.is_leaf()) {
+			handler(elliptics::error_info(), rend());
+			return;
+		}
+
+		ssize_t pos = (std::upper_bound(p.objects.begin(), p.objects.end(), k) - p.objects.begin()) - 1;
+		if ((pos >= 0) || p.is_empty()) {
+			handler(elliptics::error_info(), reverse_iterator(m_bp, start_key(), p, url, pos));
+			return;
+		}
+
+		// leaf written in older format does not have @prev link, see @reverse_iterator
+		if (p.prev.empty()) {
+			prev_leaf_async(start_key(), p.objects.front(), handler);
+			return;
+		}
+
+		const eurl prev = p.prev;
+		page_reader::instance().read_async(m_bp, prev, [this, prev, handler]
+				(const elliptics::error_info &err, const std::shared_ptr<const page> &loaded) {
+			if (err) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: reverse_leaf_iterator_async: %s: "
+						"could not read previous leaf: %s: %s [%d]",
+						m_index_name.str().c_str(), prev.str().c_str(), err.message(), err.code());
+				handler(err, rend());
+				return;
+			}
+
+			// previous page in the linked list is not a leaf, i.e. this was the first leaf
+			if (!loaded->is_leaf()) {
+				handler(err, rend());
+				return;
+			}
+
+			page pp = *loaded;
+			handler(err, reverse_iterator(m_bp, start_key(), pp, prev, (ssize_t)pp.objects.size() - 1));
+		});
+	}
+
+	// descends from @page_key to the largest key which is less than @k, every page is read
+	// in the callback of the previous read, it is an asynchronous counterpart of @reverse_iterator::load_prev_from_root()
+	void prev_leaf_async(const eurl &page_key, const key &k, const reverse_iterator_handler &handler) const {
+		page_reader::instance().read_async(m_bp, page_key, [this, page_key, k, handler]
+				(const elliptics::error_info &err, const std::shared_ptr<const page> &loaded) {
+			if (err) {
+				handler(err, rend());
+				return;
+			}
+
+			// every internal key is the first key of the appropriate child,
+			// keys less than @k live in the child preceding the first internal key not less than @k
+			auto it = std::lower_bound(loaded->objects.begin(), loaded->objects.end(), k);
+			if (it == loaded->objects.begin()) {
+				handler(err, rend());
+				return;
+			}
+
+			if (loaded->is_leaf()) {
+				ssize_t pos = (it - loaded->objects.begin()) - 1;
+				page p = *loaded;
+				handler(err, reverse_iterator(m_bp, start_key(), p, page_key, pos));
+				return;
+			}
+
+			--it;
+			prev_leaf_async(it->url, k, handler);
+		});
+	}
+
+	// @url will be set to the url of the last page read,
+	// which is the leaf page where @obj lives or should live
+	std::pair<page, int> search(const eurl &page_key, const key &obj, eurl &url) const {
+		url = page_key;
+
+		// concurrent searches share reads of the same page
+		page p;
+		elliptics::error_info err = page_reader::instance().read(m_bp, page_key, p);
+		if (err) {
+			BH_LOG(m_log, INDEXES_LOG_ERROR, "index: search: %s: page: %s, could not read page: %s [%d]",
+				obj.str().c_str(), page_key.str().c_str(), err.message(), err.code());
+			return std::make_pair(page(), err.code());
+		}
 
 		int found_pos = p.search_node(obj);
 		if (found_pos < 0) {
@@ -502,7 +1640,90 @@ private:
 		if (p.is_leaf())
 			return std::make_pair(p, found_pos);
 
-		return search(p.objects[found_pos].url, obj);
+		return search(p.objects[found_pos].url, obj, url);
+	}
+
+	typedef std::function<void (const elliptics::error_info &, page &, int, const eurl &)> search_handler;
+
+	// the same as @search(), but every next page is requested from the callback of the previous read,
+	// @handler gets the leaf page, position of @obj within it and its url
+	void search_async(const eurl &page_key, const key &obj, const search_handler &handler) const {
+		page_reader::instance().read_async(m_bp, page_key, [this, page_key, obj, handler]
+				(const elliptics::error_info &err, const std::shared_ptr<const page> &loaded) {
+			page p;
+			if (!err)
+				p = *loaded;
+
+			if (err) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: search_async: %s: page: %s, could not read page: %s [%d]",
+					obj.str().c_str(), page_key.str().c_str(), err.message(), err.code());
+				handler(err, p, err.code(), page_key);
+				return;
+			}
+
+			int found_pos = p.search_node(obj);
+			if ((found_pos < 0) || p.is_leaf()) {
+				handler(err, p, found_pos, page_key);
+				return;
+			}
+
+			search_async(p.objects[found_pos].url, obj, handler);
+		});
+	}
+
+	void next_leaves_async(const std::shared_ptr<std::vector<std::pair<eurl, page>>> &leaves,
+			const leaves_handler &handler) const {
+		const eurl next = leaves->back().second.next;
+		if (next.empty() || !leaves->back().second.is_leaf()) {
+			handler(elliptics::error_info(), std::move(*leaves));
+			return;
+		}
+
+		page_reader::instance().read_async(m_bp, next, [this, next, leaves, handler]
+				(const elliptics::error_info &err, const std::shared_ptr<const page> &loaded) {
+			if (err) {
+				BH_LOG(m_log, INDEXES_LOG_ERROR, "index: leaves_async: %s: could not read leaf: %s: %s [%d]",
+						m_index_name.str().c_str(), next.str().c_str(), err.message(), err.code());
+				leaves->clear();
+				handler(err, std::move(*leaves));
+				return;
+			}
+
+			leaves->emplace_back(next, *loaded);
+			next_leaves_async(leaves, handler);
+		});
+	}
+
+	// reads leaf page saved in the pagination cookie if index has not been modified since then,
+	// @handler gets empty page if iteration can not be resumed from that leaf and tree search is needed
+	void resume_async(const index_position &pos, const std::function<void (page &)> &handler) const {
+		if (pos.start.url.empty() ||
+				(pos.generation_number_sec != m_meta.generation_number_sec) ||
+				(pos.generation_number_nsec != m_meta.generation_number_nsec)) {
+			page p;
+			handler(p);
+			return;
+		}
+
+		page_reader::instance().read_async(m_bp, pos.start.url, [this, pos, handler]
+				(const elliptics::error_info &err, const std::shared_ptr<const page> &loaded) {
+			page p;
+			if (!err)
+				p = *loaded;
+
+			if (err || !p.is_leaf() || p.is_empty() || !(p.objects.front() <= pos.start)) {
+				BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: resume_async: %s: could not resume from leaf: %s -> %s, "
+						"error: %s [%d], falling back to tree search",
+						pos.str().c_str(), pos.start.url.str().c_str(), p.str().c_str(),
+						err.message().c_str(), err.code());
+
+				page empty;
+				handler(empty);
+				return;
+			}
+
+			handler(p);
+		});
 	}
 
 	// returns true if page at @page_key has been split after insertion
@@ -562,7 +1783,8 @@ private:
 				leaf.insert_and_split(obj, unused_split, replaced);
 				if (!replaced)
 					m_meta.num_keys++;
-				err = check(io::write(m_bp, leaf_key.url, leaf.save(), default_reserve_size, true));
+				leaf.prev = page_key;
+				err = write_page(leaf_key.url, leaf, true);
 				if (err)
 					return err;
 
@@ -571,7 +1793,7 @@ private:
 				// do not increment @num_keys since it is not a leaf page
 				p.insert_and_split(leaf_key, unused_split, replaced);
 				p.next = leaf_key.url;
-				err = check(io::write(m_bp, page_key, p.save(), default_reserve_size, true));
+				err = write_page(page_key, p, true);
 				if (err)
 					return err;
 
@@ -608,7 +1830,7 @@ private:
 			if (found != rec.page_start) {
 				BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: p: %s: replace: key: %s: id: %s -> %s",
 					p.str().c_str(), found.str().c_str(), found.id.c_str(), rec.page_start.id.c_str());
-				found.id = rec.page_start.id;
+				found.set_id(rec.page_start.id);
 				found.timestamp = rec.page_start.timestamp;
 
 				// page has been changed, it must be written into storage
@@ -640,6 +1862,8 @@ private:
 		rec.page_start = p.objects.front();
 		rec.split_key = key();
 
+		key old_root_key;
+
 		if (!split.is_empty()) {
 			// generate key for split page
 			rec.split_key = split.objects.front();
@@ -647,20 +1871,49 @@ private:
 			if (err)
 				return err;
 
+			// url where current page will be written, it is only different from @page_key
+			// when root page is split and its content is moved to the new key below
+			eurl p_url = page_key;
+
+			if (page_key == start_key()) {
+				old_root_key = p.objects.front();
+				err = generate_page_url(old_root_key.url);
+				if (err)
+					return err;
+
+				p_url = old_root_key.url;
+
+				// new root will precede old root in the linked list of pages
+				p.prev = start_key();
+			}
+
 			split.next = p.next;
+			split.prev = p_url;
 			p.next = rec.split_key.url;
 
 			BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: insert: %s: write split page: %s -> %s, split: key: %s -> %s",
 					obj.str().c_str(),
 					page_key.str().c_str(), p.str().c_str(),
 					rec.split_key.str().c_str(), split.str().c_str());
-			err = check(io::write(m_bp, rec.split_key.url, split.save(), default_reserve_size, true));
+			err = write_page(rec.split_key.url, split, true);
 			if (err)
 				return err;
 
 			m_meta.num_pages++;
 			if (p.is_leaf())
 				m_meta.num_leaf_pages++;
+
+			if (!split.next.empty()) {
+				const eurl &split_url = rec.split_key.url;
+				err = update_page(split.next, [&] (page &next) { next.prev = split_url; });
+				if (err) {
+					BH_LOG(m_log, INDEXES_LOG_ERROR, "index: insert: %s: could not update prev link "
+							"in the page following split page: %s -> %s: %s [%d]",
+							obj.str().c_str(), split.next.str().c_str(), split_url.str().c_str(),
+							err.message().c_str(), err.code());
+					return err;
+				}
+			}
 		}
 
 		if (!split.is_empty() && page_key == start_key()) {
@@ -669,13 +1922,7 @@ private:
 			// generate new root, which will host data for 2 new pages:
 			// split and old root
 
-			key old_root_key;
-			old_root_key = p.objects.front();
-			err = generate_page_url(old_root_key.url);
-			if (err)
-				return err;
-
-			err = check(io::write(m_bp, old_root_key.url, p.save(), default_reserve_size, true));
+			err = write_page(old_root_key.url, p, true);
 			if (err)
 				return err;
 
@@ -689,7 +1936,7 @@ private:
 
 			new_root.next = new_root.objects.front().url;
 
-			err = check(io::write(m_bp, start_key(), new_root.save(), default_reserve_size, true));
+			err = write_page(start_key(), new_root, true);
 			if (err)
 				return err;
 
@@ -704,7 +1951,7 @@ private:
 		} else {
 			BH_LOG(m_log, INDEXES_LOG_NOTICE, "insert: %s: write main page: %s -> %s",
 				obj.str().c_str(), page_key.str().c_str(), p.str().c_str());
-			err = check(io::write(m_bp, page_key, p.save(), default_reserve_size, true));
+			err = write_page(page_key, p, true);
 		}
 
 		return err;
@@ -763,27 +2010,40 @@ private:
 			page_key.str().c_str(), p.str().c_str(),
 			found_pos, found.str().c_str());
 
-		if (p.is_leaf() || rec.removed) {
-			if (p.is_leaf())
-				p.remove(found_pos);
+		if (p.is_leaf()) {
+			p.remove(found_pos);
 			m_meta.num_keys--;
 		} else {
+			rec.path.push_back(page_key);
 			err = remove(found.url, obj, rec);
+			rec.path.pop_back();
 			if (err)
 				return err;
 
-			// we have removed key from the underlying page, and the first key of that page hasn't been changed
-			if (!rec.page_start)
-				return elliptics::error_info();
+			bool relinked = false;
+			if (!rec.relink_page.empty() && (rec.relink_page == page_key)) {
+				p.next = rec.relink_next;
+				rec.relink_page = eurl();
+				rec.relink_next = eurl();
+				relinked = true;
+			}
 
-			key found = p.objects[found_pos];
+			if (rec.removed) {
+				// underlying page has become empty and has been removed, drop its link from the current page
+				p.remove(found_pos);
+			} else if (rec.page_start) {
+				key found = p.objects[found_pos];
 
-			// the first key of the underlying page has been changed, update appropriate key in the current page
-			// @url must be saved, but @id and @timestmap have to be copied, since they have been changed
-			found.id = rec.page_start.id;
-			found.timestamp = rec.page_start.timestamp;
+				// the first key of the underlying page has been changed, update appropriate key in the current page
+				// @url must be saved, but @id and @timestmap have to be copied, since they have been changed
+				found.set_id(rec.page_start.id);
+				found.timestamp = rec.page_start.timestamp;
 
-			p.objects[found_pos] = found;
+				p.objects[found_pos] = found;
+			} else if (!relinked) {
+				// we have removed key from the underlying page, and the first key of that page hasn't been changed
+				return elliptics::error_info();
+			}
 		}
 
 		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: remove: %s: returned: %s -> %s, found_pos: %d, found_key: %s",
@@ -801,14 +2061,35 @@ private:
 				rec.page_start = p.objects.front();
 			}
 
-			err = check(io::write(m_bp, page_key, p.save(), default_reserve_size, 0));
+			err = write_page(page_key, p, false);
+			if (err)
+				return err;
+		} else if (page_key == start_key()) {
+			// root page is never removed, the whole tree is empty now
+			page start_page;
+			err = write_page(page_key, start_page, false);
 			if (err)
 				return err;
 		} else {
 			// if current page is empty, we have to remove appropriate link from the higher page
 			rec.removed = true;
 
-			err = check(io::remove(m_bp, page_key));
+			// exclude removed page from the linked list of pages
+			if (!p.prev.empty() && (std::find(rec.path.begin(), rec.path.end(), p.prev) != rec.path.end())) {
+				rec.relink_page = p.prev;
+				rec.relink_next = p.next;
+			} else if (!p.prev.empty()) {
+				err = update_page(p.prev, [&] (page &prev) { prev.next = p.next; });
+				if (err)
+					return err;
+			}
+			if (!p.next.empty()) {
+				err = update_page(p.next, [&] (page &next) { next.prev = p.prev; });
+				if (err)
+					return err;
+			}
+
+			err = remove_page(page_key);
 			if (err)
 				return err;
 
@@ -820,6 +2101,181 @@ private:
 		return elliptics::error_info();
 	}
 
+	elliptics::error_info remove_range(const eurl &page_key, const key &from, const key &to, size_t level,
+			remove_recursion &rec, range_removal &rr) {
+		page p;
+		elliptics::error_info err = read_page(page_key, p);
+		if (err)
+			return err;
+
+		if (p.is_leaf())
+			rr.leaf_level = level;
+
+		if (p.is_empty())
+			return elliptics::error_info();
+
+		key old_front = p.objects.front();
+
+		if (p.is_leaf()) {
+			auto first = std::lower_bound(p.objects.begin(), p.objects.end(), from);
+			auto last = std::lower_bound(first, p.objects.end(), to);
+			if (first == last)
+				return elliptics::error_info();
+
+			rr.num_keys += last - first;
+			if (rr.collect_ordinals) {
+				uint64_t ordinal;
+				for (auto it = first; it != last; ++it) {
+					if (posting_ordinal(*it, &ordinal))
+						rr.ordinals.push_back(ordinal);
+				}
+			}
+			p.remove(first - p.objects.begin(), last - p.objects.begin());
+		} else {
+			// child page @i hosts keys in [objects[i], objects[i+1]) range
+			std::vector<key> objects;
+			objects.reserve(p.objects.size());
+
+			bool modified = false;
+			for (size_t i = 0; i < p.objects.size(); ++i) {
+				const key &child = p.objects[i];
+
+				bool overlaps = ((i == 0) || (child < to)) && ((i + 1 == p.objects.size()) || (from < p.objects[i + 1]));
+				if (!overlaps) {
+					objects.push_back(child);
+					continue;
+				}
+
+				// the first and the last child may host keys outside of their bounds in the current page
+				bool covered = (i != 0) && !(child < from) &&
+					(i + 1 < p.objects.size()) && !(to < p.objects[i + 1]);
+				if (covered && !rr.collect_ordinals && rr.leaf_level && (level + 1 == rr.leaf_level)) {
+					if (rr.runs.size() <= level + 1)
+						rr.runs.resize(level + 2);
+					if (rr.runs[level + 1].first.empty())
+						rr.runs[level + 1].first = child.url;
+					rr.runs[level + 1].second = child.url;
+
+					rr.pages.push_back(child.url);
+					rr.num_leaf_pages++;
+					rr.num_covered_leaves++;
+
+					modified = true;
+					continue;
+				}
+
+				remove_recursion crec;
+				err = remove_range(child.url, from, to, level + 1, crec, rr);
+				if (err)
+					return err;
+
+				if (crec.removed) {
+					modified = true;
+					continue;
+				}
+
+				objects.push_back(child);
+
+				// the first key of the underlying page has been changed, update its copy in the current page
+				if (crec.page_start) {
+					objects.back().set_id(crec.page_start.id);
+					objects.back().timestamp = crec.page_start.timestamp;
+					modified = true;
+				}
+			}
+
+			if (!modified)
+				return elliptics::error_info();
+
+			p.objects.swap(objects);
+			p.total_size = 0;
+			for (auto it = p.objects.begin(), end = p.objects.end(); it != end; ++it) {
+				p.total_size += it->size();
+			}
+		}
+
+		BH_LOG(m_log, INDEXES_LOG_NOTICE, "index: remove_range: page: %s -> %s, level: %d",
+				page_key.str().c_str(), p.str().c_str(), level);
+
+		if (p.is_empty()) {
+			// root page is never removed, it is reset when the whole tree becomes empty
+			if (level == 0) {
+				rr.root_emptied = true;
+				return elliptics::error_info();
+			}
+
+			rec.removed = true;
+
+			if (rr.runs.size() <= level)
+				rr.runs.resize(level + 1);
+			if (rr.runs[level].first.empty())
+				rr.runs[level].first = page_key;
+			rr.runs[level].second = page_key;
+
+			rr.pages.push_back(page_key);
+			if (p.is_leaf())
+				rr.num_leaf_pages++;
+
+			return elliptics::error_info();
+		}
+
+		if (p.objects.front() != old_front)
+			rec.page_start = p.objects.front();
+
+		return write_page(page_key, p, false);
+	}
+
+	// excludes runs of removed pages from the linked list of pages and removes them from the storage
+	//
+	// Levels are processed from the leaves upwards: neighbours of the removed run are read from the run's
+	// boundary pages at processing time, since they could have been updated while processing lower level.
+	elliptics::error_info remove_range_unlink(range_removal &rr) {
+		elliptics::error_info err;
+
+		for (size_t level = rr.runs.size(); level-- > 0; ) {
+			const auto &run = rr.runs[level];
+			if (run.first.empty())
+				continue;
+
+			page first, last;
+			err = read_page(run.first, first);
+			if (err)
+				return err;
+			err = read_page(run.second, last);
+			if (err)
+				return err;
+
+			if (!first.prev.empty()) {
+				err = update_page(first.prev, [&] (page &prev) { prev.next = last.next; });
+				if (err)
+					return err;
+			}
+			if (!last.next.empty()) {
+				err = update_page(last.next, [&] (page &next) { next.prev = first.prev; });
+				if (err)
+					return err;
+			}
+		}
+
+		if (rr.root_emptied) {
+			page start_page;
+			err = write_page(start_key(), start_page, false);
+			if (err)
+				return err;
+		}
+
+		for (auto it = rr.pages.begin(), end = rr.pages.end(); it != end; ++it) {
+			err = remove_page(*it);
+			if (err)
+				return err;
+
+			m_meta.num_pages--;
+		}
+
+		m_meta.num_leaf_pages -= rr.num_leaf_pages;
+		return elliptics::error_info();
+	}
+
 	elliptics::error_info check(elliptics::async_remove_result &&wr) {
 		std::vector<int> groups;
 		std::ostringstream st;
@@ -866,6 +2322,71 @@ private:
 class read_only_index: public index {
 public:
 	read_only_index(ebucket::bucket_processor &bp, const eurl &start): index(bp, start, true) {}
+	read_only_index(ebucket::bucket_processor &bp, const eurl &start, const index_meta &meta): index(bp, start, meta) {}
+
+	typedef std::function<void (const elliptics::error_info &, std::unique_ptr<read_only_index> &&)> open_handler;
+
+	// reads index metadata without waiting for the storage, @handler is called from elliptics I/O thread
+	// with opened index or with an error, missing index is reported as -ENOENT
+	static void open_async(ebucket::bucket_processor &bp, const eurl &start, const open_handler &handler) {
+		eurl mkey = generate_meta_key(start);
+
+		io::read_data_async(bp, mkey, false, [&bp, start, mkey, handler]
+				(const elliptics::error_info &err, const elliptics::data_pointer &data) {
+			std::unique_ptr<read_only_index> idx;
+			if (err) {
+				handler(err, std::move(idx));
+				return;
+			}
+
+			index_meta meta;
+			try {
+				msgpack::unpacked result;
+				msgpack::unpack(&result, data.data<char>(), data.size());
+				result.get().convert(&meta);
+			} catch (const std::exception &e) {
+				handler(elliptics::create_error(-EINVAL, "failed to unpack index metadata: %s, data size: %ld: %s",
+							mkey.str().c_str(), data.size(), e.what()), std::move(idx));
+				return;
+			}
+
+			idx.reset(new read_only_index(bp, start, meta));
+			handler(elliptics::error_info(), std::move(idx));
+		});
+	}
+
+	// opens all indexes concurrently and waits for them, index which could not be opened is an empty pointer
+	static std::vector<std::unique_ptr<read_only_index>> open_all(ebucket::bucket_processor &bp,
+			const std::vector<eurl> &indexes) {
+		struct open_context {
+			std::vector<std::unique_ptr<read_only_index>> opened;
+			std::atomic<size_t> pending;
+			std::promise<void> promise;
+		};
+
+		auto ctx = std::make_shared<open_context>();
+		ctx->opened.resize(indexes.size());
+		ctx->pending = indexes.size() + 1;
+
+		auto done = [ctx] () {
+			if (--ctx->pending == 0)
+				ctx->promise.set_value();
+		};
+
+		for (size_t i = 0; i < indexes.size(); ++i) {
+			open_async(bp, indexes[i], [ctx, i, done]
+					(const elliptics::error_info &, std::unique_ptr<read_only_index> &&idx) {
+				ctx->opened[i] = std::move(idx);
+				done();
+			});
+		}
+
+		std::future<void> future = ctx->promise.get_future();
+		done();
+		future.wait();
+
+		return std::move(ctx->opened);
+	}
 };
 
 class read_write_index: public index {
@@ -891,11 +2412,16 @@ static inline ioremap::greylock::index_meta &operator >>(msgpack::object o, iore
 	uint16_t version = 0;
 	p[0].convert(&version);
 	switch (version) {
-	case ioremap::greylock::index_meta::serialization_version_6: {
-		if (size != ioremap::greylock::index_meta::serialization_version_6) {
+	case ioremap::greylock::index_meta::serialization_version_6:
+	case ioremap::greylock::index_meta::serialization_version_7:
+	case ioremap::greylock::index_meta::serialization_version_8:
+	case ioremap::greylock::index_meta::serialization_version_9:
+	case ioremap::greylock::index_meta::serialization_version_10: {
+		// serialization version equals to the number of packed fields
+		if (size != version) {
 			std::ostringstream ss;
 			ss << "page unpack: array size mismatch: read: " << size <<
-				", must be: " << ioremap::greylock::index_meta::serialization_version_6;
+				", must be: " << version;
 			throw std::runtime_error(ss.str());
 		}
 
@@ -915,6 +2441,28 @@ static inline ioremap::greylock::index_meta &operator >>(msgpack::object o, iore
 
 		p[5].convert(&tmp);
 		meta.generation_number_nsec = tmp;
+
+		if (version >= ioremap::greylock::index_meta::serialization_version_7) {
+			p[6].convert(&tmp);
+			meta.num_keys = tmp;
+		}
+
+		if (version >= ioremap::greylock::index_meta::serialization_version_8) {
+			p[7].convert(&tmp);
+			meta.max_positions = tmp;
+		} else {
+			meta.max_positions = ioremap::greylock::index_meta::max_positions_unknown;
+		}
+
+		if (version >= ioremap::greylock::index_meta::serialization_version_9) {
+			p[8].convert(&tmp);
+			meta.dense = tmp;
+		}
+
+		if (version >= ioremap::greylock::index_meta::serialization_version_10) {
+			p[9].convert(&tmp);
+			meta.filter_shards = tmp;
+		}
 		break;
 	}
 	default: {
@@ -931,13 +2479,17 @@ static inline ioremap::greylock::index_meta &operator >>(msgpack::object o, iore
 template <typename Stream>
 inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::greylock::index_meta &meta)
 {
-	o.pack_array(ioremap::greylock::index_meta::serialization_version_6);
-	o.pack((int)ioremap::greylock::index_meta::serialization_version_6);
+	o.pack_array(ioremap::greylock::index_meta::serialization_version_10);
+	o.pack((int)ioremap::greylock::index_meta::serialization_version_10);
 	o.pack(meta.page_index.load());
 	o.pack(meta.num_pages.load());
 	o.pack(meta.num_leaf_pages.load());
 	o.pack(meta.generation_number_sec.load());
 	o.pack(meta.generation_number_nsec.load());
+	o.pack(meta.num_keys.load());
+	o.pack(meta.max_positions.load());
+	o.pack(meta.dense.load());
+	o.pack(meta.filter_shards.load());
 
 	return o;
 }
@@ -2,7 +2,12 @@
 #define __INDEXES_INTERSECTION_HPP
 
 #include "greylock/index.hpp"
+#include "greylock/posting.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <future>
 #include <map>
 
 namespace ioremap { namespace greylock { namespace intersect {
@@ -16,7 +21,8 @@ struct single_doc_result {
 	float relevance = 0;
 
 	// every entry in this array corresponds to one of the requested index name,
-	// array size will always be equal to requested number of indexes
+	// array size will always be equal to the number of required and union indexes (see @state::indexes()),
+	// union index which does not contain the document has empty positions
 	//
 	// each key contains index name and how to find it (index's @bucket/@key, @id contains index name)
 	// as well as vector of positions where given index name is being located in the document
@@ -29,6 +35,9 @@ struct result {
 	// This will contain a cookie which must be used for the next intersection request,
 	// if current request is not complete. This may happen when client has requested limited
 	// maximum number of keys in reply and there are more keys.
+	//
+	// Cookie is an opaque hex-encoded @greylock::cookie structure, which contains exact position
+	// and leaf page url for every requested index.
 	std::string cookie;
 	long max_number_of_documents = ~0UL;
 
@@ -36,6 +45,1229 @@ struct result {
 	std::vector<single_doc_result> docs;
 };
 
+// Document filter called for every document which contains all requested indexes,
+// document is not returned to the client and is not counted against requested number of documents
+// if filter returns false
+typedef std::function<bool (const single_doc_result &)> match_fn;
+
+// Returns true if words are located one after another in the document, i.e. there is position @p,
+// such that word @j is located at position @p + @j for every @j.
+// Every entry in @positions is a sorted array of the positions of the appropriate word.
+static inline bool phrase_match(const std::vector<const std::vector<size_t> *> &positions) {
+	if (positions.size() < 2)
+		return true;
+
+	// try every position of the rarest word as a phrase anchor
+	size_t rare = 0;
+	for (size_t j = 1; j < positions.size(); ++j) {
+		if (positions[j]->size() < positions[rare]->size())
+			rare = j;
+	}
+
+	for (auto it = positions[rare]->begin(), end = positions[rare]->end(); it != end; ++it) {
+		if (*it < rare)
+			continue;
+
+		size_t start = *it - rare;
+
+		bool found = true;
+		for (size_t j = 0; j < positions.size(); ++j) {
+			if (j == rare)
+				continue;
+
+			if (!std::binary_search(positions[j]->begin(), positions[j]->end(), start + j)) {
+				found = false;
+				break;
+			}
+		}
+
+		if (found)
+			return true;
+	}
+
+	return false;
+}
+
+// Returns true if every word has at least one position within window of @distance words,
+// i.e. distance between the first and the last word in the window is not greater than @distance.
+// Every entry in @positions is a sorted array of the positions of the appropriate word.
+static inline bool proximity_match(const std::vector<const std::vector<size_t> *> &positions, size_t distance) {
+	if (positions.size() < 2)
+		return true;
+
+	std::vector<size_t> offsets(positions.size(), 0);
+
+	// window is formed by the current position of every word, it is moved forward
+	// by advancing the word with the smallest position
+	while (true) {
+		size_t min_pos = 0, max = 0;
+
+		for (size_t j = 0; j < positions.size(); ++j) {
+			if (offsets[j] >= positions[j]->size())
+				return false;
+
+			size_t p = (*positions[j])[offsets[j]];
+			if (p < (*positions[min_pos])[offsets[min_pos]])
+				min_pos = j;
+			if (p > max)
+				max = p;
+		}
+
+		if (max - (*positions[min_pos])[offsets[min_pos]] <= distance)
+			return true;
+
+		offsets[min_pos]++;
+	}
+}
+
+// Term statistics relevance is BM25 without document length normalization (document length is not stored):
+// every query word contributes its saturated term frequency @tf (number of positions of the word in the document)
+// weighted by the inverse document frequency @idf computed by @term_idf().
+//
+// Score only grows with @tf, thus score of the largest term frequency in the index is its upper bound.
+static const float term_k1 = 1.2;
+
+static inline float term_score(float idf, size_t tf) {
+	return idf * (float)tf * (term_k1 + 1) / ((float)tf + term_k1);
+}
+
+// @df is the number of documents which contain the word, @num_docs is the number of documents in the collection
+static inline float term_idf(unsigned long long df, unsigned long long num_docs) {
+	return std::log(1.0 + (double)num_docs / (double)std::max(df, 1ULL));
+}
+
+// Inclusive range of key timestamps, keys outside of this range are never returned.
+//
+// Keys are sorted by timestamp first, and every key in the internal page is the first key
+// of the appropriate child page, i.e. internal keys are the lower timestamp bounds of the subtrees
+// and the next internal key is the upper bound. Because of that iterators are positioned
+// to the range boundary by the usual tree descent, which skips all subtrees before the range,
+// and iteration stops as soon as the key outside of the range is met, so pages after the range
+// are never read.
+struct time_range {
+	uint64_t start = 0;
+	uint64_t end = ~0ULL;
+
+	// sets bounds in seconds, both bounds are inclusive
+	void set(long tsec_start, long tsec_end) {
+		key k;
+
+		k.set_timestamp(tsec_start, 0);
+		start = k.timestamp;
+
+		k.set_timestamp(tsec_end, (1<<30) - 1);
+		end = k.timestamp;
+	}
+
+	bool contains(const key &k) const {
+		return (k.timestamp >= start) && (k.timestamp <= end);
+	}
+
+	bool empty() const {
+		return start > end;
+	}
+
+	// the smallest possible key within the range
+	key start_key() const {
+		key k;
+		k.timestamp = start;
+		return k;
+	}
+
+	// key which is greater than any key within the range, but less than any key after the range,
+	// keys with the same timestamp and empty ID are not valid
+	key end_key() const {
+		key k;
+		k.timestamp = end;
+		if (end != ~0ULL)
+			k.timestamp++;
+		return k;
+	}
+
+	bool operator==(const time_range &other) const {
+		return (start == other.start) && (end == other.end);
+	}
+	bool operator!=(const time_range &other) const {
+		return !operator==(other);
+	}
+
+	std::string str() const {
+		long start_sec, start_nsec, end_sec, end_nsec;
+		start_key().get_timestamp(&start_sec, &start_nsec);
+
+		key k;
+		k.timestamp = end;
+		k.get_timestamp(&end_sec, &end_nsec);
+
+		std::ostringstream ss;
+		ss << "[" << start_sec << "." << start_nsec << ", " << end_sec << "." << end_nsec << "]";
+		return ss.str();
+	}
+};
+
+// Query is an intersection of all @required indexes and of the unions of indexes in every @unions entry,
+// documents which are present in any of the @excluded indexes are not returned:
+//
+// r0 AND r1 ... AND (u00 OR u01 ...) AND (u10 OR ...) ... AND NOT (x0 OR x1 ...)
+//
+// Missing union and excluded indexes are treated as empty, missing required index means there are no results.
+//
+// @hints are indexes known to contain every document which is present in all @required indexes
+// (for example precomputed intersection of two of them), they do not change the result,
+// they are only used by the planner as additional operands, missing hint is ignored.
+struct query {
+	std::vector<eurl> required;
+	std::vector<std::vector<eurl>> unions;
+	std::vector<eurl> excluded;
+	std::vector<eurl> hints;
+
+	query() {}
+	query(const std::vector<eurl> &indexes) : required(indexes) {}
+
+	// there must be at least one required index or union, exclusion alone does not select anything
+	bool empty() const {
+		return required.empty() && unions.empty();
+	}
+
+	// all indexes in the order their positions are stored in the cookie
+	std::vector<eurl> all() const {
+		std::vector<eurl> ret(required);
+		for (auto &u: unions) {
+			ret.insert(ret.end(), u.begin(), u.end());
+		}
+		ret.insert(ret.end(), excluded.begin(), excluded.end());
+		return ret;
+	}
+
+	// all indexes followed by the hints, hints are not stored in the cookie
+	std::vector<eurl> with_hints() const {
+		std::vector<eurl> ret = all();
+		ret.insert(ret.end(), hints.begin(), hints.end());
+		return ret;
+	}
+
+	bool operator==(const query &other) const {
+		return (required == other.required) && (unions == other.unions) && (excluded == other.excluded) &&
+			(hints == other.hints);
+	}
+	bool operator!=(const query &other) const {
+		return !operator==(other);
+	}
+};
+
+// Opened indexes and iterators pointing to the current position in every index.
+//
+// State can be kept between subsequent paginated requests, in this case intersection
+// continues from already opened indexes and loaded pages without reading them again.
+class state {
+public:
+	// where iteration over single index starts: either position saved in the cookie,
+	// or bare document ID sent by older client, or the boundary of the time range if both are empty
+	struct start_position {
+		bool resume = false;
+		index_position pos;
+		std::string legacy;
+	};
+
+	// iterates over single index either from the smallest key to the largest (forward)
+	// or from the largest to the smallest (reverse), only one pair of iterators is used
+	//
+	// iteration starts at the boundary of the time range (unless started from the cookie)
+	// and finishes when key outside of the time range is met
+	struct iter {
+		read_only_index idx;
+		bool reverse;
+		time_range range;
+		greylock::iterator begin, end;
+		greylock::reverse_iterator rbegin, rend;
+
+		// when true, iterator is moved forward by searching from the root instead of reading all leaves in between
+		bool seek = false;
+
+		// when true, index is small enough to be read via @posting_cache
+		bool cached = false;
+
+		// whole index decoded by @posting_cache, if it is set, tree iterators are not used,
+		// @flat_pos is the position of the current key in the array
+		std::shared_ptr<const posting_list> flat;
+		ssize_t flat_pos = 0;
+
+		// bitmap of the dense index used as a probe (see @state::probed()),
+		// if it is not set, probe falls back to the tree search
+		std::shared_ptr<const ordinal_bitmap> bitmap;
+
+		// legacy start is a bare document ID, it can not be used to position reverse iterator,
+		// reverse iteration starts from the end of the time range in this case
+		iter(const read_only_index &index, const std::string &start, bool rev, const time_range &tr) :
+			idx(index), reverse(rev), range(tr),
+			begin(rev ? idx.end() : (start.empty() ? idx.begin(tr.start_key()) : idx.begin(start))), end(idx.end()),
+			rbegin(rev ? idx.rbegin(tr.end_key()) : idx.rend()), rend(idx.rend())
+		{}
+
+		iter(const read_only_index &index, const index_position &pos, bool rev, const time_range &tr) :
+			idx(index), reverse(rev), range(tr),
+			begin((rev || pos.finished) ? idx.end() : idx.begin(pos)), end(idx.end()),
+			rbegin((rev && !pos.finished) ? idx.rbegin(pos) : idx.rend()), rend(idx.rend())
+		{}
+
+		// iterator points to the end until it is positioned by @position_async()
+		iter(const read_only_index &index, bool rev, const time_range &tr) :
+			idx(index), reverse(rev), range(tr),
+			begin(idx.end()), end(idx.end()),
+			rbegin(idx.rend()), rend(idx.rend())
+		{}
+
+		// positions iterator over decoded index just like constructors above position tree iterators
+		void position(const std::shared_ptr<const posting_list> &list, const start_position &start) {
+			flat = list;
+
+			const ssize_t size = flat->keys.size();
+			if (start.resume && start.pos.finished) {
+				flat_pos = reverse ? -1 : size;
+				return;
+			}
+
+			key k;
+			if (start.resume) {
+				k = start.pos.start;
+			} else if (reverse) {
+				k = range.end_key();
+			} else if (start.legacy.empty()) {
+				k = range.start_key();
+			} else {
+				k.id = start.legacy;
+			}
+
+			flat_pos = reverse ? flat->rlower_bound(k, size - 1) : flat->lower_bound(k);
+		}
+
+		// positions iterator just like constructors above, but without waiting for the storage,
+		// @done is called from elliptics I/O thread when iterator is ready
+		//
+		// cached index is read via @posting_cache, tree iterators are only used if that has failed
+		void position_async(const start_position &start, const std::function<void ()> &done) {
+			if (cached) {
+				posting_cache::instance().get_async(idx, [this, start, done]
+						(const std::shared_ptr<const posting_list> &list) {
+					if (list) {
+						position(list, start);
+						done();
+					} else {
+						cached = false;
+						position_async(start, done);
+					}
+				});
+				return;
+			}
+
+			auto set_begin = [this, done] (const elliptics::error_info &, const greylock::iterator &it) {
+				begin = it;
+				done();
+			};
+			auto set_rbegin = [this, done] (const elliptics::error_info &, const greylock::reverse_iterator &it) {
+				rbegin = it;
+				done();
+			};
+
+			if (start.resume && start.pos.finished) {
+				done();
+			} else if (start.resume) {
+				if (reverse)
+					idx.rbegin_async(start.pos, set_rbegin);
+				else
+					idx.begin_async(start.pos, set_begin);
+			} else if (reverse) {
+				idx.rbegin_async(range.end_key(), set_rbegin);
+			} else if (start.legacy.empty()) {
+				idx.begin_async(range.start_key(), set_begin);
+			} else {
+				idx.begin_async(start.legacy, set_begin);
+			}
+		}
+
+		// only the bound the iterator moves towards is checked, start position is never before
+		// the near bound of the time range (see @state::clamp())
+		bool finished() {
+			if (flat) {
+				if (reverse)
+					return (flat_pos < 0) || (flat->keys[flat_pos].timestamp < range.start);
+
+				return (flat_pos >= (ssize_t)flat->keys.size()) || (flat->keys[flat_pos].timestamp > range.end);
+			}
+
+			if (reverse)
+				return (rbegin == rend) || (rbegin->timestamp < range.start);
+
+			return (begin == end) || (begin->timestamp > range.end);
+		}
+
+		// returns true if @k1 comes before @k2 in iteration order
+		bool before(const key &k1, const key &k2) const {
+			return reverse ? (k2 < k1) : (k1 < k2);
+		}
+
+		const key &current() {
+			if (flat)
+				return flat->keys[flat_pos];
+
+			return reverse ? *rbegin : *begin;
+		}
+
+		void next() {
+			if (flat)
+				flat_pos += reverse ? -1 : 1;
+			else if (reverse)
+				++rbegin;
+			else
+				++begin;
+		}
+
+		// moves iterator to the first key in iteration order which is not before @k,
+		// if that key does not live in the current leaf and @seek is set, iterator is positioned
+		// by the tree search, otherwise it skips leaves which do not host that key,
+		// the key is then found within its leaf by the block kernel
+		void advance(const key &k) {
+			if (flat) {
+				if (finished() || !before(current(), k))
+					return;
+
+				if (reverse)
+					flat_pos = flat->rlower_bound(k, flat_pos);
+				else
+					flat_pos = flat->lower_bound(k, flat_pos);
+				return;
+			}
+
+			if (reverse) {
+				if (finished() || !(k < *rbegin))
+					return;
+
+				if (seek && !rbegin.covers(k)) {
+					rbegin = idx.rbegin(k);
+					return;
+				}
+
+				while (!rbegin.at_end() && !rbegin.covers(k))
+					rbegin.skip_leaf();
+
+				if (!rbegin.at_end())
+					rbegin.seek(k);
+			} else {
+				if (finished() || !(*begin < k))
+					return;
+
+				if (seek && !begin.covers(k)) {
+					begin = idx.begin(k);
+					return;
+				}
+
+				while (!begin.at_end() && !begin.covers(k))
+					begin.skip_leaf();
+
+				if (!begin.at_end())
+					begin.seek(k);
+			}
+		}
+
+		index_position position() {
+			if (flat) {
+				if ((flat_pos < 0) || (flat_pos >= (ssize_t)flat->keys.size())) {
+					index_position pos;
+					pos.finished = true;
+					return pos;
+				}
+
+				return flat->position(flat_pos);
+			}
+
+			if (reverse ? (rbegin == rend) : (begin == end)) {
+				index_position pos;
+				pos.finished = true;
+				return pos;
+			}
+
+			return reverse ? idx.position(rbegin) : idx.position(begin);
+		}
+	};
+
+	// AND operand, it is either a single required index or a union of indexes,
+	// every entry is the position of the appropriate iterator in @idata array
+	//
+	// the first @skip union indexes are non-essential (see @prune()), they are not used to find documents
+	struct operand {
+		std::vector<size_t> iters;
+		size_t skip = 0;
+	};
+
+	// @start is an encoded @greylock::cookie, if it can not be decoded, it is treated
+	// as a bare document ID for compatibility with older clients.
+	// Cookie created for different iteration direction is ignored and iteration starts from the beginning.
+	//
+	// If @reverse is true, keys are returned from the largest (newest) to the smallest one.
+	// Only keys with timestamps within @range are returned.
+	state(ebucket::bucket_processor &bp, const query &q, const std::string &start, bool reverse = false,
+			const time_range &range = time_range()) :
+	m_query(q), m_reverse(reverse), m_range(range) {
+		// index metadata is read first, iterators are only positioned after the plan has been built,
+		// so that query with missing or empty required index does not read any page
+		std::vector<eurl> all = q.with_hints();
+		std::vector<std::unique_ptr<read_only_index>> opened;
+		opened.reserve(all.size());
+
+		for (auto &iname: all) {
+			try {
+				opened.emplace_back(new read_only_index(bp, iname));
+			} catch (const std::exception &e) {
+				BH_LOG(bp.logger(), INDEXES_LOG_NOTICE, "intersection: index: %s: could not open: %s",
+						iname.str(), e.what());
+				opened.emplace_back();
+			}
+		}
+
+		init(bp, opened, start, NULL);
+	}
+
+	typedef std::function<void (std::unique_ptr<state> &&)> open_handler;
+
+	// Asynchronous counterpart of the constructor: metadata of all indexes is read concurrently,
+	// then all iterators are positioned concurrently, and every tree descent is a chain of elliptics callbacks,
+	// so no thread waits for the storage while state is being opened.
+	//
+	// @handler is called from elliptics I/O thread when state is ready, it must not block,
+	// intersection itself (which reads the following leaves synchronously) has to be run elsewhere.
+	static void open_async(ebucket::bucket_processor &bp, const query &q, const std::string &start, bool reverse,
+			const time_range &range, const open_handler &handler) {
+		struct open_context {
+			std::unique_ptr<state> st;
+			std::vector<std::unique_ptr<read_only_index>> opened;
+			std::vector<start_position> starts;
+			std::atomic<size_t> pending;
+		};
+
+		auto ctx = std::make_shared<open_context>();
+		ctx->st.reset(new state(q, reverse, range));
+
+		std::vector<eurl> all = q.with_hints();
+		ctx->opened.resize(all.size());
+		ctx->pending = all.size() + 1;
+
+		// iterators are positioned once all indexes have been opened
+		auto position = [&bp, ctx, start, handler] () {
+			state &st = *ctx->st;
+			st.init(bp, ctx->opened, start, &ctx->starts);
+			ctx->opened.clear();
+
+			ctx->pending = st.idata.size() + st.m_probes.size() + 1;
+			auto done = [ctx, handler] () {
+				if (--ctx->pending == 0)
+					handler(std::move(ctx->st));
+			};
+
+			for (size_t i = 0; i < st.idata.size(); ++i) {
+				st.idata[i].position_async(ctx->starts[i], done);
+			}
+
+			for (auto i: st.m_probes) {
+				iter *it = &st.idata[i];
+				it->idx.bitmap_async([it, done]
+						(const elliptics::error_info &, const std::shared_ptr<const ordinal_bitmap> &bm) {
+					it->bitmap = bm;
+					done();
+				});
+			}
+
+			done();
+		};
+
+		auto opened = [ctx, position] () {
+			if (--ctx->pending == 0)
+				position();
+		};
+
+		for (size_t slot = 0; slot < all.size(); ++slot) {
+			const eurl iname = all[slot];
+			read_only_index::open_async(bp, iname, [&bp, ctx, slot, iname, opened]
+					(const elliptics::error_info &err, std::unique_ptr<read_only_index> &&idx) {
+				if (err) {
+					BH_LOG(bp.logger(), INDEXES_LOG_NOTICE, "intersection: index: %s: could not open: %s [%d]",
+							iname.str(), err.message(), err.code());
+				}
+
+				ctx->opened[slot] = std::move(idx);
+				opened();
+			});
+		}
+
+		opened();
+	}
+
+	// opens state via @open_async() and waits for it, since all storage reads are sent concurrently,
+	// it takes about the time of the slowest tree descent instead of the sum of all descents
+	//
+	// The calling thread is blocked until the state is ready. Only opening is asynchronous: intersection
+	// reads the following leaves synchronously, and so do @index::insert() and @index::remove().
+	static std::unique_ptr<state> open(ebucket::bucket_processor &bp, const query &q, const std::string &start,
+			bool reverse = false, const time_range &range = time_range()) {
+		std::promise<std::unique_ptr<state>> promise;
+		std::future<std::unique_ptr<state>> future = promise.get_future();
+
+		open_async(bp, q, start, reverse, range, [&promise] (std::unique_ptr<state> &&st) {
+				promise.set_value(std::move(st));
+			});
+
+		return future.get();
+	}
+
+	state(ebucket::bucket_processor &bp, const std::vector<eurl> &indexes, const std::string &start,
+			bool reverse = false, const time_range &range = time_range()) :
+		state(bp, query(indexes), start, reverse, range) {}
+
+	// indexes which are returned in @single_doc_result.indexes, i.e. all existing required and union indexes,
+	// they are the first entries in @idata array
+	const std::vector<eurl> &indexes() const {
+		return m_indexes;
+	}
+
+	const query &get_query() const {
+		return m_query;
+	}
+
+	// human readable description of the chosen plan
+	const std::string &plan() const {
+		return m_plan;
+	}
+
+	bool reverse() const {
+		return m_reverse;
+	}
+
+	const time_range &range() const {
+		return m_range;
+	}
+
+	// returns true if @k1 has to be returned to the client before @k2
+	bool before(const key &k1, const key &k2) const {
+		return m_reverse ? (k2 < k1) : (k1 < k2);
+	}
+
+	// union is finished when all its essential indexes are finished
+	bool finished(const operand &op) {
+		for (auto i = op.iters.begin() + op.skip; i != op.iters.end(); ++i) {
+			if (!idata[*i].finished())
+				return false;
+		}
+
+		return true;
+	}
+
+	// the first key in iteration order among all essential indexes of the operand (k-way merge),
+	// operand must not be finished
+	const key &current(const operand &op) {
+		iter *min = NULL;
+		for (auto i = op.iters.begin() + op.skip; i != op.iters.end(); ++i) {
+			iter &it = idata[*i];
+			if (it.finished())
+				continue;
+
+			if (!min || before(it.current(), min->current()))
+				min = &it;
+		}
+
+		return min->current();
+	}
+
+	// moves every index which points to the current operand key, so that duplicates are merged
+	void next(const operand &op) {
+		key k = current(op);
+		for (auto i = op.iters.begin() + op.skip; i != op.iters.end(); ++i) {
+			iter &it = idata[*i];
+			if (!it.finished() && (it.current() == k))
+				it.next();
+		}
+	}
+
+	// moves every essential index of the operand to the first key which is not before @k
+	void advance(const operand &op, const key &k) {
+		for (auto i = op.iters.begin() + op.skip; i != op.iters.end(); ++i) {
+			idata[*i].advance(k);
+		}
+	}
+
+	// Returns true if every probe index contains @k.
+	// Probe is a dense required index, which does not take part in finding documents, it only filters
+	// documents found by the operands. Document which has an ordinal is looked up in the bitmap of the index,
+	// any other document (or document of the index whose bitmap could not be read) is looked up in the tree.
+	bool probed(const key &k) {
+		uint64_t ordinal;
+		bool has_ordinal = posting_ordinal(k, &ordinal);
+
+		for (auto i: m_probes) {
+			iter &it = idata[i];
+			if (it.bitmap && has_ordinal) {
+				if (!it.bitmap->contains(ordinal))
+					return false;
+
+				continue;
+			}
+
+			it.advance(k);
+			if (it.finished() || !(it.current() == k))
+				return false;
+		}
+
+		return true;
+	}
+
+	// advances excluded indexes up to @k, returns true if any of them contains @k,
+	// since intersection only moves forward, excluded indexes are read at most once
+	bool excluded(const key &k) {
+		bool ret = false;
+		for (auto i: m_excluded) {
+			iter &it = idata[i];
+			it.advance(k);
+
+			if (!it.finished() && (it.current() == k))
+				ret = true;
+		}
+
+		return ret;
+	}
+
+	// term statistics relevance of the document, it is a sum of @term_score() of all query indexes,
+	// @rs.indexes must be filled by the intersection
+	float score(const single_doc_result &rs) const {
+		float ret = 0;
+		for (size_t i = 0; i < rs.indexes.size(); ++i) {
+			ret += term_score(m_idf[i], rs.indexes[i].positions.size());
+		}
+
+		return ret;
+	}
+
+	// MaxScore dynamic pruning, documents which can not have @score() larger than @limit are not needed.
+	//
+	// Union indexes are ordered by the upper bounds of their scores. Document which is present only in the first
+	// indexes of the union can not score more than the sum of their bounds plus bounds of all other operands,
+	// if that sum does not exceed @limit, these union indexes are non-essential: they are not used to find documents,
+	// they are only moved to the documents found by other indexes to compute score.
+	// @limit only grows during intersection, thus index never becomes essential again.
+	//
+	// Returns false if no document can have score larger than @limit, intersection can be stopped.
+	bool prune(float limit) {
+		std::vector<float> bounds(operands.size(), 0);
+		float total = 0;
+
+		for (auto i: m_probes) {
+			total += m_bound[i];
+		}
+
+		for (size_t i = 0; i < operands.size(); ++i) {
+			for (auto it: operands[i].iters) {
+				bounds[i] += m_bound[it];
+			}
+
+			total += bounds[i];
+		}
+
+		if (total <= limit)
+			return false;
+
+		for (size_t i = 0; i < operands.size(); ++i) {
+			operand &op = operands[i];
+			if (op.iters.size() < 2)
+				continue;
+
+			if (!op.skip) {
+				std::stable_sort(op.iters.begin(), op.iters.end(), [&] (size_t i1, size_t i2) {
+						return m_bound[i1] < m_bound[i2];
+					});
+			}
+
+			// at least one union index is always essential, otherwise @total would not exceed @limit
+			float sum = total - bounds[i];
+			size_t skip = 0;
+			while ((skip + 1 < op.iters.size()) && (sum + m_bound[op.iters[skip]] <= limit)) {
+				sum += m_bound[op.iters[skip]];
+				++skip;
+			}
+
+			op.skip = std::max(op.skip, skip);
+		}
+
+		return true;
+	}
+
+	// positions of all query indexes in the order of @query::all(),
+	// missing index is stored as finished
+	std::vector<index_position> positions() {
+		const size_t num = m_slots.empty() ? 0 : m_slots.size() - m_query.hints.size();
+
+		std::vector<index_position> ret;
+		ret.reserve(num);
+
+		for (size_t i = 0; i < num; ++i) {
+			ssize_t slot = m_slots[i];
+			if (slot < 0) {
+				index_position pos;
+				pos.finished = true;
+				ret.emplace_back(pos);
+			} else {
+				ret.emplace_back(idata[slot].position());
+			}
+		}
+
+		return ret;
+	}
+
+	// contains vector of iterators pointing to the requested indexes
+	// iterator always points to the smallest document ID not yet pushed into resulting structure (or to client)
+	// or discarded (if other index iterators point to larger document IDs)
+	std::vector<iter> idata;
+
+	// documents must be present in every operand
+	std::vector<operand> operands;
+
+private:
+	// used by @open_async(), state is initialized by @init() when indexes have been opened
+	state(const query &q, bool reverse, const time_range &range) : m_query(q), m_reverse(reverse), m_range(range) {}
+
+	// Iterator only checks the bound of the time range it moves towards (see @iter::finished()),
+	// thus it must not start before the near bound: cookie created for a different range
+	// or bare document ID (its key has zero timestamp) are replaced with the boundary of the time range.
+	void clamp(start_position &sp) const {
+		if (sp.resume) {
+			if (sp.pos.finished)
+				return;
+
+			if (m_reverse ? !(sp.pos.start < m_range.end_key()) : (sp.pos.start < m_range.start_key()))
+				sp = start_position();
+			return;
+		}
+
+		if (!sp.legacy.empty() && (m_range.start != 0))
+			sp.legacy.clear();
+	}
+
+	// Builds plan and iterators for the opened indexes (@opened entries are in @query::with_hints() order).
+	// If @starts is not null, iterators are not positioned, where every iterator has to start from
+	// is put into @starts instead.
+	void init(ebucket::bucket_processor &bp, const std::vector<std::unique_ptr<read_only_index>> &opened,
+			const std::string &start, std::vector<start_position> *starts) {
+		if (!plan(opened)) {
+			BH_LOG(bp.logger(), INDEXES_LOG_INFO, "intersection: plan: %s", m_plan);
+			return;
+		}
+
+		const std::vector<eurl> all = m_query.all();
+		const std::vector<eurl> names = m_query.with_hints();
+
+		greylock::cookie ck;
+		bool decoded = ck.decode(start);
+		bool resume = decoded && (ck.positions.size() == all.size()) && (ck.reverse == m_reverse);
+		std::string legacy_start = decoded ? std::string() : start;
+
+		idata.reserve(names.size());
+		m_slots.assign(names.size(), -1);
+
+		// positive indexes go first in query order, they are followed by the excluded ones and then by the hints
+		for (size_t slot = 0; slot < names.size(); ++slot) {
+			if (!opened[slot])
+				continue;
+
+			if (slot < m_query.required.size() + union_size())
+				m_indexes.push_back(all[slot]);
+			else if (slot < all.size())
+				m_excluded.push_back(idata.size());
+
+			start_position sp;
+			sp.resume = resume;
+			if (resume && (slot < all.size()))
+				sp.pos = ck.positions[slot];
+			else if (resume)
+				sp.pos = hint_start(ck);
+			else
+				sp.legacy = legacy_start;
+
+			clamp(sp);
+
+			std::shared_ptr<const posting_list> list;
+			if (starts) {
+				starts->emplace_back(sp);
+
+				iter itr(*opened[slot], m_reverse, m_range);
+				idata.emplace_back(std::move(itr));
+			} else if (m_cached[slot] && (list = posting_cache::instance().get(*opened[slot]))) {
+				iter itr(*opened[slot], m_reverse, m_range);
+				itr.position(list, sp);
+				idata.emplace_back(std::move(itr));
+			} else if (sp.resume) {
+				iter itr(*opened[slot], sp.pos, m_reverse, m_range);
+				idata.emplace_back(std::move(itr));
+			} else {
+				iter itr(*opened[slot], sp.legacy, m_reverse, m_range);
+				idata.emplace_back(std::move(itr));
+			}
+
+			idata.back().seek = m_seek[slot];
+			idata.back().cached = m_cached[slot];
+			m_slots[slot] = idata.size() - 1;
+
+			if (slot < m_query.required.size() + union_size())
+				m_df.push_back(opened[slot]->meta().estimated_keys());
+		}
+
+		init_term_statistics(opened);
+
+		// hints do not contribute to the score
+		m_bound.resize(idata.size(), 0);
+
+		for (auto &op: operands) {
+			for (auto &i: op.iters) {
+				i = m_slots[i];
+			}
+		}
+
+		for (auto &i: m_probes) {
+			i = m_slots[i];
+			if (!starts)
+				idata[i].bitmap = idata[i].idx.bitmap();
+		}
+
+		BH_LOG(bp.logger(), INDEXES_LOG_INFO, "intersection: plan: %s", m_plan);
+	}
+
+	query m_query;
+	std::vector<eurl> m_indexes;
+	bool m_reverse;
+	time_range m_range;
+	std::string m_plan;
+
+	// whether iterator for every index in @query::all() moves via the tree search
+	std::vector<bool> m_seek;
+
+	// whether every index in @query::all() is read whole via @posting_cache
+	std::vector<bool> m_cached;
+
+	// positions of the excluded indexes in @idata
+	std::vector<size_t> m_excluded;
+
+	// positions of the probe indexes in @idata (see @probed())
+	std::vector<size_t> m_probes;
+
+	// position in @idata for every index in @query::all(), -1 if index does not exist
+	std::vector<ssize_t> m_slots;
+
+	// term statistics of the existing required and union indexes, entries correspond to @indexes()
+	std::vector<unsigned long long> m_df;
+	std::vector<float> m_idf;
+	std::vector<float> m_bound;
+
+	// The number of documents in the mailbox is not known, the largest query index is used instead,
+	// it is the lower bound of the collection size, thus the most frequent query word gets the smallest weight.
+	// Indexes written by older versions do not know the largest term frequency, their bound is the score limit
+	// for infinitely large term frequency.
+	void init_term_statistics(const std::vector<std::unique_ptr<read_only_index>> &opened) {
+		unsigned long long num_docs = 0;
+		for (auto df: m_df) {
+			num_docs = std::max(num_docs, df);
+		}
+
+		size_t pos = 0;
+		for (size_t slot = 0; slot < m_query.required.size() + union_size(); ++slot) {
+			if (!opened[slot])
+				continue;
+
+			float idf = term_idf(m_df[pos], num_docs);
+			const index_meta &meta = opened[slot]->meta();
+			unsigned long long max_tf = meta.max_positions;
+
+			// saturation limit of @term_score() bounds any term frequency
+			float bound = idf * (term_k1 + 1);
+			if (meta.max_positions_known() && max_tf)
+				bound = term_score(idf, max_tf);
+
+			// bounds are summed in different order than scores, leave some space for rounding errors
+			m_idf.push_back(idf);
+			m_bound.push_back(bound * 1.0001);
+			++pos;
+		}
+	}
+
+	// Hint has no position in the cookie, it is resumed from the required index position which is the furthest
+	// in iteration order: no document before it can be returned, since it is missing in that required index.
+	// Position has no leaf url, so hint iterator is positioned by the tree search.
+	index_position hint_start(const greylock::cookie &ck) const {
+		index_position ret;
+		bool found = false;
+
+		for (size_t i = 0; i < m_query.required.size(); ++i) {
+			const index_position &pos = ck.positions[i];
+			if (pos.finished) {
+				ret.finished = true;
+				return ret;
+			}
+
+			if (!found || before(ret.start, pos.start)) {
+				ret.start.id = pos.start.id;
+				ret.start.timestamp = pos.start.timestamp;
+				found = true;
+			}
+		}
+
+		// there are no required indexes, hint is walked from the beginning of the time range
+		if (!found)
+			ret.start = m_reverse ? m_range.end_key() : m_range.start_key();
+
+		return ret;
+	}
+
+	size_t union_size() const {
+		size_t ret = 0;
+		for (auto &u: m_query.unions) {
+			ret += u.size();
+		}
+		return ret;
+	}
+
+	// the number of page reads needed to find a key from the root
+	static unsigned long long tree_height(const index_meta &meta) {
+		// internal page key is about the size of the url plus timestamp
+		unsigned long long fanout = std::max<unsigned long long>(2, max_page_size / 64);
+		unsigned long long height = 1;
+		for (unsigned long long pages = meta.num_leaf_pages; pages > 1; pages /= fanout)
+			height++;
+		return height;
+	}
+
+	// Builds operands from the opened indexes (@opened entries are in @query::with_hints() order,
+	// missing index is an empty pointer) and returns false if query can not match any document.
+	//
+	// Operands are ordered by the estimated number of keys, so that the rarest operand leads the intersection,
+	// every other operand (and excluded index) is either walked linearly or moved by the tree search,
+	// depending on which one is cheaper: linear walk reads all its leaf pages, while tree search
+	// costs tree height reads for every key of the leading operand.
+	// Dense required index (see @index::dense()) which does not lead becomes a probe instead of an operand,
+	// documents found by the operands are looked up in its bitmap.
+	// Existing hint is one more operand, it usually leads, since it is smaller than the indexes it is built from.
+	bool plan(const std::vector<std::unique_ptr<read_only_index>> &opened) {
+		std::ostringstream ss;
+		m_seek.assign(opened.size(), false);
+		m_cached.assign(opened.size(), false);
+
+		struct candidate {
+			operand op;
+			unsigned long long keys = 0;
+			unsigned long long leaves = 0;
+		};
+		std::vector<candidate> candidates;
+
+		size_t slot = 0;
+		auto add = [&] (size_t num) -> bool {
+			candidate c;
+			for (size_t i = 0; i < num; ++i, ++slot) {
+				const auto &idx = opened[slot];
+				if (!idx || !idx->meta().num_leaf_pages)
+					continue;
+
+				c.op.iters.push_back(slot);
+				c.keys += idx->meta().estimated_keys();
+				c.leaves += idx->meta().num_leaf_pages;
+			}
+
+			if (c.op.iters.empty())
+				return false;
+
+			candidates.emplace_back(c);
+			return true;
+		};
+
+		for (size_t i = 0; i < m_query.required.size(); ++i) {
+			if (!add(1)) {
+				ss << "empty: required index " << m_query.required[i].str() << " is missing or has no keys";
+				m_plan = ss.str();
+				return false;
+			}
+		}
+
+		for (auto &u: m_query.unions) {
+			if (!add(u.size())) {
+				ss << "empty: none of the union indexes exists or has keys, first: " << u.front().str();
+				m_plan = ss.str();
+				return false;
+			}
+		}
+
+		if (candidates.empty()) {
+			m_plan = "empty: there are no required indexes or unions";
+			return false;
+		}
+
+		const std::vector<eurl> all = m_query.all();
+		const std::vector<eurl> names = m_query.with_hints();
+
+		for (size_t hint = all.size(); hint < names.size(); ++hint) {
+			const auto &idx = opened[hint];
+			if (!idx || !idx->meta().num_leaf_pages)
+				continue;
+
+			candidate c;
+			c.op.iters.push_back(hint);
+			c.keys = idx->meta().estimated_keys();
+			c.leaves = idx->meta().num_leaf_pages;
+			candidates.emplace_back(c);
+		}
+
+		std::stable_sort(candidates.begin(), candidates.end(), [] (const candidate &c1, const candidate &c2) {
+					return c1.keys < c2.keys;
+				});
+
+		unsigned long long lead_keys = candidates.front().keys;
+
+		// cached index is moved by the binary search in memory, it never needs the tree search
+		auto choose = [&] (size_t slot) -> bool {
+			const index_meta &meta = opened[slot]->meta();
+			bool seek = lead_keys * tree_height(meta) < meta.num_leaf_pages;
+			m_seek[slot] = seek && !m_cached[slot];
+			return m_seek[slot];
+		};
+
+		for (size_t i = 0; i < opened.size(); ++i) {
+			if (opened[i])
+				m_cached[i] = posting_cache::instance().fits(opened[i]->meta());
+		}
+
+		for (size_t i = 0; i < candidates.size(); ++i) {
+			const candidate &c = candidates[i];
+
+			// probe is moved to the matched documents only to read their positions,
+			// its bitmap only rejects documents, positions are read by the cheaper of seek and linear walk
+			size_t first = c.op.iters.front();
+			if ((i != 0) && (first < m_query.required.size()) && opened[first]->dense() && !m_cached[first]) {
+				bool seek = choose(first);
+				m_probes.push_back(first);
+
+				ss << ", [" << all[first].str() <<
+					" keys: " << opened[first]->meta().estimated_keys() <<
+					", leaves: " << opened[first]->meta().num_leaf_pages <<
+					", probe, " << (seek ? "seek" : "linear") << "]";
+				continue;
+			}
+
+			ss << (i == 0 ? "lead: " : ", ") << "[";
+			for (size_t j = 0; j < c.op.iters.size(); ++j) {
+				size_t slot = c.op.iters[j];
+				bool seek = (i != 0) && choose(slot);
+
+				ss << (j == 0 ? "" : " OR ") << names[slot].str() <<
+					" keys: " << opened[slot]->meta().estimated_keys() <<
+					", leaves: " << opened[slot]->meta().num_leaf_pages <<
+					", " << (i == 0 ? "lead" : (seek ? "seek" : "linear")) <<
+					(m_cached[slot] ? ", cached" : "") <<
+					(slot >= all.size() ? ", hint" : "");
+			}
+			ss << "]";
+
+			operands.push_back(c.op);
+		}
+
+		for (; slot < all.size(); ++slot) {
+			if (!opened[slot])
+				continue;
+
+			bool seek = choose(slot);
+			ss << ", NOT [" << all[slot].str() << ", " << (seek ? "seek" : "linear") <<
+				(m_cached[slot] ? ", cached" : "") << "]";
+		}
+
+		m_plan = ss.str();
+		return true;
+	}
+};
+
+// Bounded selection of @k most relevant documents.
+//
+// Every inserted document is scored by @score callback, documents live in min-heap ordered by relevance,
+// so that the least relevant winner is always at the front and can be replaced in O(log k).
+// Documents which are less relevant than all current winners are dropped right away,
+// thus memory usage is bounded by @k no matter how many documents matched the request.
+//
+// If @max_extra is not negative, documents are ranked by term statistics (see @state::score()),
+// relevance is set by the intersection before @score is called, and @score may add at most @max_extra to it.
+// This allows intersection to skip documents which can not beat the current winners.
+class top_k {
+public:
+	typedef std::function<void (single_doc_result &)> score_fn;
+
+	// heap grows with the number of inserted documents, @k is not reserved up front
+	top_k(size_t k, const score_fn &score, float max_extra = -1) : m_k(k), m_score(score), m_max_extra(max_extra) {
+	}
+
+	size_t size() const {
+		return m_docs.size();
+	}
+
+	bool ranked() const {
+		return m_max_extra >= 0;
+	}
+
+	float max_extra() const {
+		return m_max_extra;
+	}
+
+	// document has to be more relevant than @threshold to get into the heap,
+	// returns false if heap is not yet full and any document can get there
+	bool threshold(float *threshold) const {
+		if (!m_k || m_docs.size() < m_k)
+			return false;
+
+		*threshold = m_docs.front().relevance;
+		return true;
+	}
+
+	// returns true if document has been placed into the heap
+	bool insert(single_doc_result &rs) {
+		if (!m_k)
+			return false;
+
+		m_score(rs);
+
+		if (m_docs.size() < m_k) {
+			m_docs.emplace_back(std::move(rs));
+			std::push_heap(m_docs.begin(), m_docs.end(), &top_k::less_relevant);
+			return true;
+		}
+
+		// ties are resolved in favour of documents found earlier, i.e. those which come first in search direction
+		if (rs.relevance <= m_docs.front().relevance)
+			return false;
+
+		std::pop_heap(m_docs.begin(), m_docs.end(), &top_k::less_relevant);
+		m_docs.back() = std::move(rs);
+		std::push_heap(m_docs.begin(), m_docs.end(), &top_k::less_relevant);
+		return true;
+	}
+
+	// moves winners out of the heap, the most relevant document comes first
+	std::vector<single_doc_result> extract() {
+		std::sort_heap(m_docs.begin(), m_docs.end(), &top_k::less_relevant);
+
+		std::vector<single_doc_result> ret;
+		ret.swap(m_docs);
+		return ret;
+	}
+
+private:
+	size_t m_k;
+	score_fn m_score;
+	float m_max_extra;
+	std::vector<single_doc_result> m_docs;
+
+	// heap comparator, the least relevant document is at the front of the heap
+	static bool less_relevant(const single_doc_result &a, const single_doc_result &b) {
+		return a.relevance > b.relevance;
+	}
+};
+
 class intersector {
 public:
 	intersector(ebucket::bucket_processor &bp) : m_bp(bp) {}
@@ -62,26 +1294,29 @@ public:
 	// @result.completed will be set to true in this case.
 	result intersect(const std::vector<eurl> &indexes, std::string &start, size_t num,
 			const std::function<bool (const std::vector<eurl> &, result &)> &finish) const {
-		struct iter {
-			read_only_index idx;
-			greylock::iterator begin, end;
-
-			iter(ebucket::bucket_processor &bp, const eurl &iname, const std::string &start) :
-				idx(bp, iname),
-				begin(idx.begin(start)), end(idx.end())
-			{}
-		};
-
-		// contains vector of iterators pointing to the requested indexes
-		// iterator always points to the smallest document ID not yet pushed into resulting structure (or to client)
-		// or discarded (if other index iterators point to larger document IDs)
-		std::vector<iter> idata;
-		idata.reserve(indexes.size());
+		state st(m_bp, indexes, start);
+		return intersect(st, start, num, finish);
+	}
 
-		for (auto it = indexes.begin(), end = indexes.end(); it != end; ++it) {
-			iter itr(m_bp, *it, start);
-			idata.emplace_back(std::move(itr));
-		}
+	// continues intersection from the given state, @start will be updated just like above,
+	// so that client can continue either with the same state or with the returned cookie
+	//
+	// in reverse state 'the smallest' key below means the largest one,
+	// i.e. the key which has to be returned first in the selected direction
+	//
+	// if @match is set, documents which contain all indexes but are rejected by @match are skipped
+	// right in the intersection loop, they do not occupy space in the result
+	//
+	// if @top is set, accepted documents are pushed into @top instead of @result.docs and @num is ignored,
+	// caller has to extract winners from @top after all states have been processed,
+	// if @top is ranked, intersection stops as soon as no other document can get into @top
+	result intersect(state &st, std::string &start, size_t num,
+			const std::function<bool (const std::vector<eurl> &, result &)> &finish,
+			const match_fn &match = match_fn(), top_k *top = NULL) const {
+		const std::vector<eurl> &indexes = st.indexes();
+		std::vector<state::operand> &operands = st.operands;
+		greylock::cookie ck;
+		ck.reverse = st.reverse();
 
 		result res;
 
@@ -159,38 +1394,46 @@ public:
 			// 	indexes.
 			//
 			// 6. Return [d3, d4] values to the client
+			//
+			// Every @idata column above is an entry in @operands array, i.e. AND operand,
+			// which is either a single index or a union of indexes, union operand points to the smallest key
+			// among all its indexes. Keys found in all operands are then checked against excluded indexes.
 			std::vector<int> pos;
 
+			// operand which points to the largest key, all other operands can skip keys up to that one
+			int max_pos = -1;
+
 			int current = -1;
-			for (auto idata_it = idata.begin(), idata_end = idata.end(); idata_it != idata_end; ++idata_it) {
-				auto &it = idata_it->begin;
-				auto &e = idata_it->end;
+			for (auto op_it = operands.begin(), op_end = operands.end(); op_it != op_end; ++op_it) {
 				++current;
 
-				if (it == e) {
+				if (st.finished(*op_it)) {
 					res.completed = true;
 					break;
 				}
 
 				res.completed = false;
 
+				if ((max_pos < 0) || st.before(st.current(operands[max_pos]), st.current(*op_it)))
+					max_pos = current;
+
 				if (pos.size() == 0) {
 					pos.push_back(current);
 					continue;
 				}
 
-				auto &min_it = idata[pos[0]].begin;
+				const key &min_key = st.current(operands[pos[0]]);
+				const key &it_key = st.current(*op_it);
 
-				BH_LOG(m_bp.logger(), INDEXES_LOG_INFO, "intersection: min-index: %s, id: %s, it-index: %s, id: %s",
-						idata[pos[0]].idx.start_key().str(), min_it->str(),
-						idata_it->idx.start_key().str(), it->str());
+				BH_LOG(m_bp.logger(), INDEXES_LOG_INFO, "intersection: min-operand: %d, id: %s, it-operand: %d, id: %s",
+						pos[0], min_key.str(), current, it_key.str());
 
-				if (*it == *min_it) {
+				if (it_key == min_key) {
 					pos.push_back(current);
 					continue;
 				}
 
-				if (*it < *min_it) {
+				if (st.before(it_key, min_key)) {
 					pos.clear();
 					pos.push_back(current);
 				}
@@ -203,49 +1446,108 @@ public:
 				break;
 			}
 
-			if (pos.size() != idata.size()) {
+			if (pos.size() != operands.size()) {
+				// keys before the largest one can not be present in all operands,
+				// operands are moved directly to it, either by walking leaves or by the tree search
+				key target = st.current(operands[max_pos]);
+
 				for (auto it = pos.begin(); it != pos.end(); ++it) {
-					auto &min_it = idata[*it].begin;
+					auto &min_it = operands[*it];
 
-					auto prev_str = min_it->str();
-					++min_it;
+					auto prev_str = st.current(min_it).str();
+					st.advance(min_it, target);
 
 					std::string min_str = "finished";
-					if (min_it != idata[*it].end)
-						min_str = min_it->str();
+					if (!st.finished(min_it))
+						min_str = st.current(min_it).str();
 
-					BH_LOG(m_bp.logger(), INDEXES_LOG_INFO, "intersection: min-index: %s, id: %s increasing to %s",
-							idata[*it].idx.start_key().str(), prev_str, min_str);
+					BH_LOG(m_bp.logger(), INDEXES_LOG_INFO, "intersection: min-operand: %d, id: %s increasing to %s",
+							*it, prev_str, min_str);
 				}
 
 				continue;
 			}
 
-			start = idata[pos[0]].begin->id;
-			if (res.docs.size() == num) {
+			if (!top && (res.docs.size() == num)) {
+				// all iterators point to the same key, which has not been returned,
+				// save their positions, next request will start exactly from this key
+				ck.positions = st.positions();
+				start = ck.encode();
+
 				if (!finish(indexes, res))
 					continue;
 				break;
 			}
 
-			single_doc_result rs;
-			for (auto it = pos.begin(); it != pos.end(); ++it) {
-				auto &idata_iter = idata[*it];
-				auto &min_it = idata_iter.begin;
-				key k = *min_it;
-
-				if (it == pos.begin()) {
-					rs.doc = k;
-					rs.doc.positions.clear();
+			// key must be copied, iterators are moved forward below
+			key doc = st.current(operands.front());
+
+			if (!st.probed(doc)) {
+				for (auto &op: operands) {
+					st.next(op);
 				}
 
+				BH_LOG(m_bp.logger(), INDEXES_LOG_INFO, "intersection: doc: %s: not found in probe indexes", doc.str());
+				continue;
+			}
+
+			if (st.excluded(doc)) {
+				for (auto &op: operands) {
+					st.next(op);
+				}
+
+				BH_LOG(m_bp.logger(), INDEXES_LOG_INFO, "intersection: doc: %s: excluded", doc.str());
+				continue;
+			}
+
+			single_doc_result rs;
+			rs.doc = doc;
+			rs.doc.positions.clear();
+
+			// union indexes which do not contain the document get empty positions,
+			// non-essential union indexes (see @state::prune()) lag behind, they are moved to the document here
+			for (size_t i = 0; i < indexes.size(); ++i) {
+				auto &idata_iter = st.idata[i];
+				idata_iter.advance(doc);
+
 				key idx;
-				idx.url = indexes[*it];
-				idx.positions = k.positions;
+				idx.url = indexes[i];
+				if (!idata_iter.finished() && (idata_iter.current() == doc))
+					idx.positions = idata_iter.current().positions;
 
 				rs.indexes.push_back(idx);
+			}
+
+			for (auto &op: operands) {
+				st.next(op);
+			}
+
+			if (match && !match(rs)) {
+				BH_LOG(m_bp.logger(), INDEXES_LOG_INFO, "intersection: doc: %s: rejected by match filter",
+						rs.doc.str());
+				continue;
+			}
+
+			if (top) {
+				if (top->ranked())
+					rs.relevance = st.score(rs);
+
+				float threshold;
+				if (top->insert(rs) && top->ranked() && top->threshold(&threshold)) {
+					if (!st.prune(threshold - top->max_extra())) {
+						BH_LOG(m_bp.logger(), INDEXES_LOG_INFO, "intersection: doc: %s: "
+								"no other document can get relevance above %f, stopping",
+								doc.str(), threshold);
 
-				++min_it;
+						res.completed = true;
+						start.clear();
+						if (!finish(indexes, res))
+							continue;
+						break;
+					}
+				}
+
+				continue;
 			}
 
 			res.docs.emplace_back(rs);
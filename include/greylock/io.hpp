@@ -5,6 +5,10 @@
 
 #include <ebucket/bucket_processor.hpp>
 
+#include <functional>
+#include <memory>
+#include <mutex>
+
 namespace ioremap { namespace greylock {
 
 struct io {
@@ -32,6 +36,53 @@ struct io {
 		return async;
 	}
 
+	typedef std::function<void (const elliptics::error_info &, const elliptics::data_pointer &)> read_handler;
+
+	// Reads object without waiting for the storage, @handler is called from elliptics I/O thread
+	// either with the data of the first successful reply or with an error if there is no such reply.
+	// @handler must not block.
+	static void read_data_async(ebucket::bucket_processor &bp, const eurl &url, bool read_latest,
+			const read_handler &handler) {
+		struct read_state {
+			std::mutex lock;
+			bool found = false;
+			elliptics::data_pointer data;
+			elliptics::error_info error;
+		};
+		auto rs = std::make_shared<read_state>();
+
+		elliptics::async_read_result async = read_data(bp, url, read_latest);
+		async.connect(
+			[rs] (const elliptics::read_result_entry &ent) {
+				std::lock_guard<std::mutex> guard(rs->lock);
+				if (rs->found)
+					return;
+
+				if (!ent.error() && ent.is_valid()) {
+					rs->found = true;
+					rs->data = ent.file();
+				} else if (ent.error()) {
+					rs->error = ent.error();
+				}
+			},
+			[rs, url, handler] (const elliptics::error_info &error) {
+				{
+					std::lock_guard<std::mutex> guard(rs->lock);
+					if (!rs->found) {
+						elliptics::error_info err = error ? error : rs->error;
+						if (!err) {
+							err = elliptics::create_error(-ENOENT, "%s: there are no valid replies",
+									url.str().c_str());
+						}
+
+						rs->error = err;
+					}
+				}
+
+				handler(rs->found ? elliptics::error_info() : rs->error, rs->data);
+			});
+	}
+
 	static elliptics::async_lookup_result prepare_latest(ebucket::bucket_processor &bp, const eurl &url) {
 		ebucket::bucket b;
 
@@ -3,6 +3,8 @@
 
 #include "greylock/core.hpp"
 
+#include <algorithm>
+#include <stdint.h>
 #include <string>
 
 namespace ioremap { namespace greylock {
@@ -13,8 +15,38 @@ struct key {
 	uint64_t timestamp = 0;
 	std::vector<size_t> positions;
 
+	// The first 8 bytes of @id packed big-endian and zero-padded, integer comparison of prefixes orders keys
+	// exactly as byte-wise comparison of ids does, only keys with equal prefixes have to compare whole ids.
+	//
+	// Prefix is not stored, it is set for the keys decoded from the storage by @update_prefix(),
+	// keys built in place do not have it and are compared as strings.
+	// Id of the key which has prefix must be changed via @set_id().
+	uint64_t id_prefix = 0;
+	bool has_prefix = false;
+
 	MSGPACK_DEFINE(id, url, positions, timestamp);
 
+	static uint64_t prefix(const std::string &id) {
+		uint64_t ret = 0;
+
+		size_t num = std::min(id.size(), sizeof(uint64_t));
+		for (size_t i = 0; i < num; ++i) {
+			ret |= (uint64_t)(unsigned char)id[i] << (56 - 8 * i);
+		}
+
+		return ret;
+	}
+
+	void update_prefix() {
+		id_prefix = prefix(id);
+		has_prefix = true;
+	}
+
+	void set_id(const std::string &new_id) {
+		id = new_id;
+		update_prefix();
+	}
+
 	void set_timestamp(long tsec, long nsec) {
 		timestamp = tsec;
 		timestamp <<= 30;
@@ -30,11 +62,18 @@ struct key {
 		return id.size() + url.size();
 	}
 
+	// returns true if ids of the keys can be ordered by prefixes without comparing strings
+	bool prefix_differs(const key &other) const {
+		return has_prefix && other.has_prefix && (id_prefix != other.id_prefix);
+	}
+
 	bool operator<(const key &other) const {
 		if (timestamp < other.timestamp)
 			return true;
 		if (timestamp > other.timestamp)
 			return false;
+		if (prefix_differs(other))
+			return id_prefix < other.id_prefix;
 		return id < other.id;
 	}
 	bool operator<=(const key &other) const {
@@ -42,13 +81,15 @@ struct key {
 			return true;
 		if (timestamp > other.timestamp)
 			return false;
+		if (prefix_differs(other))
+			return id_prefix < other.id_prefix;
 		return id <= other.id;
 	}
 	bool operator==(const key &other) const {
-		return (timestamp == other.timestamp) && (id == other.id);
+		return (timestamp == other.timestamp) && !prefix_differs(other) && (id == other.id);
 	}
 	bool operator!=(const key &other) const {
-		return id != other.id || (timestamp != other.timestamp);
+		return !operator==(other);
 	}
 
 	operator bool() const {
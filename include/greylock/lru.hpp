@@ -0,0 +1,139 @@
+#ifndef __INDEXES_LRU_HPP
+#define __INDEXES_LRU_HPP
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace ioremap { namespace greylock {
+
+// Thread-safe bounded table which holds at most @max_size entries.
+//
+// Every access to the entry moves it to the head of the LRU list and prolongs its lifetime
+// for @timeout seconds. Entries which have not been accessed for @timeout seconds are dropped,
+// when table is full, the least recently used entry is dropped.
+//
+// Values are shared pointers, so that entry can be safely used by the caller after it has been evicted.
+template <typename Key, typename Value>
+class lru_cache {
+public:
+	typedef std::shared_ptr<Value> value_ptr;
+
+	lru_cache(size_t max_size = 0, long timeout = 60) : m_max_size(max_size), m_timeout(timeout) {}
+
+	void configure(size_t max_size, long timeout) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_max_size = max_size;
+		m_timeout = timeout;
+
+		shrink();
+	}
+
+	// table with zero maximum size does not store anything
+	bool enabled() const {
+		return m_max_size != 0;
+	}
+
+	void insert(const Key &k, const value_ptr &v) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!m_max_size)
+			return;
+
+		auto it = m_entries.find(k);
+		if (it != m_entries.end()) {
+			m_lru.erase(it->second.lru);
+			m_entries.erase(it);
+		}
+
+		m_lru.push_front(k);
+
+		entry &e = m_entries[k];
+		e.value = v;
+		e.lru = m_lru.begin();
+		e.expires = clock::now() + std::chrono::seconds(m_timeout);
+
+		shrink();
+	}
+
+	// returns empty pointer if there is no such entry or it has expired
+	value_ptr get(const Key &k) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		expire();
+
+		auto it = m_entries.find(k);
+		if (it == m_entries.end())
+			return value_ptr();
+
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+		it->second.expires = clock::now() + std::chrono::seconds(m_timeout);
+
+		return it->second.value;
+	}
+
+	value_ptr remove(const Key &k) {
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		auto it = m_entries.find(k);
+		if (it == m_entries.end())
+			return value_ptr();
+
+		value_ptr ret = it->second.value;
+		m_lru.erase(it->second.lru);
+		m_entries.erase(it);
+
+		return ret;
+	}
+
+	size_t size() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_entries.size();
+	}
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct entry {
+		value_ptr value;
+		typename std::list<Key>::iterator lru;
+		clock::time_point expires;
+	};
+
+	std::mutex m_lock;
+	size_t m_max_size;
+	long m_timeout;
+
+	// the most recently used key lives at the front,
+	// since every access prolongs lifetime by the same timeout, entries at the tail expire first
+	std::list<Key> m_lru;
+	std::map<Key, entry> m_entries;
+
+	void drop_tail() {
+		m_entries.erase(m_lru.back());
+		m_lru.pop_back();
+	}
+
+	void expire() {
+		auto now = clock::now();
+		while (!m_lru.empty()) {
+			auto it = m_entries.find(m_lru.back());
+			if (it->second.expires > now)
+				break;
+
+			drop_tail();
+		}
+	}
+
+	void shrink() {
+		expire();
+
+		while (m_entries.size() > m_max_size) {
+			drop_tail();
+		}
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_LRU_HPP
@@ -1,10 +1,16 @@
 #ifndef __INDEXES_PAGE_HPP
 #define __INDEXES_PAGE_HPP
 
+#include "greylock/block.hpp"
 #include "greylock/io.hpp"
 #include "greylock/key.hpp"
 
+#include <atomic>
+#include <future>
 #include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include <lz4frame.h>
@@ -19,9 +25,16 @@ struct page {
 	size_t total_size = 0;
 	eurl next;
 
+	// pages are linked into doubly linked list, @prev is the reverse of @next link,
+	// it is only stored in linked serialization versions, pages written in older format
+	// will have empty @prev link
+	eurl prev;
+
 	enum {
 		serialization_version_raw = 1,
 		serialization_version_packed,
+		serialization_version_raw_linked,
+		serialization_version_packed_linked,
 		serialization_version_max,
 	};
 
@@ -51,6 +64,7 @@ struct page {
 				", N" << objects.size() <<
 				", T" << total_size <<
 				", next:" << next.str() <<
+				", prev:" << prev.str() <<
 				")";
 		} else {
 			ss << "[" << 
@@ -58,6 +72,7 @@ struct page {
 				", N" << objects.size() <<
 				", T" << total_size <<
 				", next:" << next.str() <<
+				", prev:" << prev.str() <<
 				")";
 		}
 		return ss.str();
@@ -71,6 +86,7 @@ struct page {
 		objects.clear();
 		flags = 0;
 		next = eurl();
+		prev = eurl();
 		total_size = 0;
 
 		msgpack::unpacked result;
@@ -79,6 +95,10 @@ struct page {
 		msgpack::object obj = result.get();
 		obj.convert(this);
 
+		for (auto &k: objects) {
+			k.update_prefix();
+		}
+
 		dprintf("page load: %s\n", str().c_str());
 	}
 
@@ -152,6 +172,17 @@ struct page {
 		return total_size < max_page_size / 3;
 	}
 
+	// removes keys at positions [@first, @last), returns true if modified page is subject to compaction
+	bool remove(size_t first, size_t last) {
+		for (size_t pos = first; pos < last; ++pos) {
+			total_size -= objects[pos].size();
+		}
+
+		objects.erase(objects.begin() + first, objects.begin() + last);
+
+		return total_size < max_page_size / 3;
+	}
+
 	bool insert_and_split(const key &obj, page &other, bool &replaced) {
 		std::vector<key> copy;
 		bool copied = false;
@@ -159,7 +190,8 @@ struct page {
 		replaced = false;
 
 		for (auto it = objects.begin(), end = objects.end(); it != end; ++it) {
-			if ((obj.id == it->id) || (obj.timestamp <= it->timestamp)) {
+			// keys with the same timestamp must be sorted by id, otherwise binary search will not find them
+			if ((obj.id == it->id) || (obj <= *it)) {
 				copy.push_back(obj);
 				total_size += obj.size();
 				copied = true;
@@ -224,6 +256,109 @@ struct page {
 	}
 };
 
+// Single-flight page reads.
+//
+// Concurrent readers of the same page share one storage request and one decoded page,
+// so that many searches over the same mailbox do not multiply reads of the root and hot leaves.
+// Pages are not cached: reader which comes after the page has been delivered sends a new request.
+//
+// Only read-only paths use it, pages which are read to be modified are read directly.
+class page_reader {
+public:
+	typedef std::function<void (const elliptics::error_info &, const std::shared_ptr<const page> &)> read_handler;
+
+	static page_reader &instance() {
+		static page_reader reader;
+		return reader;
+	}
+
+	// @handler is called from elliptics I/O thread (or from the caller thread if read fails right away),
+	// all handlers waiting for the same page get the same decoded page
+	void read_async(ebucket::bucket_processor &bp, const eurl &url, const read_handler &handler) {
+		const std::string name = url.str();
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			auto it = m_flights.find(name);
+			if (it != m_flights.end()) {
+				it->second.push_back(handler);
+				m_joined++;
+				return;
+			}
+
+			m_flights[name].push_back(handler);
+			m_reads++;
+		}
+
+		if (m_send_hook)
+			m_send_hook(url);
+
+		io::read_data_async(bp, url, false, [this, name]
+				(const elliptics::error_info &error, const elliptics::data_pointer &data) {
+			elliptics::error_info err = error;
+			std::shared_ptr<page> p = std::make_shared<page>();
+
+			if (!err) {
+				try {
+					p->load(data.data(), data.size());
+				} catch (const std::exception &e) {
+					err = elliptics::create_error(-EINVAL, "%s: could not load page: %s", name.c_str(), e.what());
+				}
+			}
+
+			std::vector<read_handler> waiters;
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				auto it = m_flights.find(name);
+				waiters.swap(it->second);
+				m_flights.erase(it);
+			}
+
+			for (auto &w: waiters) {
+				w(err, p);
+			}
+		});
+	}
+
+	elliptics::error_info read(ebucket::bucket_processor &bp, const eurl &url, page &p) {
+		std::promise<elliptics::error_info> promise;
+		std::future<elliptics::error_info> future = promise.get_future();
+
+		read_async(bp, url, [&] (const elliptics::error_info &err, const std::shared_ptr<const page> &loaded) {
+				if (!err)
+					p = *loaded;
+
+				promise.set_value(err);
+			});
+
+		return future.get();
+	}
+
+	// number of reads which have been served by already running request
+	unsigned long long joined() const {
+		return m_joined;
+	}
+
+	// number of requests which have been sent to the storage
+	unsigned long long reads() const {
+		return m_reads;
+	}
+
+	// @hook is called in the thread which starts new read after the read has been registered,
+	// but before the request is sent to the storage, readers of the same page which come meanwhile join it.
+	// It is only used by tests, and must not be changed while any read is running.
+	void set_send_hook(const std::function<void (const eurl &)> &hook) {
+		m_send_hook = hook;
+	}
+
+private:
+	std::mutex m_lock;
+	std::function<void (const eurl &)> m_send_hook;
+	std::map<std::string, std::vector<read_handler>> m_flights;
+	std::atomic<unsigned long long> m_joined{0};
+	std::atomic<unsigned long long> m_reads{0};
+};
+
 class page_iterator {
 public:
 	typedef page_iterator self_type;
@@ -239,6 +374,7 @@ public:
 	}
 	page_iterator(const page_iterator &i) : m_bp(i.m_bp) {
 		m_page = i.m_page;
+		m_url = i.m_url;
 		m_use_latest = i.m_use_latest;
 		m_page_index = i.m_page_index;
 	}
@@ -275,6 +411,11 @@ private:
 	bool m_use_latest = false;
 
 	void read_and_load() {
+		if (!m_use_latest) {
+			page_reader::instance().read(m_bp, m_url, m_page);
+			return;
+		}
+
 		auto async = io::read_data(m_bp, m_url, m_use_latest);
 		if (async.error())
 			return;
@@ -313,12 +454,31 @@ public:
 
 	iterator(ebucket::bucket_processor &bp, page &p, size_t internal_index) :
 		m_bp(bp), m_page(p), m_page_internal_index(internal_index) {}
+	iterator(ebucket::bucket_processor &bp, page &p, const eurl &url, size_t internal_index) :
+		m_bp(bp), m_page(p), m_url(url), m_page_internal_index(internal_index) {
+		// @internal_index can point right after the last key in the page,
+		// for example when starting key is larger than any key in given leaf,
+		// in this case iterator must start from the next page
+		if (!m_page.is_empty())
+			try_loading_next_page();
+	}
 	iterator(const iterator &i) : m_bp(i.m_bp) {
 		m_page = i.m_page;
+		m_url = i.m_url;
 		m_page_internal_index = i.m_page_internal_index;
 		m_page_index = i.m_page_index;
 	}
 
+	// iterators can only be assigned if they work with the same bucket processor
+	self_type &operator=(const iterator &i) {
+		m_page = i.m_page;
+		m_url = i.m_url;
+		m_page_internal_index = i.m_page_internal_index;
+		m_page_index = i.m_page_index;
+		m_columns.clear();
+		return *this;
+	}
+
 	self_type operator++() {
 		++m_page_internal_index;
 		try_loading_next_page();
@@ -353,37 +513,249 @@ public:
 				m_page.str(), rhs.m_page.str(), not_equal);
 		return not_equal;
 	}
+
+	// url of the leaf page which hosts current key,
+	// it is empty if iterator has been created from the page without known url (like @end())
+	const eurl &url() const {
+		return m_url;
+	}
+
+	// returns true if the first key not less than @k can be reached without leaving current leaf
+	bool covers(const key &k) const {
+		return !m_page.is_empty() && !(m_page.objects.back() < k);
+	}
+
+	// returns true if iterator has gone past the last leaf, it is the same as comparing with @index::end()
+	bool at_end() const {
+		return m_page.is_empty();
+	}
+
+	// moves iterator to the first key not less than @k, which must be covered by the current leaf (see @covers()),
+	// keys are compared a block at a time over the sort words of the leaf, which are built at the first seek
+	void seek(const key &k) {
+		if (m_columns.size() != m_page.objects.size())
+			m_columns.assign(m_page.objects);
+
+		m_page_internal_index = block::lower_bound(m_page.objects, m_columns, m_page_internal_index, k);
+		try_loading_next_page();
+	}
+
+	// moves iterator to the first key of the next leaf
+	void skip_leaf() {
+		m_page_internal_index = m_page.objects.size();
+		try_loading_next_page();
+	}
 private:
 	ebucket::bucket_processor &m_bp;
 	page m_page;
+	eurl m_url;
 	size_t m_page_index = 0;
 	size_t m_page_internal_index = 0;
 
+	// sort words of the current leaf, they are not copied with iterator
+	block::columns m_columns;
+
 	void try_loading_next_page() {
 		if (m_page_internal_index >= m_page.objects.size()) {
 			m_page_internal_index = 0;
 			++m_page_index;
+			m_columns.clear();
 
 			BH_LOG(m_bp.logger(), INDEXES_LOG_NOTICE, "iterator: loading next page: %s",
 					m_page.str());
 
 			if (m_page.next.empty()) {
 				m_page = page();
+				m_url = eurl();
 			} else {
 				auto url = m_page.next;
 				m_page = page();
+				m_url = url;
 
-				auto async = io::read_data(m_bp, url, false);
-				if (async.error())
-					return;
+				page_reader::instance().read(m_bp, url, m_page);
+			}
+		}
+	}
+};
+
+// Iterates over leaf keys from the largest to the smallest one following @prev links.
+//
+// Leaves written in older format do not have @prev link (leaves in linked format always have it,
+// the first leaf is linked to the internal page), in this case previous leaf is found by descending
+// from the root page @root to the largest key which is less than the first key of the current leaf.
+class reverse_iterator {
+public:
+	typedef reverse_iterator self_type;
+	typedef key value_type;
+	typedef key& reference;
+	typedef key* pointer;
+	typedef std::forward_iterator_tag iterator_category;
+	typedef std::ptrdiff_t difference_type;
+
+	// if @internal_index is negative, iteration starts from the last key of the previous page
+	reverse_iterator(ebucket::bucket_processor &bp, const eurl &root, page &p, const eurl &url, ssize_t internal_index) :
+		m_bp(bp), m_root(root), m_page(p), m_url(url), m_page_internal_index(internal_index) {
+		if (m_page.is_empty()) {
+			m_page_internal_index = 0;
+		} else {
+			try_loading_prev_page();
+		}
+	}
+	reverse_iterator(const reverse_iterator &i) : m_bp(i.m_bp) {
+		m_root = i.m_root;
+		m_page = i.m_page;
+		m_url = i.m_url;
+		m_page_internal_index = i.m_page_internal_index;
+	}
+
+	// iterators can only be assigned if they work with the same bucket processor
+	self_type &operator=(const reverse_iterator &i) {
+		m_root = i.m_root;
+		m_page = i.m_page;
+		m_url = i.m_url;
+		m_page_internal_index = i.m_page_internal_index;
+		m_columns.clear();
+		return *this;
+	}
+
+	self_type operator++() {
+		--m_page_internal_index;
+		try_loading_prev_page();
+
+		return *this;
+	}
+
+	reference operator*() {
+		return m_page.objects[m_page_internal_index];
+	}
+	pointer operator->() {
+		return &m_page.objects[m_page_internal_index];
+	}
+
+	bool operator==(const self_type& rhs) {
+		return (m_page == rhs.m_page) && (m_page_internal_index == rhs.m_page_internal_index);
+	}
+	bool operator!=(const self_type& rhs) {
+		return (m_page != rhs.m_page) || (m_page_internal_index != rhs.m_page_internal_index);
+	}
+
+	// url of the leaf page which hosts current key
+	const eurl &url() const {
+		return m_url;
+	}
+
+	// returns true if the largest key not greater than @k can be reached without leaving current leaf
+	bool covers(const key &k) const {
+		return !m_page.is_empty() && (m_page.objects.front() <= k);
+	}
+
+	// returns true if iterator has gone past the first leaf, it is the same as comparing with @index::rend()
+	bool at_end() const {
+		return m_page.is_empty();
+	}
+
+	// moves iterator to the largest key not greater than @k, which must be covered by the current leaf,
+	// see @iterator::seek()
+	void seek(const key &k) {
+		if (m_columns.size() != m_page.objects.size())
+			m_columns.assign(m_page.objects);
+
+		m_page_internal_index = block::rlower_bound(m_page.objects, m_columns, m_page_internal_index, k);
+		try_loading_prev_page();
+	}
+
+	// moves iterator to the last key of the previous leaf
+	void skip_leaf() {
+		m_page_internal_index = -1;
+		try_loading_prev_page();
+	}
+private:
+	ebucket::bucket_processor &m_bp;
+	eurl m_root;
+	page m_page;
+	eurl m_url;
+	ssize_t m_page_internal_index = 0;
+
+	// sort words of the current leaf, they are not copied with iterator
+	block::columns m_columns;
+
+	void set_end() {
+		m_page = page();
+		m_url = eurl();
+		m_page_internal_index = 0;
+		m_columns.clear();
+	}
+
+	bool read(const eurl &url, page &p) {
+		return !page_reader::instance().read(m_bp, url, p);
+	}
 
-				elliptics::read_result_entry e = async.get_one();
-				if (e.error())
+	// loads leaf which hosts the largest key less than @k descending from the root
+	void load_prev_from_root(const key &k) {
+		eurl url = m_root;
+
+		while (true) {
+			page p;
+			if (!read(url, p)) {
+				set_end();
+				return;
+			}
+
+			if (p.is_leaf()) {
+				auto it = std::lower_bound(p.objects.begin(), p.objects.end(), k);
+				if (it == p.objects.begin()) {
+					set_end();
 					return;
+				}
+
+				m_page_internal_index = (it - p.objects.begin()) - 1;
+				m_page = p;
+				m_url = url;
+				m_columns.clear();
+				return;
+			}
 
-				const auto &file = e.file();
-				m_page.load(file.data(), file.size());
+			// every internal key is the first key of the appropriate child,
+			// keys less than @k live in the child preceding the first internal key not less than @k
+			auto it = std::lower_bound(p.objects.begin(), p.objects.end(), k);
+			if (it == p.objects.begin()) {
+				set_end();
+				return;
 			}
+
+			--it;
+			url = it->url;
+		}
+	}
+
+	void try_loading_prev_page() {
+		while (m_page_internal_index < 0) {
+			if (m_page.is_empty()) {
+				set_end();
+				return;
+			}
+
+			BH_LOG(m_bp.logger(), INDEXES_LOG_NOTICE, "reverse iterator: loading prev page: %s",
+					m_page.str());
+
+			if (m_page.prev.empty()) {
+				key first = m_page.objects.front();
+				load_prev_from_root(first);
+				continue;
+			}
+
+			eurl url = m_page.prev;
+			page p;
+			if (!read(url, p) || !p.is_leaf()) {
+				// previous page in the linked list is not a leaf, i.e. this was the first leaf
+				set_end();
+				return;
+			}
+
+			m_page = p;
+			m_url = url;
+			m_page_internal_index = (ssize_t)m_page.objects.size() - 1;
+			m_columns.clear();
 		}
 	}
 };
@@ -407,22 +779,33 @@ static inline ioremap::greylock::page &operator >>(msgpack::object o, ioremap::g
 	p[0].convert(&version);
 	switch (version) {
 	case ioremap::greylock::page::serialization_version_raw:
-	case ioremap::greylock::page::serialization_version_packed: {
-		if (size != 4) {
+	case ioremap::greylock::page::serialization_version_packed:
+	case ioremap::greylock::page::serialization_version_raw_linked:
+	case ioremap::greylock::page::serialization_version_packed_linked: {
+		bool linked = (version == ioremap::greylock::page::serialization_version_raw_linked) ||
+			(version == ioremap::greylock::page::serialization_version_packed_linked);
+		const uint32_t expected_size = linked ? 5 : 4;
+
+		if (size != expected_size) {
 			std::ostringstream ss;
-			ss << "page unpack: array size mismatch: read: " << size << ", must be: 4";
+			ss << "page unpack: array size mismatch: read: " << size << ", must be: " << expected_size;
 			throw std::runtime_error(ss.str());
 		}
 
 		p[1].convert(&page.flags);
 		p[2].convert(&page.next);
+		if (linked)
+			p[3].convert(&page.prev);
+
+		const msgpack::object &objects = p[expected_size - 1];
 
 		switch (version) {
-		case ioremap::greylock::page::serialization_version_raw: {
+		case ioremap::greylock::page::serialization_version_raw:
+		case ioremap::greylock::page::serialization_version_raw_linked: {
 			msgpack::unpacked result;
 
-			const char *src = p[3].via.raw.ptr;
-			size_t src_size = p[3].via.raw.size;
+			const char *src = objects.via.raw.ptr;
+			size_t src_size = objects.via.raw.size;
 
 			msgpack::unpack(&result, src, src_size);
 			msgpack::object obj = result.get();
@@ -431,14 +814,15 @@ static inline ioremap::greylock::page &operator >>(msgpack::object o, ioremap::g
 			page.recalculate_size();
 			break;
 		}
-		case ioremap::greylock::page::serialization_version_packed: {
+		case ioremap::greylock::page::serialization_version_packed:
+		case ioremap::greylock::page::serialization_version_packed_linked: {
 			msgpack::unpacked result;
 
 			//msgpack::unpack(&result, raw.data(), raw.size());
 			msgpack::object obj;// = result.get();
 
-			const char *src = p[3].via.raw.ptr;
-			size_t src_size = p[3].via.raw.size;
+			const char *src = objects.via.raw.ptr;
+			size_t src_size = objects.via.raw.size;
 
 			LZ4F_decompressionContext_t dctx;
 			LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
@@ -534,14 +918,15 @@ static inline ioremap::greylock::page &operator >>(msgpack::object o, ioremap::g
 template <typename Stream>
 inline msgpack::packer<Stream> &operator <<(msgpack::packer<Stream> &o, const ioremap::greylock::page &p)
 {
-	o.pack_array(4);
+	o.pack_array(5);
 #ifdef PAGE_COMPRESSION
-	o.pack((int)ioremap::greylock::page::serialization_version_packed);
+	o.pack((int)ioremap::greylock::page::serialization_version_packed_linked);
 #else
-	o.pack((int)ioremap::greylock::page::serialization_version_raw);
+	o.pack((int)ioremap::greylock::page::serialization_version_raw_linked);
 #endif
 	o.pack(p.flags);
 	o.pack(p.next);
+	o.pack(p.prev);
 
 	std::stringstream ss;
 	msgpack::pack(ss, p.objects);
@@ -0,0 +1,165 @@
+#ifndef __INDEXES_POSTING_HPP
+#define __INDEXES_POSTING_HPP
+
+#include "greylock/block.hpp"
+#include "greylock/index.hpp"
+#include "greylock/lru.hpp"
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// All keys of the index decoded into flat sorted array.
+//
+// Intersection runs over this array in memory: there is neither tree descent nor page decode,
+// cursor is moved to the given key by the block kernel over the sort words of the keys. Every key also remembers its leaf page,
+// so that pagination cookie created from the array can be resumed by the tree iterators and vice versa.
+struct posting_list {
+	unsigned long long generation_number_sec = 0;
+	unsigned long long generation_number_nsec = 0;
+
+	std::vector<key> keys;
+
+	// sort words of @keys, cursors are moved over them by the block kernel
+	block::columns columns;
+
+	// urls of the leaf pages, @leaf contains position in this array for every key
+	std::vector<eurl> leaves;
+	std::vector<uint32_t> leaf;
+
+	bool fresh(const index_meta &meta) const {
+		return (generation_number_sec == meta.generation_number_sec) &&
+			(generation_number_nsec == meta.generation_number_nsec);
+	}
+
+	// position of the first key which is not less than @k within [@first, keys.size())
+	size_t lower_bound(const key &k, size_t first = 0) const {
+		return block::lower_bound(keys, columns, first, k);
+	}
+
+	// position of the largest key which is not greater than @k within [0, @last], -1 if there is no such key
+	ssize_t rlower_bound(const key &k, ssize_t last) const {
+		return block::rlower_bound(keys, columns, last, k);
+	}
+
+	// the same as @index::position()
+	index_position position(size_t pos) const {
+		index_position ret;
+		ret.start.id = keys[pos].id;
+		ret.start.timestamp = keys[pos].timestamp;
+		ret.start.url = leaves[leaf[pos]];
+		ret.generation_number_sec = generation_number_sec;
+		ret.generation_number_nsec = generation_number_nsec;
+		return ret;
+	}
+};
+
+// Process-wide cache of the whole small indexes.
+//
+// Attribute indexes like sender addresses or folder tags are tiny, but they take part in almost every query.
+// Index which has at most @max_keys keys in at most @max_leaves leaves is loaded whole into @posting_list,
+// it is cached by the index name and is valid until index generation number changes,
+// i.e. the first search after the index has been modified loads it again.
+//
+// Cache is disabled by default, it is set up once at startup by @configure().
+class posting_cache {
+public:
+	typedef std::shared_ptr<const posting_list> list_ptr;
+	typedef std::function<void (const list_ptr &)> get_handler;
+
+	static posting_cache &instance() {
+		static posting_cache cache;
+		return cache;
+	}
+
+	void configure(size_t max_lists, long timeout, unsigned long long max_keys, unsigned long long max_leaves) {
+		m_lists.configure(max_lists, timeout);
+		m_max_keys = max_keys;
+		m_max_leaves = max_leaves;
+	}
+
+	// returns true if index with given metadata is small enough to be cached
+	bool fits(const index_meta &meta) const {
+		return m_lists.enabled() &&
+			(meta.num_leaf_pages != 0) && (meta.num_leaf_pages <= m_max_leaves) &&
+			(meta.estimated_keys() <= m_max_keys);
+	}
+
+	// @handler gets decoded index, it is loaded if there is no cached list of the current index generation,
+	// empty pointer means index could not be read or it has grown too large since its metadata has been read
+	//
+	// @handler may be called from elliptics I/O thread, index object must outlive the operation.
+	void get_async(const read_only_index &idx, const get_handler &handler) {
+		const index_meta meta = idx.meta();
+
+		list_ptr cached = m_lists.get(idx.start_key().str());
+		if (cached && cached->fresh(meta)) {
+			handler(cached);
+			return;
+		}
+
+		const std::string name = idx.start_key().str();
+		const unsigned long long max_keys = m_max_keys;
+		idx.leaves_async([this, meta, name, max_keys, handler]
+				(const elliptics::error_info &err, std::vector<std::pair<eurl, page>> &&leaves) {
+			if (err) {
+				handler(list_ptr());
+				return;
+			}
+
+			auto list = std::make_shared<posting_list>();
+			list->generation_number_sec = meta.generation_number_sec;
+			list->generation_number_nsec = meta.generation_number_nsec;
+
+			for (auto &l: leaves) {
+				if (list->keys.size() + l.second.objects.size() > max_keys) {
+					handler(list_ptr());
+					return;
+				}
+
+				list->leaves.push_back(l.first);
+				for (auto &k: l.second.objects) {
+					list->keys.emplace_back(std::move(k));
+					list->leaf.push_back(list->leaves.size() - 1);
+				}
+			}
+
+			list->columns.assign(list->keys);
+
+			m_lists.insert(name, list);
+			handler(list);
+		});
+	}
+
+	// synchronous counterpart of @get_async()
+	list_ptr get(const read_only_index &idx) {
+		std::promise<list_ptr> promise;
+		std::future<list_ptr> future = promise.get_future();
+
+		get_async(idx, [&promise] (const list_ptr &list) {
+				promise.set_value(list);
+			});
+
+		return future.get();
+	}
+
+	size_t size() {
+		return m_lists.size();
+	}
+
+private:
+	lru_cache<std::string, const posting_list> m_lists;
+	unsigned long long m_max_keys = 0;
+	unsigned long long m_max_leaves = 0;
+
+	posting_cache() {}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_POSTING_HPP
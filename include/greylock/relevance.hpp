@@ -0,0 +1,197 @@
+#ifndef __INDEXES_RELEVANCE_HPP
+#define __INDEXES_RELEVANCE_HPP
+
+#include <algorithm>
+#include <climits>
+#include <functional>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace ioremap { namespace greylock {
+
+// Positional relevance of the query words within single document attribute.
+//
+// Position lists of all attribute words are merged into runs of words located one after another in the document,
+// every run is split into windows of the query length and each window is compared with the query
+// using edit distance. Relevance grows when there are windows closer to the query and when there are
+// more such windows relative to the total length of all runs.
+//
+// Kernel keeps its scratch buffers between calls, so that scoring of many documents does not allocate memory
+// once buffers have grown to the size of the largest document. Kernel is not thread-safe.
+class relevance_kernel {
+public:
+	// @positions are sorted position arrays of the attribute words,
+	// @ivec is the query in query order, every entry is an offset within @positions array
+	float score(const std::vector<const std::vector<size_t> *> &positions, const std::vector<size_t> &ivec) {
+		if (ivec.empty())
+			return 0;
+
+		prepare(ivec, positions.size());
+
+		m_min_dist = INT_MAX;
+		m_min_num = 0;
+		m_total_length = 0;
+		m_run.clear();
+
+		// heap-based k-way merge of the position lists, ties are resolved in favour of the word
+		// with the smallest offset in @positions array
+		m_heap.clear();
+		m_offsets.assign(positions.size(), 0);
+		for (size_t i = 0; i < positions.size(); ++i) {
+			if (!positions[i]->empty())
+				m_heap.emplace_back((*positions[i])[0], i);
+		}
+		std::make_heap(m_heap.begin(), m_heap.end(), std::greater<std::pair<size_t, size_t>>());
+
+		size_t prev = 0;
+		while (!m_heap.empty()) {
+			std::pop_heap(m_heap.begin(), m_heap.end(), std::greater<std::pair<size_t, size_t>>());
+			size_t pos = m_heap.back().first;
+			size_t word = m_heap.back().second;
+
+			if (++m_offsets[word] < positions[word]->size()) {
+				m_heap.back().first = (*positions[word])[m_offsets[word]];
+				std::push_heap(m_heap.begin(), m_heap.end(), std::greater<std::pair<size_t, size_t>>());
+			} else {
+				m_heap.pop_back();
+			}
+
+			if (!m_run.empty() && (pos != prev + 1)) {
+				process_run(ivec);
+				m_run.clear();
+			}
+
+			m_run.push_back(word);
+			prev = pos;
+		}
+
+		// document without any position still has single empty run
+		process_run(ivec);
+
+		return (1.0 - (float)m_min_dist / (float)ivec.size()) * ((float)m_min_num / (float)m_total_length);
+	}
+
+	// Levenstein distance between @pattern and @text of @size words,
+	// every word must be less than the alphabet size set by @prepare()
+	int distance(const std::vector<size_t> &pattern, const size_t *text, size_t size) {
+		if (pattern.size() > 64)
+			return distance_dp(pattern, text, size);
+
+		return distance_bits(pattern, text, size);
+	}
+
+	// sets up pattern bit masks for @pattern of words within [0, @alphabet) range
+	void prepare(const std::vector<size_t> &pattern, size_t alphabet) {
+		m_peq.assign(alphabet, 0);
+		if (pattern.size() > 64)
+			return;
+
+		for (size_t i = 0; i < pattern.size(); ++i) {
+			m_peq[pattern[i]] |= 1ULL << i;
+		}
+	}
+
+private:
+	std::vector<std::pair<size_t, size_t>> m_heap;
+	std::vector<size_t> m_offsets;
+	std::vector<size_t> m_run;
+
+	// bit mask of the pattern positions for every word of the alphabet
+	std::vector<uint64_t> m_peq;
+
+	// single row of the dynamic programming matrix for the patterns longer than 64 words
+	std::vector<int> m_row;
+
+	int m_min_dist;
+	int m_min_num;
+	size_t m_total_length;
+
+	// Compares every window of the query size within the run with the query, the last window
+	// is one word shorter than the query, the whole run is compared if it is shorter than the query.
+	void process_run(const std::vector<size_t> &ivec) {
+		size_t start = 0;
+		while (true) {
+			size_t num = std::min(m_run.size() - start, ivec.size());
+
+			int dist = distance(ivec, m_run.data() + start, num);
+			if (dist < m_min_dist) {
+				m_min_dist = dist;
+				m_min_num = 1;
+			} else if (dist == m_min_dist) {
+				m_min_num++;
+			}
+
+			if (num < ivec.size())
+				break;
+
+			++start;
+		}
+
+		m_total_length += m_run.size();
+	}
+
+	// Myers bit-parallel edit distance as reformulated by Hyyro for the global alignment:
+	// vertical deltas of the current column are packed into @vp/@vn bit vectors,
+	// the first row of the matrix grows by one in every column.
+	int distance_bits(const std::vector<size_t> &pattern, const size_t *text, size_t size) {
+		const size_t m = pattern.size();
+		if (!m)
+			return size;
+
+		const uint64_t last = 1ULL << (m - 1);
+		const uint64_t mask = (m == 64) ? ~0ULL : ((1ULL << m) - 1);
+
+		uint64_t vp = mask;
+		uint64_t vn = 0;
+		int score = m;
+
+		for (size_t j = 0; j < size; ++j) {
+			uint64_t eq = m_peq[text[j]];
+			uint64_t xv = eq | vn;
+			uint64_t xh = (((eq & vp) + vp) ^ vp) | eq;
+			uint64_t ph = vn | ~(xh | vp);
+			uint64_t mh = vp & xh;
+
+			if (ph & last)
+				score++;
+			else if (mh & last)
+				score--;
+
+			ph = (ph << 1) | 1;
+			mh <<= 1;
+
+			vp = (mh | ~(xv | ph)) & mask;
+			vn = ph & xv & mask;
+		}
+
+		return score;
+	}
+
+	int distance_dp(const std::vector<size_t> &pattern, const size_t *text, size_t size) {
+		const size_t m = pattern.size();
+
+		m_row.resize(m + 1);
+		for (size_t i = 0; i <= m; ++i)
+			m_row[i] = i;
+
+		for (size_t j = 0; j < size; ++j) {
+			int diag = m_row[0];
+			m_row[0] = j + 1;
+
+			for (size_t i = 1; i <= m; ++i) {
+				int up = m_row[i];
+				int cost = (pattern[i - 1] == text[j]) ? 0 : 1;
+
+				m_row[i] = std::min(std::min(m_row[i - 1] + 1, up + 1), diag + cost);
+				diag = up;
+			}
+		}
+
+		return m_row[m];
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_RELEVANCE_HPP
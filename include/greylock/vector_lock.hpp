@@ -0,0 +1,109 @@
+#ifndef __INDEXES_VECTOR_LOCK_HPP
+#define __INDEXES_VECTOR_LOCK_HPP
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace ioremap { namespace greylock {
+
+// Set of reader-writer locks identified by string keys, like ribosome::vector_lock,
+// but the key can also be locked in shared mode by @lock_shared().
+// Lock entry only exists while the key is locked or waited for.
+//
+// Writers are preferred: once writer waits for the key, new readers wait until it has been unlocked,
+// so that continuous searches do not starve indexing.
+class shared_vector_lock {
+public:
+	void lock(const std::string &key) {
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		entry &e = m_entries[key];
+		e.writers_waiting++;
+		e.cond.wait(guard, [&e] {return !e.writer && !e.readers;});
+		e.writers_waiting--;
+		e.writer = true;
+	}
+
+	void unlock(const std::string &key) {
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		auto it = m_entries.find(key);
+		if (it == m_entries.end())
+			return;
+
+		it->second.writer = false;
+		release(it);
+	}
+
+	void lock_shared(const std::string &key) {
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		entry &e = m_entries[key];
+		e.readers_waiting++;
+		e.cond.wait(guard, [&e] {return !e.writer && !e.writers_waiting;});
+		e.readers_waiting--;
+		e.readers++;
+	}
+
+	void unlock_shared(const std::string &key) {
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		auto it = m_entries.find(key);
+		if (it == m_entries.end())
+			return;
+
+		it->second.readers--;
+		release(it);
+	}
+
+private:
+	struct entry {
+		int readers = 0;
+		bool writer = false;
+		int readers_waiting = 0;
+		int writers_waiting = 0;
+
+		std::condition_variable cond;
+	};
+
+	std::mutex m_lock;
+
+	// entries are never moved, waiters keep references to them
+	std::map<std::string, entry> m_entries;
+
+	void release(std::map<std::string, entry>::iterator it) {
+		entry &e = it->second;
+		if (!e.writer && !e.readers && !e.readers_waiting && !e.writers_waiting) {
+			m_entries.erase(it);
+			return;
+		}
+
+		e.cond.notify_all();
+	}
+};
+
+// Locks the key of the @shared_vector_lock owned by @T in shared mode, it is a counterpart
+// of ribosome::locker, which takes exclusive lock, both can be used with std::unique_lock.
+template <typename T>
+class shared_locker {
+public:
+	shared_locker(T *t, const std::string &key) : m_t(t), m_key(key) {}
+
+	void lock() {
+		m_t->lock_shared(m_key);
+	}
+
+	void unlock() {
+		m_t->unlock_shared(m_key);
+	}
+
+private:
+	T *m_t;
+	std::string m_key;
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_VECTOR_LOCK_HPP
@@ -0,0 +1,130 @@
+#ifndef __INDEXES_WORKER_POOL_HPP
+#define __INDEXES_WORKER_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace ioremap { namespace greylock {
+
+// Fixed set of threads which execute CPU bound tasks in submission order.
+//
+// Pool which has not been started (or has zero threads) does not accept tasks,
+// caller is expected to run the task itself in this case.
+class worker_pool {
+public:
+	typedef std::function<void ()> task_t;
+
+	worker_pool() {}
+
+	~worker_pool() {
+		stop();
+	}
+
+	// starts @num threads, if @pin is true, every thread is bound to its own CPU core (round-robin if there are
+	// more threads than cores), returns false if pinning has failed, pool is running anyway
+	bool start(size_t num, bool pin) {
+		bool ret = true;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_stop = false;
+
+		unsigned cores = std::thread::hardware_concurrency();
+		for (size_t i = 0; i < num; ++i) {
+			m_threads.emplace_back(std::bind(&worker_pool::run, this));
+
+			if (pin && cores) {
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(i % cores, &set);
+
+				if (pthread_setaffinity_np(m_threads.back().native_handle(), sizeof(cpu_set_t), &set))
+					ret = false;
+			}
+		}
+
+		return ret;
+	}
+
+	// waits for already queued tasks to complete
+	void stop() {
+		std::vector<std::thread> threads;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_stop = true;
+			threads.swap(m_threads);
+		}
+
+		m_cond.notify_all();
+
+		for (auto &t: threads) {
+			t.join();
+		}
+	}
+
+	bool enabled() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return !m_threads.empty() && !m_stop;
+	}
+
+	size_t size() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_threads.size();
+	}
+
+	// number of tasks which wait for a free thread
+	size_t queued() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_tasks.size();
+	}
+
+	// returns false if pool does not run, task is not queued in this case,
+	// task must not throw exceptions
+	bool submit(task_t &&task) {
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			if (m_threads.empty() || m_stop)
+				return false;
+
+			m_tasks.emplace_back(std::move(task));
+		}
+
+		m_cond.notify_one();
+		return true;
+	}
+
+private:
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::deque<task_t> m_tasks;
+	std::vector<std::thread> m_threads;
+	bool m_stop = false;
+
+	void run() {
+		while (true) {
+			task_t task;
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				m_cond.wait(guard, [&] {return m_stop || !m_tasks.empty();});
+
+				if (m_tasks.empty())
+					return;
+
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+
+			task();
+		}
+	}
+};
+
+}} // namespace ioremap::greylock
+
+#endif // __INDEXES_WORKER_POOL_HPP
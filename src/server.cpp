@@ -1,7 +1,14 @@
 #include "greylock/core.hpp"
+#include "greylock/dictionary.hpp"
+#include "greylock/forward.hpp"
 #include "greylock/index.hpp"
 #include "greylock/intersection.hpp"
 #include "greylock/json.hpp"
+#include "greylock/lru.hpp"
+#include "greylock/posting.hpp"
+#include "greylock/relevance.hpp"
+#include "greylock/vector_lock.hpp"
+#include "greylock/worker_pool.hpp"
 
 
 #include <ebucket/bucket_processor.hpp>
@@ -20,12 +27,18 @@
 
 #include <ribosome/split.hpp>
 #include <ribosome/timer.hpp>
-#include <ribosome/distance.hpp>
 #include <ribosome/vector_lock.hpp>
 
 #include <swarm/logger.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
 #include <string>
 #include <thread>
 
@@ -90,6 +103,9 @@ struct single_attribute {
 	typedef std::vector<size_t> pos_t;
 
 	std::string aname;
+
+	// query words of the attribute in query order, every entry is the position of the word's index
+	// within @apos array, the same entry is repeated if word is repeated in the query
 	pos_t ivec;
 
 	// greylock operates with raw index names, it doesn't know whether they were organized into attributes or not
@@ -107,7 +123,14 @@ struct indexes_request {
 		inames(o.inames.str()),
 		indexes(std::move(o.indexes)),
 		positions(std::move(o.positions)),
-		attributes(std::move(o.attributes)) {}
+		attributes(std::move(o.attributes)),
+		unions(std::move(o.unions)),
+		excluded(std::move(o.excluded)),
+		hints(std::move(o.hints)),
+		match_type(o.match_type),
+		match_distance(o.match_distance),
+		top(o.top),
+		ranking(o.ranking) {}
 
 	indexes_request() {}
 
@@ -118,175 +141,156 @@ struct indexes_request {
 
 	std::vector<single_attribute> attributes;
 
-	bool distance_sort(const std::vector<greylock::eurl> &indexes_unused, greylock::intersect::result &res) {
-		(void) indexes_unused;
+	// documents must also contain at least one index from every @unions entry
+	// and must not contain any of the @excluded indexes, these indexes are not used in relevance
+	std::vector<std::vector<greylock::eurl>> unions;
+	std::vector<greylock::eurl> excluded;
 
-//#define STDOUT_DEBUG
-#ifdef STDOUT_DEBUG
-		auto print_vector = [] (const std::vector<size_t> &v) {
-			std::ostringstream ss;
-			ss << "[";
-			for (auto it = v.begin(), end = v.end(); it != end;) {
-				ss << (ssize_t)(*it);
-				++it;
+	// pair indexes of the required indexes (see @http_server::pair_hints()), they do not change the result
+	std::vector<greylock::eurl> hints;
 
-				if (it != end)
-					ss << ", ";
-			}
-			ss << "]";
+	greylock::intersect::query get_query() const {
+		greylock::intersect::query q(indexes);
+		q.unions = unions;
+		q.excluded = excluded;
+		q.hints = hints;
+		return q;
+	}
 
-			return ss.str();
+	// everything which affects search result except index contents, used as search cache key
+	std::string cache_key(bool reverse, const greylock::intersect::time_range &range,
+			const std::string &start, long num) const {
+		std::ostringstream ss;
+		auto dump = [&] (const char *prefix, const std::vector<greylock::eurl> &v) {
+			ss << prefix << v.size() << ":";
+			for (const auto &url: v) {
+				ss << url.str().size() << ":" << url.str();
+			}
 		};
-		auto print_vectors = [&] (const std::vector<pos_t> &v) {
-			std::ostringstream ss;
-			for (auto it = v.begin(), end = v.end(); it != end;) {
-				ss << print_vector(*it);
-				++it;
 
-				if (it != end)
-					ss << ", ";
-			}
+		dump("r", indexes);
+		for (const auto &u: unions) {
+			dump("u", u);
+		}
+		dump("x", excluded);
 
-			return ss.str();
+		// match filter and positional score depend on how query words are grouped into attributes
+		auto dump_pos = [&] (const char *prefix, const single_attribute::pos_t &v) {
+			ss << prefix << v.size() << ":";
+			for (auto pos: v) {
+				ss << pos << ",";
+			}
 		};
-#endif
 
-		for (size_t i = 0; i < indexes.size(); ++i) {
-			const std::string &iname = indexes[i].key;
+		ss << "a" << attributes.size() << ":";
+		for (const auto &sa: attributes) {
+			ss << sa.aname.size() << ":" << sa.aname;
+			dump_pos("i", sa.ivec);
+			dump_pos("p", sa.apos);
+		}
 
-			for (auto &sa : attributes) {
-				if (iname.find(sa.aname) == 0) {
-					sa.apos.push_back(i);
-					break;
+		ss << "m" << match_type << ":" << match_distance <<
+			"t" << top << ":" << ranking <<
+			"d" << reverse << range.str() <<
+			"n" << num <<
+			"s" << start.size() << ":" << start;
+		return ss.str();
+	}
+
+	// how query words of every attribute have to be located in the document:
+	// anywhere (and), one after another (phrase), or within @match_distance words (proximity)
+	enum {
+		match_and = 0,
+		match_phrase,
+		match_proximity,
+	};
+	int match_type = match_and;
+	size_t match_distance = 0;
+
+	// if non-zero, only @top most relevant documents among all matching documents are returned,
+	// they are selected with bounded heap during intersection, pagination is not used in this mode
+	size_t top = 0;
+
+	// how @top documents are ranked: by the positions of the query words only,
+	// or by term statistics with positional score added on top of it, the latter allows intersection
+	// to skip documents which can not get into the top
+	enum {
+		ranking_positions = 0,
+		ranking_terms,
+	};
+	int ranking = ranking_positions;
+
+	// document filter used in the intersection loop, documents rejected here are never scored
+	bool match(const greylock::intersect::single_doc_result &doc) const {
+		for (const auto &sa: attributes) {
+			std::vector<const std::vector<size_t> *> positions;
+
+			if (match_type == match_phrase) {
+				for (auto it = sa.ivec.begin(), end = sa.ivec.end(); it != end; ++it) {
+					positions.push_back(&doc.indexes[sa.apos[*it]].positions);
+				}
+
+				if (!greylock::intersect::phrase_match(positions))
+					return false;
+			} else if (match_type == match_proximity) {
+				for (auto it = sa.apos.begin(), end = sa.apos.end(); it != end; ++it) {
+					positions.push_back(&doc.indexes[*it].positions);
 				}
+
+				if (!greylock::intersect::proximity_match(positions, match_distance))
+					return false;
 			}
 		}
 
-		for (auto &doc: res.docs) {
-			for (const auto &sa: attributes) {
-				std::vector<pos_t> positions;
-				for (size_t i = 0; i < sa.apos.size(); ++i) {
-					size_t ipos = sa.apos[i];
-
-					positions.push_back(doc.indexes[ipos].positions);
-#ifdef STDOUT_DEBUG
-					printf("doc: %s, sa: %s, index: %s, positions: %s\n",
-							doc.doc.str().c_str(), sa.aname.c_str(),
-							doc.indexes[ipos].str().c_str(), print_vector(doc.indexes[ipos].positions).c_str());
-#endif
-				}
-
-				std::vector<size_t> pos_idx;
-				// fill in with zeroes, every entry in this array is an offset within corresponding entry in @positions array
-				pos_idx.resize(positions.size());
-
-				// This code converts index positions for given attribute in given document into index vector.
-				//
-				// Given document @doc, let's assume, there are following index positions for @sa attribute:
-				//
-				// idx0 positions: 0, 1, 4, 12
-				// idx1 positions: 3, 7, 15
-				// idx2 positions: 2, 13
-				//
-				//              : 0, 1, 2, 3, 4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
-				// index vectors: 0, 0, 2, 1, 0
-				//                                        1
-				//                                                            0,  2
-				//                                                                        1
-
-				std::vector<pos_t> dvecs;
-				pos_t current_dvec;
-
-				size_t prev;
-
-				while (true) {
-					size_t min = INT_MAX;
-					int min_pos = -1;
-
-					for (size_t i = 0; i < pos_idx.size(); ++i) {
-						const pos_t &pos_vector = positions[i];
-						size_t pos_offset = pos_idx[i];
-
-						if (pos_offset < pos_vector.size()) {
-							if (pos_vector[pos_offset] < min) {
-								min = pos_vector[pos_offset];
-								min_pos = i;
-							}
-						}
-					}
+		return true;
+	}
 
-					if (min_pos == -1) {
-						dvecs.push_back(current_dvec);
-						break;
-					}
+	greylock::intersect::match_fn match_filter() {
+		if (match_type == match_and)
+			return greylock::intersect::match_fn();
 
-					if (current_dvec.size() == 0) {
-						current_dvec.push_back(min_pos);
-						pos_idx[min_pos]++;
+		return std::bind(&indexes_request::match, this, std::placeholders::_1);
+	}
 
-						prev = min;
-						continue;
-					}
+	// computes relevance of the single document, it is only based on the positions of the query words
+	void score(greylock::intersect::single_doc_result &doc) const {
+		for (const auto &sa: attributes) {
+			std::vector<const std::vector<size_t> *> &positions = m_score_positions;
+			positions.clear();
 
-					if (min != prev + 1) {
-						dvecs.push_back(current_dvec);
-						current_dvec.clear();
-					} else {
-						current_dvec.push_back(min_pos);
-						pos_idx[min_pos]++;
-						prev = min;
-					}
-				}
-#ifdef STDOUT_DEBUG
-				printf("doc: %s, sa: %s, index vectors: %s\n",
-						doc.doc.str().c_str(), sa.aname.c_str(),
-						print_vectors(dvecs).c_str());
-#endif
-				int min_dist = INT_MAX;
-				int min_num = 0;
-				size_t total_length = 0;
-				for (const auto &dvec: dvecs) {
-					// Using sliding window with size equal to @ivec size for given attribute,
-					// compare every subset of index vector with @ivec using Levenstein distance
-					size_t start = 0;
-					while (true) {
-						std::vector<size_t> sub;
-
-						size_t num = dvec.size() - start;
-						if (num > sa.ivec.size())
-							num = sa.ivec.size();
-
-						sub.insert(sub.begin(), dvec.begin() + start, dvec.begin() + start + num);
-
-						int dist = ribosome::distance::levenstein(sa.ivec, sub, INT_MAX);
-						if (dist < min_dist) {
-							min_dist = dist;
-							min_num = 1;
-						} else if (dist == min_dist) {
-							min_num++;
-						}
-#ifdef STDOUT_DEBUG						
-						printf("doc: %s, sa: %s, start: %zd, index vector: %s, dist: %d, min_dist: %d, min_num: %d\n",
-								doc.doc.str().c_str(),
-								sa.aname.c_str(),
-								start,
-								print_vector(sub).c_str(),
-								dist,
-								min_dist,
-								min_num);
-#endif
-
-						if (num < sa.ivec.size())
-							break;
-
-						++start;
-					}
+			for (auto ipos: sa.apos) {
+				positions.push_back(&doc.indexes[ipos].positions);
+			}
 
-					total_length += dvec.size();
-				}
+			doc.relevance = m_kernel.score(positions, sa.ivec);
+		}
+	}
 
-				doc.relevance = (1.0 - (float)min_dist / (float)sa.ivec.size()) * ((float)min_num / (float)total_length);
-			}
+	// @doc.relevance has been set to term statistics score by the intersection,
+	// positional score is within [0, 1] range, it is added to that relevance
+	void rank(greylock::intersect::single_doc_result &doc) const {
+		float terms = doc.relevance;
+
+		doc.relevance = 0;
+		score(doc);
+		if (!std::isfinite(doc.relevance))
+			doc.relevance = 0;
+
+		doc.relevance = terms + std::min<float>(std::max<float>(doc.relevance, 0), 1);
+	}
+
+	greylock::intersect::top_k top_selection() {
+		if (ranking == ranking_terms)
+			return greylock::intersect::top_k(top, std::bind(&indexes_request::rank, this, std::placeholders::_1), 1);
+
+		return greylock::intersect::top_k(top, std::bind(&indexes_request::score, this, std::placeholders::_1));
+	}
+
+	bool distance_sort(const std::vector<greylock::eurl> &indexes_unused, greylock::intersect::result &res) {
+		(void) indexes_unused;
+
+		for (auto &doc: res.docs) {
+			score(doc);
 		}
 
 		std::sort(res.docs.begin(), res.docs.end(), [&]
@@ -296,6 +300,36 @@ struct indexes_request {
 
 		return true;
 	}
+
+private:
+	// scratch buffers reused for every scored document
+	mutable greylock::relevance_kernel m_kernel;
+	mutable std::vector<const std::vector<size_t> *> m_score_positions;
+};
+
+// Intersection state kept on the server between paginated search requests.
+// Only one request at a time may continue given session, others fall back to the cookie.
+// Session continues only the page which starts at @cookie, i.e. where the last page served by it has ended,
+// request which repeats or skips pages falls back to the cookie as well.
+struct search_session {
+	std::mutex lock;
+	std::unique_ptr<greylock::intersect::state> state;
+	std::string cookie;
+};
+
+// Number of searches which have required given pair of indexes, see @http_server::pair_hints().
+struct pair_hits {
+	std::atomic<long> count{0};
+};
+
+// Search result cached on the server.
+// It is only valid while generation numbers of all query indexes are the same as when it was computed,
+// missing index has zero generation.
+struct cached_search {
+	typedef std::pair<unsigned long long, unsigned long long> generation_t;
+
+	std::vector<generation_t> generations;
+	greylock::intersect::result result;
 };
 
 class http_server : public thevoid::server<http_server>
@@ -323,6 +357,16 @@ public:
 			options::methods("POST")
 		);
 
+		on<on_retention>(
+			options::exact_match("/retention"),
+			options::methods("POST")
+		);
+
+		on<on_delete>(
+			options::exact_match("/delete"),
+			options::methods("POST")
+		);
+
 		return true;
 	}
 
@@ -335,14 +379,40 @@ public:
 		}
 	};
 
-	struct on_search : public thevoid::simple_request_stream<http_server> {
+	struct on_search : public thevoid::simple_request_stream<http_server>, public std::enable_shared_from_this<on_search> {
 		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
-			ribosome::timer search_tm;
-			ILOG_INFO("url: %s: start", req.url().to_human_readable().c_str());
-
 			// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
 			std::string data(const_cast<char *>(boost::asio::buffer_cast<const char*>(buffer)), boost::asio::buffer_size(buffer));
 
+			// intersection and scoring are CPU bound, they run in the worker pool,
+			// so that heavy searches do not occupy request threads needed by light requests
+			//
+			// search also holds its worker thread while it waits for the storage: state is opened
+			// by the blocking @greylock::intersect::state::open(), and intersection reads leaves synchronously
+			auto self = this->shared_from_this();
+			auto request = std::make_shared<thevoid::http_request>(req);
+			auto body = std::make_shared<std::string>(std::move(data));
+			if (server()->workers().submit([self, request, body] () {self->run_search(*request, *body);}))
+				return;
+
+			run_search(req, *body);
+		}
+
+		// worker pool tasks must not throw
+		void run_search(const thevoid::http_request &req, const std::string &data) {
+			try {
+				search(req, data);
+			} catch (const std::exception &e) {
+				ILOG_ERROR("url: %s: search failed: %s", req.url().to_human_readable().c_str(), e.what());
+				this->send_reply(swarm::http_response::internal_server_error);
+			}
+		}
+
+		void search(const thevoid::http_request &req, const std::string &data) {
+			ribosome::timer search_tm;
+			ILOG_INFO("url: %s: start, worker queue: %d", req.url().to_human_readable().c_str(),
+					server()->workers().queued());
+
 			rapidjson::Document doc;
 			doc.Parse<0>(data.c_str());
 
@@ -381,13 +451,114 @@ public:
 			size_t page_num = ~0U;
 			std::string page_start("\0");
 
+			// when non-zero, the whole mailbox is searched and only this number of the most relevant documents is returned
+			size_t page_top = 0;
+			int page_ranking = indexes_request::ranking_positions;
+
+			// client may ask server to keep intersection state between paginated requests,
+			// it either opens new session by setting 'session' to true or continues
+			// existing session using token returned in the previous reply
+			std::string session_id;
+			bool want_session = false;
+
+			// when true, the newest documents are returned first
+			bool reverse = false;
+
+			// only documents with timestamps within this range will be returned
+			greylock::intersect::time_range range;
+			const rapidjson::Value &time = greylock::get_object(doc, "time");
+			if (time.IsObject()) {
+				range.set(greylock::get_int64(time, "start", 0), greylock::get_int64(time, "end", LONG_MAX >> 30));
+				if (range.empty()) {
+					ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'time' range %s is empty",
+							req.url().to_human_readable().c_str(), mbox, -EINVAL, range.str());
+					this->send_reply(swarm::http_response::bad_request);
+					return;
+				}
+			}
+
 			if (doc.HasMember("paging")) {
 				const auto &pages = doc["paging"];
 				page_num = greylock::get_int64(pages, "num", ~0U);
 				page_start = greylock::get_string(pages, "start", "\0");
+				reverse = greylock::get_bool(pages, "reverse", false);
+				long top = greylock::get_int64(pages, "top", 0);
+				if (top < 0) {
+					ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'paging/top' %ld is negative",
+							req.url().to_human_readable().c_str(), mbox, -EINVAL, top);
+					this->send_reply(swarm::http_response::bad_request);
+					return;
+				}
+
+				// winners are kept in memory until the whole mailbox has been searched
+				page_top = std::min<size_t>(top, server()->search_top_max());
+
+				const char *ranking = greylock::get_string(pages, "ranking", "positions");
+				if (!strcmp(ranking, "terms")) {
+					page_ranking = indexes_request::ranking_terms;
+				} else if (strcmp(ranking, "positions")) {
+					ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: unsupported 'paging/ranking': %s",
+							req.url().to_human_readable().c_str(), mbox, -EINVAL, ranking);
+					this->send_reply(swarm::http_response::bad_request);
+					return;
+				}
+
+				const char *sid = greylock::get_string(pages, "session");
+				if (sid) {
+					session_id.assign(sid);
+					want_session = true;
+				} else {
+					want_session = greylock::get_bool(pages, "session", false);
+				}
 			}
 
 			auto ireq = server()->get_indexes(mbox, query);
+			ireq.top = page_top;
+			ireq.ranking = page_ranking;
+
+			// every 'or' entry is an object just like 'query', document must contain at least one of its words
+			const rapidjson::Value &any = greylock::get_array(doc, "or");
+			if (any.IsArray()) {
+				for (auto it = any.Begin(), end = any.End(); it != end; ++it) {
+					auto oreq = server()->get_indexes(mbox, *it);
+					if (oreq.indexes.empty())
+						continue;
+
+					ireq.inames << " or: [" << oreq.inames.str() << "]";
+					ireq.unions.emplace_back(std::move(oreq.indexes));
+				}
+			}
+
+			// documents which contain any word from 'not' object are not returned
+			const rapidjson::Value &exclude = greylock::get_object(doc, "not");
+			if (exclude.IsObject()) {
+				auto nreq = server()->get_indexes(mbox, exclude);
+				if (!nreq.indexes.empty()) {
+					ireq.inames << " not: [" << nreq.inames.str() << "]";
+					ireq.excluded = std::move(nreq.indexes);
+				}
+			}
+
+			const rapidjson::Value &match = greylock::get_object(doc, "match");
+			if (match.IsObject()) {
+				const char *match_type = greylock::get_string(match, "type", "and");
+				if (!strcmp(match_type, "and")) {
+					ireq.match_type = indexes_request::match_and;
+				} else if (!strcmp(match_type, "phrase")) {
+					ireq.match_type = indexes_request::match_phrase;
+				} else if (!strcmp(match_type, "proximity")) {
+					ireq.match_type = indexes_request::match_proximity;
+					ireq.match_distance = greylock::get_int64(match, "distance", 0);
+				} else {
+					ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: unsupported 'match/type': %s",
+							req.url().to_human_readable().c_str(), mbox, -EINVAL, match_type);
+					this->send_reply(swarm::http_response::bad_request);
+					return;
+				}
+			}
+
+			if (!server()->partition_period())
+				server()->pair_hints(mbox, ireq);
 
 			greylock::intersect::result result;
 			result.cookie = page_start;
@@ -397,38 +568,39 @@ public:
 					req.url().to_human_readable(), ireq.inames.str(), search_tm.elapsed());
 
 			try {
-				intersect(req, ireq, result);
+				if (server()->partition_period()) {
+					if (want_session) {
+						ILOG_NOTICE("url: %s: indexes: %s: search sessions are not supported for partitioned indexes, "
+								"falling back to cookie",
+								req.url().to_human_readable(), ireq.inames.str());
+					}
+
+					intersect_partitions(req, mbox, ireq, result, reverse, range);
+				} else {
+					intersect(req, ireq, result, reverse, range, session_id, want_session);
+				}
 			} catch (const std::exception &e) {
 				// likely this exception tells that there are no requested indexes
 				// FIXME exception mechanism has to be reworked
 				ILOG_ERROR("url: %s: indexes: %s: could not run intersection for %d indexes: %s",
 					req.url().to_human_readable(), ireq.inames.str(), ireq.indexes.size(), e.what());
-				send_search_result(result);
+				send_search_result(result, std::string());
 				return;
 			}
 
-			const rapidjson::Value &match = greylock::get_object(doc, "match");
-			if (match.IsObject()) {
-				const char *match_type = greylock::get_string(match, "type");
-				if (match_type) {
-					if (strcmp(match_type, "and")) {
-					} else if (strcmp(match_type, "phrase")) {
-					}
-				}
-			}
-
-			send_search_result(result);
+			server()->hydrate_documents(mbox, result);
+			send_search_result(result, session_id);
 
 			ILOG_INFO("url: %s: indexes: %s: requested indexes: %d, requested number of documents: %d, search start: %s, "
-					"found documents: %d, cookie: %s, completed: %d, duration: %d ms",
+					"found documents: %d, cookie: %s, session: %s, completed: %d, duration: %d ms",
 					req.url().to_human_readable(),
 					ireq.inames.str(), ireq.indexes.size(),
 					page_num, page_start,
-					result.docs.size(), result.cookie.c_str(), result.completed,
+					result.docs.size(), result.cookie.c_str(), session_id, result.completed,
 					search_tm.elapsed());
 		}
 
-		void send_search_result(const greylock::intersect::result &result) {
+		void send_search_result(const greylock::intersect::result &result, const std::string &session_id) {
 			JsonValue ret;
 			auto &allocator = ret.GetAllocator();
 
@@ -469,6 +641,11 @@ public:
 				rapidjson::Value sv(result.cookie.c_str(), result.cookie.size(), allocator);
 				page.AddMember("start", sv, allocator);
 
+				if (!session_id.empty()) {
+					rapidjson::Value sid(session_id.c_str(), session_id.size(), allocator);
+					page.AddMember("session", sid, allocator);
+				}
+
 				ret.AddMember("paging", page, allocator);
 			}
 
@@ -482,159 +659,287 @@ public:
 			this->send_reply(std::move(reply), std::move(data));
 		}
 
-		bool intersect(const thevoid::http_request &req, indexes_request &ireq, greylock::intersect::result &result) {
+		// if @want_session is true and sessions are enabled, intersection state is kept on the server,
+		// @session_id will be set to the token client has to use to continue this search,
+		// it is cleared if intersection has been completed or session could not be used
+		bool intersect(const thevoid::http_request &req, indexes_request &ireq, greylock::intersect::result &result,
+				bool reverse, const greylock::intersect::time_range &range,
+				std::string &session_id, bool want_session) {
 			ribosome::timer tm;
 
 			greylock::intersect::intersector p(*(server()->bucket()));
 
-			std::vector<ribosome::locker<http_server>> lockers;
-			lockers.reserve(ireq.indexes.size());
+			std::vector<greylock::shared_locker<http_server>> lockers;
+			std::vector<std::unique_lock<greylock::shared_locker<http_server>>> locks;
+			lock_indexes(ireq.get_query().with_hints(), lockers, locks);
 
-			std::vector<std::unique_lock<ribosome::locker<http_server>>> locks;
-			locks.reserve(ireq.indexes.size());
+			ILOG_INFO("url: %s: indexes: %s: intersection locked: duration: %d ms",
+					req.url().to_human_readable(), ireq.inames.str(), tm.elapsed());
 
-			for (auto it = ireq.indexes.begin(), end = ireq.indexes.end(); it != end; ++it) {
-				ribosome::locker<http_server> l(server(), it->str());
-				lockers.emplace_back(std::move(l));
+			ribosome::timer intersect_tm;
 
-				std::unique_lock<ribosome::locker<http_server>> lk(lockers.back());
-				locks.emplace_back(std::move(lk));
+			// sessions keep intersection state, their results are never cached
+			auto &cache = server()->search_cache();
+			std::string cache_key;
+			std::vector<cached_search::generation_t> generations;
+			if (cache.enabled() && !(want_session && server()->sessions().enabled())) {
+				cache_key = ireq.cache_key(reverse, range, result.cookie, result.max_number_of_documents);
+				generations = server()->generations(ireq.get_query().all());
+
+				auto cached = cache.get(cache_key);
+				if (cached && (cached->generations == generations)) {
+					result = cached->result;
+					session_id.clear();
+
+					ILOG_INFO("url: %s: indexes: %s: completed: %d, result keys: %d, requested num: %d, "
+							"page start: %s, reverse: %d, time range: %s: "
+							"cached intersection: duration: %d ms, whole duration: %d ms",
+							req.url().to_human_readable(), ireq.inames.str(),
+							result.completed, result.docs.size(),
+							result.max_number_of_documents, result.cookie,
+							reverse, range.str(),
+							intersect_tm.elapsed(), tm.elapsed());
+					return result.completed;
+				}
 			}
 
-			ILOG_INFO("url: %s: indexes: %s: intersection locked: duration: %d ms",
-					req.url().to_human_readable(), ireq.inames.str(), tm.elapsed());
+			// @intersect() updates cookie in place, it must not be overwritten by returned result
+			std::string cookie = result.cookie;
+			long max_number_of_documents = result.max_number_of_documents;
+			auto finish = std::bind(&indexes_request::distance_sort, &ireq, std::placeholders::_1, std::placeholders::_2);
+
+			std::string plan;
+
+			auto &sessions = server()->sessions();
+			if (ireq.top) {
+				// every matching document is scored right in the intersection loop,
+				// only the winners are kept, thus there is nothing to continue from
+				greylock::intersect::top_k top = ireq.top_selection();
+
+				auto st = greylock::intersect::state::open(*(server()->bucket()), ireq.get_query(), cookie, reverse, range);
+				result = p.intersect(*st, cookie, ~0UL,
+						[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) {return true;},
+						ireq.match_filter(), &top);
+				result.docs = top.extract();
+				result.completed = true;
+				cookie.clear();
+
+				plan = st->plan();
+				session_id.clear();
+			} else if (want_session && sessions.enabled()) {
+				std::shared_ptr<search_session> session;
+				std::unique_lock<std::mutex> session_guard;
+
+				if (!session_id.empty()) {
+					session = sessions.get(session_id);
+					if (session) {
+						std::unique_lock<std::mutex> guard(session->lock, std::try_to_lock);
+
+						// session is being used by another request, it was created for different query,
+						// or its state is not at the page requested by the cookie
+						if (!guard.owns_lock() ||
+								(session->cookie != cookie) ||
+								(session->state->get_query() != ireq.get_query()) ||
+								(session->state->reverse() != reverse) ||
+								(session->state->range() != range)) {
+							ILOG_NOTICE("url: %s: indexes: %s: session: %s: can not be used, locked: %d, "
+									"falling back to cookie",
+									req.url().to_human_readable(), ireq.inames.str(), session_id,
+									!guard.owns_lock());
+							session.reset();
+						} else {
+							session_guard = std::move(guard);
+						}
+					}
+				}
 
-			ribosome::timer intersect_tm;
-			result = p.intersect(ireq.indexes, result.cookie, result.max_number_of_documents,
-					std::bind(&indexes_request::distance_sort, &ireq, std::placeholders::_1, std::placeholders::_2));
+				if (!session) {
+					session = std::make_shared<search_session>();
+					session_guard = std::unique_lock<std::mutex>(session->lock);
+					session->state = greylock::intersect::state::open(*(server()->bucket()),
+								ireq.get_query(), cookie, reverse, range);
+					session_id = server()->generate_session_id();
+				}
 
-			ILOG_INFO("url: %s: indexes: %s: completed: %d, result keys: %d, requested num: %d, page start: %s: "
+				result = p.intersect(*session->state, cookie, max_number_of_documents, finish, ireq.match_filter());
+				plan = session->state->plan();
+
+				if (result.completed) {
+					sessions.remove(session_id);
+					session_id.clear();
+				} else {
+					session->cookie = cookie;
+					sessions.insert(session_id, session);
+				}
+			} else {
+				auto st = greylock::intersect::state::open(*(server()->bucket()), ireq.get_query(), cookie, reverse, range);
+				result = p.intersect(*st, cookie, max_number_of_documents, finish, ireq.match_filter());
+				plan = st->plan();
+				session_id.clear();
+			}
+
+			result.cookie = cookie;
+			result.max_number_of_documents = max_number_of_documents;
+
+			// indexes are locked, so generations read before intersection are those of the indexes it has read
+			if (!cache_key.empty() && (result.docs.size() <= server()->search_cache_max_documents())) {
+				auto cached = std::make_shared<cached_search>();
+				cached->generations = std::move(generations);
+				cached->result = result;
+				cache.insert(cache_key, cached);
+			}
+
+			ILOG_INFO("url: %s: indexes: %s: completed: %d, result keys: %d, requested num: %d, page start: %s, "
+					"session: %s, reverse: %d, time range: %s, plan: %s: "
 					"intersection completed: duration: %d ms, whole duration: %d ms",
 					req.url().to_human_readable(), ireq.inames.str(),
 					result.completed, result.docs.size(),
-					result.max_number_of_documents, result.cookie,
+					result.max_number_of_documents, result.cookie, session_id,
+					reverse, range.str(), plan,
 					intersect_tm.elapsed(), tm.elapsed());
 
 			return result.completed;
 		}
-	};
 
-	struct on_index : public thevoid::simple_request_stream<http_server> {
-		elliptics::error_info process_one_document(const thevoid::http_request &req, const std::string &mbox,
-				greylock::key &doc, const rapidjson::Value &idxs) {
-			ribosome::timer all_tm;
+		// Every time partition has its own set of indexes, and all indexes of the document live
+		// in the partition its timestamp belongs to, thus intersection is run for every partition separately.
+		// Partitions are walked in the iteration order (the newest first for reverse search),
+		// the walk stops as soon as requested number of documents has been found.
+		//
+		// Cookie returned to the client is prefixed with the partition where iteration has been stopped.
+		bool intersect_partitions(const thevoid::http_request &req, const std::string &mbox, indexes_request &ireq,
+				greylock::intersect::result &result, bool reverse, const greylock::intersect::time_range &range) {
 			ribosome::timer tm;
 
-			ILOG_INFO("process_one_document: url: %s, mailbox: %s, doc: %s: start insertion",
-					req.url().to_human_readable().c_str(), mbox.c_str(),
-					doc.str().c_str());
-
-			auto ireq = server()->get_indexes(mbox, idxs);
+			greylock::intersect::intersector p(*(server()->bucket()));
 
-			for (size_t i = 0; i < ireq.indexes.size(); ++i) {
-				greylock::eurl &iname = ireq.indexes[i];
-				std::vector<size_t> &positions = ireq.positions[i];
+			long start_partition = -1;
+			std::string cookie;
+			server()->decode_partition_cookie(result.cookie, &start_partition, &cookie);
+
+			std::vector<long> partitions = server()->list_partitions(mbox, range);
+			if (reverse)
+				std::reverse(partitions.begin(), partitions.end());
+
+			auto it = partitions.begin();
+			if (start_partition >= 0) {
+				// partition could be dropped by retention since cookie has been created
+				it = std::find_if(partitions.begin(), partitions.end(), [&] (long partition) {
+						return reverse ? partition <= start_partition : partition >= start_partition;
+					});
+				if (it == partitions.end() || *it != start_partition)
+					cookie.clear();
+			}
 
-				// for every index we put vector of positions where given index is located in the document
-				// since it is an inverted index, it contains list of document links each of which contains
-				// array of the positions, where given index lives in the document
-				doc.positions.swap(positions);
+			greylock::intersect::result ret;
+			ret.max_number_of_documents = result.max_number_of_documents;
 
-				ribosome::locker<http_server> l(server(), iname.str());
-				std::unique_lock<ribosome::locker<http_server>> lk(l);
+			size_t max_number_of_documents = result.max_number_of_documents;
+			size_t num_partitions = 0;
 
-				try {
-					greylock::read_write_index index(*(server()->bucket()), iname);
+			// top-k search walks all partitions, winners are selected among documents from every partition
+			std::unique_ptr<greylock::intersect::top_k> top;
+			if (ireq.top) {
+				top.reset(new greylock::intersect::top_k(ireq.top_selection()));
+				it = partitions.begin();
+				cookie.clear();
+			}
 
-					elliptics::error_info err = index.insert(doc);
-					if (err) {
-						return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
-								"doc: %s, index: %s: could not insert new key: %s [%d]",
-							req.url().to_human_readable().c_str(), mbox.c_str(),
-							doc.str().c_str(),
-							iname.str().c_str(),
-							err.message().c_str(),
-							err.code());
-					}
-				} catch (const std::exception &e) {
-					return elliptics::create_error(-EINVAL, "process_one_document: url: %s, mailbox: %s, "
-							"doc: %s, index: %s, exception: %s",
-							req.url().to_human_readable().c_str(), mbox.c_str(),
-							doc.str().c_str(),
-							iname.str().c_str(),
-							e.what());
+			for (; it != partitions.end(); ++it) {
+				if (!top && (ret.docs.size() >= max_number_of_documents)) {
+					ret.completed = false;
+					ret.cookie = server()->encode_partition_cookie(*it, std::string());
+					break;
 				}
 
-				ILOG_INFO("process_one_document: url: %s, mailbox: %s, "
-						"doc: %s, index: %s, elapsed time: %d ms",
-					req.url().to_human_readable().c_str(), mbox,
-					doc.str().c_str(),
-					iname.str().c_str(),
-					tm.restart());
-			}
+				greylock::intersect::query q = server()->partition_query(ireq.get_query(), *it);
 
-			ILOG_INFO("process_one_document: url: %s, mailbox: %s, doc: %s, total number of indexes: %d, elapsed time: %d ms",
-					req.url().to_human_readable().c_str(), mbox,
-					doc.str().c_str(), ireq.indexes.size(), all_tm.elapsed());
+				std::vector<greylock::shared_locker<http_server>> lockers;
+				std::vector<std::unique_lock<greylock::shared_locker<http_server>>> locks;
+				lock_indexes(q.all(), lockers, locks);
 
-			return elliptics::error_info();
-		}
+				greylock::intersect::result res;
+				try {
+					auto st = greylock::intersect::state::open(*(server()->bucket()), q, cookie, reverse, range);
+					res = p.intersect(*st, cookie, top ? ~0UL : max_number_of_documents - ret.docs.size(),
+						[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) {return true;},
+						ireq.match_filter(), top.get());
+				} catch (const std::exception &e) {
+					// partition does not host some of the requested indexes, none of its documents can match
+					ILOG_DEBUG("url: %s: indexes: %s: partition: %ld: skipping: %s",
+							req.url().to_human_readable(), ireq.inames.str(), *it, e.what());
+					cookie.clear();
+					continue;
+				}
 
-		elliptics::error_info parse_docs(const thevoid::http_request &req, const std::string &mbox, const rapidjson::Value &docs) {
-			elliptics::error_info err = elliptics::create_error(-EINVAL,
-					"url: %s, mbox: %s: could not parse document, there are no valid index entries",
-					req.url().to_human_readable().c_str(), mbox.c_str());
+				++num_partitions;
+				ret.docs.insert(ret.docs.end(),
+						std::make_move_iterator(res.docs.begin()), std::make_move_iterator(res.docs.end()));
 
-			for (auto it = docs.Begin(), id_end = docs.End(); it != id_end; ++it) {
-				if (it->IsObject()) {
-					greylock::key doc;
+				if (!res.completed) {
+					ret.completed = false;
+					ret.cookie = server()->encode_partition_cookie(*it, cookie);
+					break;
+				}
 
-					const char *id = greylock::get_string(*it, "id");
-					const char *bucket = greylock::get_string(*it, "bucket");
-					const char *key = greylock::get_string(*it, "key");
-					if (!bucket || !key || !id) {
-						ILOG_ERROR("parse_docs: url: %s, mailbox: %s, error: %d: 'docs/{bucket,ket,id} must be strings",
-								req.url().to_human_readable().c_str(), mbox, -EINVAL);
-						continue;
-					}
+				cookie.clear();
+			}
 
-					struct timespec ts;
-					clock_gettime(CLOCK_REALTIME, &ts);
+			if (top) {
+				ret.docs = top->extract();
+			} else {
+				ireq.distance_sort(ireq.indexes, ret);
+			}
+			result = std::move(ret);
 
-					const rapidjson::Value &timestamp = greylock::get_object(*it, "timestamp");
-					if (timestamp.IsObject()) {
-						long tsec, tnsec;
+			ILOG_INFO("url: %s: indexes: %s: completed: %d, result keys: %d, requested num: %d, page start: %s, "
+					"reverse: %d, time range: %s, partitions: %d, intersected partitions: %d: "
+					"partitioned intersection completed: duration: %d ms",
+					req.url().to_human_readable(), ireq.inames.str(),
+					result.completed, result.docs.size(),
+					result.max_number_of_documents, result.cookie,
+					reverse, range.str(), partitions.size(), num_partitions,
+					tm.elapsed());
 
-						tsec = greylock::get_int64(timestamp, "tsec", ts.tv_sec);
-						tnsec = greylock::get_int64(timestamp, "tnsec", ts.tv_nsec);
+			return result.completed;
+		}
 
-						doc.set_timestamp(tsec, tnsec);
-					} else {
-						doc.set_timestamp(ts.tv_sec, ts.tv_nsec);
-					}
+		// @lockers must outlive @locks, both vectors are reserved upfront, since locks reference lockers
+		//
+		// the same index may be used in several query operands, but it must be locked only once,
+		// indexes are locked in sorted order
+		//
+		// search only reads indexes, they are locked in shared mode, so that concurrent searches over
+		// the same indexes run together and share page reads (see @greylock::page_reader)
+		void lock_indexes(const std::vector<greylock::eurl> &indexes,
+				std::vector<greylock::shared_locker<http_server>> &lockers,
+				std::vector<std::unique_lock<greylock::shared_locker<http_server>>> &locks) {
+			std::set<std::string> names;
+			for (auto it = indexes.begin(), end = indexes.end(); it != end; ++it) {
+				names.insert(it->str());
+			}
 
-					doc.url.bucket.assign(bucket);
-					doc.url.key.assign(key);
-					doc.id.assign(id);
+			lockers.reserve(names.size());
+			locks.reserve(names.size());
 
-					const rapidjson::Value &idxs = greylock::get_object(*it, "index");
-					if (!idxs.IsObject()) {
-						ILOG_ERROR("parse_docs: url: %s, mailbox: %s, doc: %s, error: %d: 'docs/index' must be object",
-								req.url().to_human_readable().c_str(), mbox, doc.str().c_str(), -EINVAL);
-						continue;
-					}
+			for (auto it = names.begin(), end = names.end(); it != end; ++it) {
+				lockers.emplace_back(server(), *it);
 
-					err = process_one_document(req, mbox, doc, idxs);
-					if (err)
-						return err;
-				}
+				std::unique_lock<greylock::shared_locker<http_server>> lk(lockers.back());
+				locks.emplace_back(std::move(lk));
 			}
-
-			return err;
 		}
+	};
 
+	// Removes all documents which are older than requested time.
+	//
+	// Whole time partitions are dropped: every partition keeps a directory of its indexes,
+	// so dropping it takes one storage operation per index page instead of removing documents one by one.
+	// Indexes of the partition which is only partially covered, and indexes of the mailboxes which are
+	// not partitioned, are trimmed with range removal, which only rewrites boundary pages.
+	struct on_retention : public thevoid::simple_request_stream<http_server> {
 		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
-			ribosome::timer index_tm;
+			ribosome::timer tm;
 			ILOG_INFO("url: %s: start", req.url().to_human_readable().c_str());
 
 			// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
@@ -643,16 +948,9 @@ public:
 			rapidjson::Document doc;
 			doc.Parse<0>(data.c_str());
 
-			if (doc.HasParseError()) {
-				ILOG_ERROR("on_request: url: %s, error: %d: could not parse document: %s, error offset: %d",
-						req.url().to_human_readable().c_str(), -EINVAL, doc.GetParseError(), doc.GetErrorOffset());
-				this->send_reply(swarm::http_response::bad_request);
-				return;
-			}
-
-			if (!doc.IsObject()) {
-				ILOG_ERROR("on_request: url: %s, error: %d: document must be object, its type: %d",
-						req.url().to_human_readable().c_str(), -EINVAL, doc.GetType());
+			if (doc.HasParseError() || !doc.IsObject()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: could not parse document or it is not an object",
+						req.url().to_human_readable().c_str(), -EINVAL);
 				this->send_reply(swarm::http_response::bad_request);
 				return;
 			}
@@ -665,42 +963,1557 @@ public:
 				return;
 			}
 
-			const rapidjson::Value &docs = greylock::get_array(doc, "docs");
-			if (!docs.IsArray()) {
-				ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'docs' must be array",
+			const rapidjson::Value &time = greylock::get_object(doc, "time");
+			if (!time.IsObject() || !time.HasMember("end")) {
+				ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'time/end' must be specified",
 						req.url().to_human_readable().c_str(), mbox, -EINVAL);
 				this->send_reply(swarm::http_response::bad_request);
 				return;
 			}
 
-			elliptics::error_info err = parse_docs(req, mbox, docs);
-			if (err) {
+			long end = greylock::get_int64(time, "end", 0);
+
+			greylock::intersect::time_range range;
+			range.set(0, end);
+
+			size_t num_dropped = 0;
+			size_t num_keys = 0;
+			elliptics::error_info err;
+
+			if (server()->partition_period()) {
+				std::vector<long> partitions = server()->list_partitions(mbox, range);
+				for (auto it = partitions.begin(), pend = partitions.end(); it != pend; ++it) {
+					if (*it + server()->partition_period() - 1 > end) {
+						// the last partition is only partially covered by the range
+						err = server()->trim_directory(server()->partition_directory(mbox, *it), range, &num_keys);
+						break;
+					}
+
+					err = server()->drop_partition(mbox, *it);
+					if (err)
+						break;
+
+					++num_dropped;
+				}
+			} else {
+				err = server()->trim_directory(server()->partition_directory(mbox, -1), range, &num_keys);
+			}
+
+			if (!err)
+				err = server()->trim_forward(mbox, range);
+
+			if (err) {
+				ILOG_ERROR("on_request: url: %s, mailbox: %s, end: %ld: retention failed: %s [%d]",
+					req.url().to_human_readable().c_str(), mbox, end, err.message(), err.code());
+				this->send_reply(swarm::http_response::service_unavailable);
+				return;
+			}
+
+			ILOG_INFO("on_request: url: %s, mailbox: %s, end: %ld, dropped partitions: %d, trimmed keys: %d, "
+					"duration: %d ms",
+					req.url().to_human_readable().c_str(), mbox, end,
+					num_dropped, num_keys, tm.elapsed());
+			this->send_reply(thevoid::http_response::ok);
+		}
+	};
+
+	// Removes documents from every index they have been inserted into.
+	//
+	// Indexes of the document are read from the forward index of the mailbox (see @greylock::forward_index),
+	// so the client only sends document ids, postings of all requested documents are removed index by index.
+	struct on_delete : public thevoid::simple_request_stream<http_server> {
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			ribosome::timer tm;
+			ILOG_INFO("url: %s: start", req.url().to_human_readable().c_str());
+
+			if (!server()->forward_enabled()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: \"application.forward-index\" is not turned on",
+						req.url().to_human_readable().c_str(), -ENOTSUP);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
+			std::string data(const_cast<char *>(boost::asio::buffer_cast<const char*>(buffer)), boost::asio::buffer_size(buffer));
+
+			rapidjson::Document doc;
+			doc.Parse<0>(data.c_str());
+
+			if (doc.HasParseError() || !doc.IsObject()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: could not parse document or it is not an object",
+						req.url().to_human_readable().c_str(), -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			const char *mbox = greylock::get_string(doc, "mailbox");
+			if (!mbox) {
+				ILOG_ERROR("on_request: url: %s, error: %d: 'mailbox' must be a string",
+						req.url().to_human_readable().c_str(), -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			const rapidjson::Value &jids = greylock::get_array(doc, "ids");
+			if (!jids.IsArray()) {
+				ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'ids' must be array",
+						req.url().to_human_readable().c_str(), mbox, -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			std::vector<std::string> ids;
+			for (auto it = jids.Begin(), end = jids.End(); it != end; ++it) {
+				if (!it->IsString()) {
+					ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'ids' must be array of strings",
+							req.url().to_human_readable().c_str(), mbox, -EINVAL);
+					this->send_reply(swarm::http_response::bad_request);
+					return;
+				}
+
+				ids.emplace_back(it->GetString(), it->GetStringLength());
+			}
+
+			size_t num_docs = 0, num_postings = 0;
+			elliptics::error_info err = server()->delete_documents(mbox, ids, &num_docs, &num_postings);
+			if (err) {
+				ILOG_ERROR("on_request: url: %s, mailbox: %s, ids: %d: deletion error: %s [%d]",
+					req.url().to_human_readable().c_str(), mbox, ids.size(), err.message(), err.code());
+				this->send_reply(swarm::http_response::service_unavailable);
+				return;
+			}
+
+			ILOG_INFO("on_request: url: %s, mailbox: %s, ids: %d, removed documents: %d, removed postings: %d, "
+					"duration: %d ms",
+					req.url().to_human_readable().c_str(), mbox, ids.size(), num_docs, num_postings, tm.elapsed());
+			this->send_reply(thevoid::http_response::ok);
+		}
+	};
+
+	struct on_index : public thevoid::simple_request_stream<http_server> {
+		elliptics::error_info process_one_document(const thevoid::http_request &req, const std::string &mbox,
+				greylock::key &doc, const rapidjson::Value &idxs) {
+			ribosome::timer all_tm;
+			ribosome::timer tm;
+
+			ILOG_INFO("process_one_document: url: %s, mailbox: %s, doc: %s: start insertion",
+					req.url().to_human_readable().c_str(), mbox.c_str(),
+					doc.str().c_str());
+
+			auto ireq = server()->get_indexes(mbox, idxs);
+
+			// all indexes of the document live in the partition its timestamp belongs to
+			long partition = -1;
+			if (server()->partition_period()) {
+				long tsec, tnsec;
+				doc.get_timestamp(&tsec, &tnsec);
+
+				// negative partition means there are no partitions
+				if (tsec < 0) {
+					return elliptics::create_error(-EINVAL, "process_one_document: url: %s, mailbox: %s, "
+							"doc: %s: negative timestamp %ld can not be partitioned",
+						req.url().to_human_readable().c_str(), mbox.c_str(),
+						doc.str().c_str(),
+						tsec);
+				}
+
+				partition = server()->partition_start(tsec);
+			}
+
+			// posting is the key inserted into every index, it references document ordinal if dictionary is enabled
+			greylock::key posting = doc;
+			unsigned long long num_documents = 0;
+			if (server()->document_ordinals()) {
+				greylock::eurl dname = server()->documents_index(mbox);
+
+				ribosome::locker<http_server> l(server(), dname.str());
+				std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+				try {
+					greylock::document_dictionary dict(*(server()->bucket()), dname);
+					uint64_t num = 0;
+					elliptics::error_info err = dict.assign(posting, &num);
+					if (err) {
+						return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+								"doc: %s: could not assign document ordinal: %s [%d]",
+							req.url().to_human_readable().c_str(), mbox.c_str(),
+							doc.str().c_str(),
+							err.message().c_str(),
+							err.code());
+					}
+
+					num_documents = num;
+				} catch (const std::exception &e) {
+					return elliptics::create_error(-EINVAL, "process_one_document: url: %s, mailbox: %s, "
+							"doc: %s: could not open document dictionary: %s",
+							req.url().to_human_readable().c_str(), mbox.c_str(),
+							doc.str().c_str(),
+							e.what());
+				}
+			}
+
+			if (partition >= 0) {
+				for (auto &iname: ireq.indexes) {
+					iname = server()->partition_index(iname, partition);
+				}
+			}
+
+			// Upsert replaces previous versions of the document, i.e. documents with the same id which have been
+			// indexed before. They are found in the forward index, their postings are removed from the indexes
+			// of this document by the same index object which inserts the new posting, postings in the indexes
+			// this document does not have anymore and in pair indexes are removed after the insertion.
+			// Without forward index, previous postings are only looked up in the indexes of this document
+			// which have id filters.
+			std::vector<greylock::forward_index::document> old_docs;
+			http_server::posting_batches stale;
+
+			// document is recorded before its postings are inserted, so that it can be deleted
+			// even if indexing fails halfway
+			if (server()->forward_enabled()) {
+				greylock::eurl fname = server()->forward_index_name(mbox);
+
+				ribosome::locker<http_server> l(server(), fname.str());
+				std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+				try {
+					greylock::forward_index fwd(*(server()->bucket()), fname);
+
+					elliptics::error_info err;
+					if (server()->upsert()) {
+						err = fwd.find(doc.id, old_docs);
+
+						// previous version with the same timestamp is replaced in the forward index right away,
+						// since its key and record are the same as those of the new version
+						for (auto it = old_docs.begin(); !err && (it != old_docs.end()); ++it) {
+							if (it->doc.timestamp == doc.timestamp)
+								err = fwd.remove(*it);
+						}
+
+						if (err) {
+							return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+									"doc: %s: could not find previous versions of the document: %s [%d]",
+								req.url().to_human_readable().c_str(), mbox.c_str(),
+								doc.str().c_str(),
+								err.message().c_str(),
+								err.code());
+						}
+					}
+
+					err = fwd.insert(doc, posting, ireq.indexes);
+					if (err) {
+						return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+								"doc: %s: could not update forward index: %s [%d]",
+							req.url().to_human_readable().c_str(), mbox.c_str(),
+							doc.str().c_str(),
+							err.message().c_str(),
+							err.code());
+					}
+				} catch (const std::exception &e) {
+					return elliptics::create_error(-EINVAL, "process_one_document: url: %s, mailbox: %s, "
+							"doc: %s: could not open forward index: %s",
+							req.url().to_human_readable().c_str(), mbox.c_str(),
+							doc.str().c_str(),
+							e.what());
+				}
+			}
+
+			size_t num_stale;
+			elliptics::error_info err = server()->add_postings(mbox, old_docs, stale, &num_stale);
+			if (err) {
+				return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+						"doc: %s: could not list pair indexes of the previous version: %s [%d]",
+					req.url().to_human_readable().c_str(), mbox.c_str(),
+					doc.str().c_str(),
+					err.message().c_str(),
+					err.code());
+			}
+
+			for (auto &b: stale) {
+				// posting of the previous version with the same timestamp is replaced by the insertion
+				if (std::find(ireq.indexes.begin(), ireq.indexes.end(), b.first) == ireq.indexes.end())
+					continue;
+
+				b.second.erase(std::remove(b.second.begin(), b.second.end(), posting), b.second.end());
+			}
+
+			for (size_t i = 0; i < ireq.indexes.size(); ++i) {
+				greylock::eurl &iname = ireq.indexes[i];
+				std::vector<size_t> &positions = ireq.positions[i];
+
+				// for every index we put vector of positions where given index is located in the document
+				// since it is an inverted index, it contains list of document links each of which contains
+				// array of the positions, where given index lives in the document
+				posting.positions.swap(positions);
+
+				// index is registered before it is created, so that directory never misses existing index
+				// even if indexing fails right after creation
+				elliptics::error_info err = server()->register_partition_index(mbox, partition, iname);
+				if (err) {
+					return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+							"doc: %s, index: %s, partition: %ld: could not register index in partition: %s [%d]",
+						req.url().to_human_readable().c_str(), mbox.c_str(),
+						doc.str().c_str(),
+						iname.str().c_str(),
+						partition,
+						err.message().c_str(),
+						err.code());
+				}
+
+				{
+					ribosome::locker<http_server> l(server(), iname.str());
+					std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+					try {
+						greylock::read_write_index index(*(server()->bucket()), iname);
+
+						std::vector<greylock::key> old;
+						auto st = stale.find(iname);
+						if (st != stale.end()) {
+							old.swap(st->second);
+							stale.erase(st);
+						} else if (server()->upsert() && !server()->forward_enabled() && index.has_filters()) {
+							elliptics::error_info err = index.find_id(posting.id, old);
+							if (err) {
+								return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+										"doc: %s, index: %s: could not find previous postings: %s [%d]",
+									req.url().to_human_readable().c_str(), mbox.c_str(),
+									doc.str().c_str(),
+									iname.str().c_str(),
+									err.message().c_str(),
+									err.code());
+							}
+
+							old.erase(std::remove(old.begin(), old.end(), posting), old.end());
+						}
+
+						for (const auto &k: old) {
+							elliptics::error_info err = index.remove(k);
+							if (err && (err.code() != -ENOENT)) {
+								return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+										"doc: %s, index: %s: could not remove previous posting %s: %s [%d]",
+									req.url().to_human_readable().c_str(), mbox.c_str(),
+									doc.str().c_str(),
+									iname.str().c_str(),
+									k.str().c_str(),
+									err.message().c_str(),
+									err.code());
+							}
+						}
+
+						elliptics::error_info err = index.insert(posting);
+						if (err) {
+							return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+									"doc: %s, index: %s: could not insert new key: %s [%d]",
+								req.url().to_human_readable().c_str(), mbox.c_str(),
+								doc.str().c_str(),
+								iname.str().c_str(),
+								err.message().c_str(),
+								err.code());
+						}
+
+						if (server()->dense_term(index.meta(), num_documents)) {
+							err = index.make_dense();
+							if (err) {
+								ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+										"doc: %s, index: %s: could not make index dense: %s [%d]",
+									req.url().to_human_readable().c_str(), mbox.c_str(),
+									doc.str().c_str(),
+									iname.str().c_str(),
+									err.message().c_str(),
+									err.code());
+							}
+						}
+
+						if (server()->id_filters() && !index.has_filters()) {
+							err = index.enable_filters();
+							if (err) {
+								ILOG_ERROR("process_one_document: url: %s, mailbox: %s, "
+										"doc: %s, index: %s: could not build id filters: %s [%d]",
+									req.url().to_human_readable().c_str(), mbox.c_str(),
+									doc.str().c_str(),
+									iname.str().c_str(),
+									err.message().c_str(),
+									err.code());
+							}
+						}
+					} catch (const std::exception &e) {
+						return elliptics::create_error(-EINVAL, "process_one_document: url: %s, mailbox: %s, "
+								"doc: %s, index: %s, exception: %s",
+								req.url().to_human_readable().c_str(), mbox.c_str(),
+								doc.str().c_str(),
+								iname.str().c_str(),
+								e.what());
+					}
+				}
+
+				ILOG_INFO("process_one_document: url: %s, mailbox: %s, "
+						"doc: %s, index: %s, elapsed time: %d ms",
+					req.url().to_human_readable().c_str(), mbox,
+					doc.str().c_str(),
+					iname.str().c_str(),
+					tm.restart());
+			}
+
+			// postings in the indexes this document is not in anymore and in pair indexes
+			if (!stale.empty()) {
+				elliptics::error_info err = server()->remove_batches(stale);
+				if (err) {
+					return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+							"doc: %s: could not remove previous postings: %s [%d]",
+						req.url().to_human_readable().c_str(), mbox.c_str(),
+						doc.str().c_str(),
+						err.message().c_str(),
+						err.code());
+				}
+			}
+
+			if (partition < 0) {
+				elliptics::error_info err = server()->update_pairs(mbox, posting, ireq.indexes);
+				if (err) {
+					return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+							"doc: %s: could not update pair indexes: %s [%d]",
+						req.url().to_human_readable().c_str(), mbox.c_str(),
+						doc.str().c_str(),
+						err.message().c_str(),
+						err.code());
+				}
+			}
+
+			// previous versions with other timestamps are forgotten once all their postings have been removed
+			for (const auto &old: old_docs) {
+				if (old.doc.timestamp == doc.timestamp)
+					continue;
+
+				greylock::eurl fname = server()->forward_index_name(mbox);
+
+				ribosome::locker<http_server> l(server(), fname.str());
+				std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+				greylock::forward_index fwd(*(server()->bucket()), fname);
+				elliptics::error_info err = server()->forget_document(mbox, fwd, old);
+				if (err) {
+					return elliptics::create_error(err.code(), "process_one_document: url: %s, mailbox: %s, "
+							"doc: %s: could not forget previous version %s: %s [%d]",
+						req.url().to_human_readable().c_str(), mbox.c_str(),
+						doc.str().c_str(),
+						old.doc.str().c_str(),
+						err.message().c_str(),
+						err.code());
+				}
+			}
+
+			ILOG_INFO("process_one_document: url: %s, mailbox: %s, doc: %s, total number of indexes: %d, "
+					"previous versions: %d, elapsed time: %d ms",
+					req.url().to_human_readable().c_str(), mbox,
+					doc.str().c_str(), ireq.indexes.size(), old_docs.size(), all_tm.elapsed());
+
+			return elliptics::error_info();
+		}
+
+		elliptics::error_info parse_docs(const thevoid::http_request &req, const std::string &mbox, const rapidjson::Value &docs) {
+			elliptics::error_info err = elliptics::create_error(-EINVAL,
+					"url: %s, mbox: %s: could not parse document, there are no valid index entries",
+					req.url().to_human_readable().c_str(), mbox.c_str());
+
+			for (auto it = docs.Begin(), id_end = docs.End(); it != id_end; ++it) {
+				if (it->IsObject()) {
+					greylock::key doc;
+
+					const char *id = greylock::get_string(*it, "id");
+					const char *bucket = greylock::get_string(*it, "bucket");
+					const char *key = greylock::get_string(*it, "key");
+					if (!bucket || !key || !id) {
+						ILOG_ERROR("parse_docs: url: %s, mailbox: %s, error: %d: 'docs/{bucket,ket,id} must be strings",
+								req.url().to_human_readable().c_str(), mbox, -EINVAL);
+						continue;
+					}
+
+					struct timespec ts;
+					clock_gettime(CLOCK_REALTIME, &ts);
+
+					const rapidjson::Value &timestamp = greylock::get_object(*it, "timestamp");
+					if (timestamp.IsObject()) {
+						long tsec, tnsec;
+
+						tsec = greylock::get_int64(timestamp, "tsec", ts.tv_sec);
+						tnsec = greylock::get_int64(timestamp, "tnsec", ts.tv_nsec);
+
+						doc.set_timestamp(tsec, tnsec);
+					} else {
+						doc.set_timestamp(ts.tv_sec, ts.tv_nsec);
+					}
+
+					doc.url.bucket.assign(bucket);
+					doc.url.key.assign(key);
+					doc.id.assign(id);
+
+					const rapidjson::Value &idxs = greylock::get_object(*it, "index");
+					if (!idxs.IsObject()) {
+						ILOG_ERROR("parse_docs: url: %s, mailbox: %s, doc: %s, error: %d: 'docs/index' must be object",
+								req.url().to_human_readable().c_str(), mbox, doc.str().c_str(), -EINVAL);
+						continue;
+					}
+
+					err = process_one_document(req, mbox, doc, idxs);
+					if (err)
+						return err;
+				}
+			}
+
+			return err;
+		}
+
+		virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+			ribosome::timer index_tm;
+			ILOG_INFO("url: %s: start", req.url().to_human_readable().c_str());
+
+			// this is needed to put ending zero-byte, otherwise rapidjson parser will explode
+			std::string data(const_cast<char *>(boost::asio::buffer_cast<const char*>(buffer)), boost::asio::buffer_size(buffer));
+
+			rapidjson::Document doc;
+			doc.Parse<0>(data.c_str());
+
+			if (doc.HasParseError()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: could not parse document: %s, error offset: %d",
+						req.url().to_human_readable().c_str(), -EINVAL, doc.GetParseError(), doc.GetErrorOffset());
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			if (!doc.IsObject()) {
+				ILOG_ERROR("on_request: url: %s, error: %d: document must be object, its type: %d",
+						req.url().to_human_readable().c_str(), -EINVAL, doc.GetType());
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			const char *mbox = greylock::get_string(doc, "mailbox");
+			if (!mbox) {
+				ILOG_ERROR("on_request: url: %s, error: %d: 'mailbox' must be a string",
+						req.url().to_human_readable().c_str(), -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			const rapidjson::Value &docs = greylock::get_array(doc, "docs");
+			if (!docs.IsArray()) {
+				ILOG_ERROR("on_request: url: %s, mailbox: %s, error: %d: 'docs' must be array",
+						req.url().to_human_readable().c_str(), mbox, -EINVAL);
+				this->send_reply(swarm::http_response::bad_request);
+				return;
+			}
+
+			elliptics::error_info err = parse_docs(req, mbox, docs);
+			if (err) {
 				ILOG_ERROR("on_request: url: %s, mailbox: %s, keys: %d: insertion error: %s [%d]",
 					req.url().to_human_readable().c_str(), mbox, docs.Size(), err.message(), err.code());
 				this->send_reply(swarm::http_response::bad_request);
 				return;
 			}
 
-			ILOG_INFO("on_request: url: %s, mailbox: %s, keys: %d: insertion completed, index duration: %d ms",
-					req.url().to_human_readable().c_str(), mbox, docs.Size(), index_tm.elapsed());
-			this->send_reply(thevoid::http_response::ok);
+			ILOG_INFO("on_request: url: %s, mailbox: %s, keys: %d: insertion completed, index duration: %d ms",
+					req.url().to_human_readable().c_str(), mbox, docs.Size(), index_tm.elapsed());
+			this->send_reply(thevoid::http_response::ok);
+		}
+	};
+
+	std::shared_ptr<ebucket::bucket_processor> bucket() {
+		return m_bucket;
+	}
+
+	void lock(const std::string &key) {
+		m_lock.lock(key);
+	}
+
+	void unlock(const std::string &key) {
+		m_lock.unlock(key);
+	}
+
+	void lock_shared(const std::string &key) {
+		m_lock.lock_shared(key);
+	}
+
+	void unlock_shared(const std::string &key) {
+		m_lock.unlock_shared(key);
+	}
+
+	const std::string &meta_bucket_name() const {
+		return m_meta_bucket;
+	}
+
+	greylock::lru_cache<std::string, search_session> &sessions() {
+		return m_sessions;
+	}
+
+	greylock::worker_pool &workers() {
+		return m_workers;
+	}
+
+	greylock::lru_cache<std::string, cached_search> &search_cache() {
+		return m_search_cache;
+	}
+
+	// larger results are not cached
+	size_t search_cache_max_documents() const {
+		return m_search_cache_max_documents;
+	}
+
+	// the largest number of the most relevant documents search can return, larger 'paging/top' is capped
+	size_t search_top_max() const {
+		return m_search_top_max;
+	}
+
+	// generation numbers of the indexes, metadata of all indexes is read concurrently
+	std::vector<cached_search::generation_t> generations(const std::vector<greylock::eurl> &indexes) {
+		std::vector<cached_search::generation_t> ret;
+		ret.reserve(indexes.size());
+
+		auto opened = greylock::read_only_index::open_all(*m_bucket, indexes);
+		for (const auto &idx: opened) {
+			if (!idx) {
+				ret.emplace_back(0, 0);
+				continue;
+			}
+
+			greylock::index_meta meta = idx->meta();
+			ret.emplace_back(meta.generation_number_sec, meta.generation_number_nsec);
+		}
+
+		return ret;
+	}
+
+	std::string generate_session_id() {
+		std::lock_guard<std::mutex> guard(m_session_rng_lock);
+
+		char tmp[64];
+		snprintf(tmp, sizeof(tmp), "%016llx%016llx",
+				(unsigned long long)m_session_rng(), (unsigned long long)m_session_rng());
+		return tmp;
+	}
+
+	// documents are spread over time partitions of this many seconds, zero means there are no partitions
+	long partition_period() const {
+		return m_partition_period;
+	}
+
+	// returns start time (in seconds) of the partition which hosts documents with given timestamp,
+	// @tsec must not be negative
+	long partition_start(long tsec) const {
+		return tsec - tsec % m_partition_period;
+	}
+
+	// index which hosts given token for the documents within given partition
+	greylock::eurl partition_index(const greylock::eurl &iname, long partition) const {
+		greylock::eurl ret = iname;
+		ret.key += "@" + std::to_string(partition);
+		return ret;
+	}
+
+	greylock::intersect::query partition_query(const greylock::intersect::query &q, long partition) const {
+		auto convert = [&] (const std::vector<greylock::eurl> &indexes) {
+			std::vector<greylock::eurl> ret;
+			ret.reserve(indexes.size());
+			for (auto it = indexes.begin(), end = indexes.end(); it != end; ++it) {
+				ret.push_back(partition_index(*it, partition));
+			}
+			return ret;
+		};
+
+		greylock::intersect::query ret(convert(q.required));
+		for (auto it = q.unions.begin(), end = q.unions.end(); it != end; ++it) {
+			ret.unions.push_back(convert(*it));
+		}
+		ret.excluded = convert(q.excluded);
+		return ret;
+	}
+
+	// directory of all indexes created within given mailbox partition, key ID is the index name,
+	// negative partition is used for the directory of the mailbox whose indexes are not partitioned
+	greylock::eurl partition_directory(const std::string &mbox, long partition) {
+		greylock::eurl ret;
+		ret.bucket = meta_bucket_name();
+		if (partition < 0)
+			ret.key = index_name(mbox, "@indexes", "");
+		else
+			ret.key = index_name(mbox, "@partition", std::to_string(partition));
+		return ret;
+	}
+
+	// dictionary of the mailbox documents, see @greylock::document_dictionary
+	greylock::eurl documents_index(const std::string &mbox) {
+		greylock::eurl ret;
+		ret.bucket = meta_bucket_name();
+		ret.key = index_name(mbox, "@documents", "");
+		return ret;
+	}
+
+	bool document_ordinals() const {
+		return m_document_ordinals;
+	}
+
+	// indexes of every mailbox document, see @greylock::forward_index
+	greylock::eurl forward_index_name(const std::string &mbox) {
+		greylock::eurl ret;
+		ret.bucket = meta_bucket_name();
+		ret.key = index_name(mbox, "@forward", "");
+		return ret;
+	}
+
+	bool forward_enabled() const {
+		return m_forward_index;
+	}
+
+	// returns true if indexing replaces previous versions of the document, see @on_index::process_one_document()
+	bool upsert() const {
+		return m_upsert;
+	}
+
+	// Removes documents with given ids from all their indexes, including pair indexes, then from the dictionary
+	// and the forward index. Postings are grouped by index, so that every index is opened and its metadata
+	// is written once per request, indexes are processed in parallel in the worker pool.
+	elliptics::error_info delete_documents(const std::string &mbox, const std::vector<std::string> &ids,
+			size_t *num_docs, size_t *num_postings) {
+		*num_docs = 0;
+		*num_postings = 0;
+
+		greylock::eurl fname = forward_index_name(mbox);
+
+		ribosome::locker<http_server> l(this, fname.str());
+		std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+		greylock::forward_index fwd(*bucket(), fname);
+
+		std::vector<greylock::forward_index::document> docs;
+		for (const auto &id: ids) {
+			std::vector<greylock::forward_index::document> found;
+			elliptics::error_info err = fwd.find(id, found);
+			if (err)
+				return err;
+
+			docs.insert(docs.end(), found.begin(), found.end());
+		}
+
+		posting_batches batches;
+		elliptics::error_info err = add_postings(mbox, docs, batches, num_postings);
+		if (err)
+			return err;
+
+		err = remove_batches(batches);
+		if (err)
+			return err;
+
+		for (const auto &d: docs) {
+			err = forget_document(mbox, fwd, d);
+			if (err)
+				return err;
+		}
+
+		*num_docs = docs.size();
+		return elliptics::error_info();
+	}
+
+	// postings to be removed grouped by index
+	typedef std::map<greylock::eurl, std::vector<greylock::key>> posting_batches;
+
+	// adds postings of @docs to @batches for every their index and every pair index of them,
+	// @num_postings is set to the number of added postings
+	elliptics::error_info add_postings(const std::string &mbox,
+			const std::vector<greylock::forward_index::document> &docs,
+			posting_batches &batches, size_t *num_postings) {
+		*num_postings = 0;
+
+		std::vector<index_pair> pairs;
+		if (pairs_enabled() && !docs.empty()) {
+			elliptics::error_info err = list_pairs(mbox, pairs);
+			if (err)
+				return err;
+		}
+
+		size_t num = 0;
+		for (const auto &d: docs) {
+			auto has = [&] (const greylock::eurl &url) {
+				return std::find(d.indexes.begin(), d.indexes.end(), url) != d.indexes.end();
+			};
+
+			std::vector<greylock::eurl> indexes = d.indexes;
+			for (const auto &p: pairs) {
+				if (has(p.first) && has(p.second))
+					indexes.push_back(p.index);
+			}
+
+			for (const auto &iname: indexes) {
+				batches[iname].push_back(d.posting);
+			}
+
+			num += indexes.size();
+		}
+
+		*num_postings = num;
+		return elliptics::error_info();
+	}
+
+	// removes every batch from its index, indexes are processed in parallel in the worker pool
+	elliptics::error_info remove_batches(const posting_batches &batches) {
+		std::vector<std::future<elliptics::error_info>> results;
+		for (const auto &b: batches) {
+			auto task = std::make_shared<std::packaged_task<elliptics::error_info ()>>(
+					std::bind(&http_server::remove_postings, this, b.first, b.second));
+			results.emplace_back(task->get_future());
+
+			if (!m_workers.submit([task] () {(*task)();}))
+				(*task)();
+		}
+
+		elliptics::error_info ret;
+		for (auto &r: results) {
+			elliptics::error_info err = r.get();
+			if (err && !ret.code())
+				ret = err;
+		}
+
+		return ret;
+	}
+
+	// removes document whose postings have already been removed from the dictionary and the forward index,
+	// caller holds the lock of the forward index
+	elliptics::error_info forget_document(const std::string &mbox, greylock::forward_index &fwd,
+			const greylock::forward_index::document &d) {
+		if (greylock::document_dictionary::is_ordinal_id(d.posting.id)) {
+			greylock::eurl dname = documents_index(mbox);
+
+			ribosome::locker<http_server> dl(this, dname.str());
+			std::unique_lock<ribosome::locker<http_server>> dlk(dl);
+
+			try {
+				greylock::document_dictionary dict(*bucket(), dname);
+				elliptics::error_info err = dict.erase(d.doc);
+				if (err)
+					return err;
+			} catch (const std::exception &e) {
+				return elliptics::create_error(-EINVAL, "dictionary: %s: exception: %s",
+						dname.str().c_str(), e.what());
+			}
+		}
+
+		try {
+			return fwd.remove(d);
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "forward index: %s: exception: %s",
+					forward_index_name(mbox).str().c_str(), e.what());
+		}
+	}
+
+	// removes @postings from the index, index which does not exist is not created,
+	// postings which are not in the index are skipped
+	//
+	// it runs in the worker pool and must not throw
+	elliptics::error_info remove_postings(const greylock::eurl &iname, const std::vector<greylock::key> &postings) {
+		ribosome::locker<http_server> l(this, iname.str());
+		std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+		try {
+			greylock::read_only_index existing(*bucket(), iname);
+		} catch (const std::exception &e) {
+			ILOG_INFO("remove_postings: index: %s: there is no such index: %s", iname.str(), e.what());
+			return elliptics::error_info();
+		}
+
+		try {
+			greylock::read_write_index index(*bucket(), iname);
+
+			for (const auto &k: postings) {
+				elliptics::error_info err = index.remove(k);
+				if (err && (err.code() != -ENOENT))
+					return err;
+			}
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "index: %s: exception: %s",
+					iname.str().c_str(), e.what());
+		}
+
+		return elliptics::error_info();
+	}
+
+	// removes documents within @range from the forward index
+	elliptics::error_info trim_forward(const std::string &mbox, const greylock::intersect::time_range &range) {
+		if (!forward_enabled())
+			return elliptics::error_info();
+
+		greylock::eurl fname = forward_index_name(mbox);
+
+		ribosome::locker<http_server> l(this, fname.str());
+		std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+		try {
+			greylock::read_only_index existing(*bucket(), fname);
+		} catch (const std::exception &e) {
+			// there is no forward index, nothing has been indexed yet
+			return elliptics::error_info();
+		}
+
+		try {
+			greylock::forward_index fwd(*bucket(), fname);
+			return fwd.remove_range(range.start_key(), range.end_key());
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "forward index: %s: exception: %s",
+					fname.str().c_str(), e.what());
+		}
+	}
+
+	// returns true if index contains so large share of the mailbox documents, that it has to become dense,
+	// see @greylock::index::make_dense()
+	bool dense_term(const greylock::index_meta &meta, unsigned long long num_documents) const {
+		return m_dense_term_ratio && num_documents && !meta.dense &&
+			(meta.num_keys >= m_dense_term_min_keys) &&
+			(meta.num_keys * 100 >= num_documents * m_dense_term_ratio);
+	}
+
+	// returns true if modified indexes have to keep filters of document ids, see @greylock::index::enable_filters()
+	bool id_filters() const {
+		return m_id_filters;
+	}
+
+	// restores ids and urls of the returned documents which reference ordinals,
+	// document which is missing in the dictionary is dropped from the result
+	void hydrate_documents(const std::string &mbox, greylock::intersect::result &result) {
+		auto need = [] (const greylock::intersect::single_doc_result &rs) {
+			return greylock::document_dictionary::is_ordinal_id(rs.doc.id);
+		};
+		if (std::none_of(result.docs.begin(), result.docs.end(), need))
+			return;
+
+		// dictionary is opened once for the whole result
+		greylock::eurl dname = documents_index(mbox);
+		greylock::document_dictionary dict(*bucket(), dname);
+		std::unique_ptr<greylock::read_only_index> dindex;
+		try {
+			dindex.reset(new greylock::read_only_index(*bucket(), dname));
+		} catch (const std::exception &e) {
+			ILOG_ERROR("mailbox: %s: could not open document dictionary %s: %s",
+					mbox, dname.str(), e.what());
+		}
+
+		auto it = std::remove_if(result.docs.begin(), result.docs.end(),
+				[&] (greylock::intersect::single_doc_result &rs) {
+			if (!need(rs))
+				return false;
+
+			elliptics::error_info err = dindex ? dict.hydrate(*dindex, rs.doc) :
+				elliptics::create_error(-ENOENT, "there is no document dictionary");
+			if (err) {
+				ILOG_ERROR("mailbox: %s, doc: %s: could not restore document: %s [%d]",
+						mbox, rs.doc.str(), err.message(), err.code());
+				return true;
+			}
+
+			return false;
+		});
+		result.docs.erase(it, result.docs.end());
+	}
+
+	// Pair index is a precomputed intersection of two indexes of the same mailbox,
+	// it hosts postings of the documents which are present in both of them.
+	//
+	// Pair index is filled from its two indexes once (see @build_pair()) and is then updated by the indexing,
+	// search uses ready pair index as a hint (see @greylock::intersect::query::hints), so that intersection
+	// is led by the documents which have both words instead of walking two large indexes.
+	// Pair indexes are not supported for partitioned mailboxes.
+	struct index_pair {
+		greylock::eurl first, second;
+		greylock::eurl index;
+		bool ready = false;
+
+		// key ID in the registry of the mailbox pairs
+		std::string id() const {
+			return first.key + std::string(1, '\0') + second.key;
+		}
+	};
+
+	index_pair pair_of(const greylock::eurl &a, const greylock::eurl &b) const {
+		index_pair ret;
+		ret.first = (a < b) ? a : b;
+		ret.second = (a < b) ? b : a;
+		ret.index.bucket = ret.first.bucket;
+		ret.index.key = ret.first.key + "&" + ret.second.key;
+		return ret;
+	}
+
+	// registry of the pair indexes of the mailbox, key ID is @index_pair::id(), key url is the pair index,
+	// positions[0] is non-zero if pair index has been filled and can be used by the search
+	greylock::eurl pairs_index(const std::string &mbox) {
+		greylock::eurl ret;
+		ret.bucket = meta_bucket_name();
+		ret.key = index_name(mbox, "@pairs", "");
+		return ret;
+	}
+
+	bool pairs_enabled() const {
+		return !m_pair_config.empty() || m_pair_hot_queries;
+	}
+
+	// Returns pairs of the mailbox from the in-memory snapshot of its registry, so that searches and indexing
+	// do not read the registry. Snapshot is read from the registry when the mailbox is met for the first time
+	// (or its snapshot has been evicted), after that it is only changed by @register_pair().
+	// Registry which could not be read is not cached, the error is returned and the next call reads it again.
+	elliptics::error_info list_pairs(const std::string &mbox, std::vector<index_pair> &pairs) {
+		auto snapshot = m_pair_snapshots.get(mbox);
+		if (snapshot) {
+			pairs = *snapshot;
+			return elliptics::error_info();
+		}
+
+		// snapshot is read under the registry lock, so that concurrent registration is not lost
+		greylock::eurl rname = pairs_index(mbox);
+		ribosome::locker<http_server> l(this, rname.str());
+		std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+		snapshot = m_pair_snapshots.get(mbox);
+		if (snapshot) {
+			pairs = *snapshot;
+			return elliptics::error_info();
+		}
+
+		auto read = std::make_shared<std::vector<index_pair>>();
+		elliptics::error_info err = read_pairs(rname, *read);
+		if (err)
+			return err;
+
+		m_pair_snapshots.insert(mbox, read);
+		pairs = *read;
+		return elliptics::error_info();
+	}
+
+	// reads pairs from the registry, missing registry means that mailbox does not have pair indexes
+	elliptics::error_info read_pairs(const greylock::eurl &rname, std::vector<index_pair> &ret) {
+		ret.clear();
+
+		try {
+			greylock::read_only_index registry(*bucket(), rname);
+			for (auto it = registry.begin(), end = registry.end(); it != end; ++it) {
+				size_t sep = it->id.find('\0');
+				if (sep == std::string::npos)
+					continue;
+
+				index_pair p;
+				p.first.bucket = p.second.bucket = it->url.bucket;
+				p.first.key = it->id.substr(0, sep);
+				p.second.key = it->id.substr(sep + 1);
+				p.index = it->url;
+				p.ready = !it->positions.empty() && it->positions[0];
+				ret.push_back(p);
+			}
+		} catch (const elliptics::error &e) {
+			// read-only index reports missing metadata as -EROFS
+			ret.clear();
+			if ((e.error_code() == -ENOENT) || (e.error_code() == -EROFS))
+				return elliptics::error_info();
+
+			return elliptics::create_error(e.error_code(), "pairs registry: %s: could not read registry: %s",
+					rname.str().c_str(), e.what());
+		} catch (const std::exception &e) {
+			ret.clear();
+			return elliptics::create_error(-EINVAL, "pairs registry: %s: could not read registry: %s",
+					rname.str().c_str(), e.what());
+		}
+
+		return elliptics::error_info();
+	}
+
+	elliptics::error_info register_pair(const std::string &mbox, const index_pair &p, bool ready) {
+		greylock::eurl rname = pairs_index(mbox);
+
+		try {
+			ribosome::locker<http_server> l(this, rname.str());
+			std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+			greylock::read_write_index registry(*bucket(), rname);
+
+			greylock::key k;
+			k.id = p.id();
+			k.url = p.index;
+			k.positions.assign(1, ready ? 1 : 0);
+
+			elliptics::error_info err = registry.insert(k);
+			if (err)
+				return err;
+
+			// snapshot is only updated if it exists, otherwise it is read from the registry when needed
+			auto snapshot = m_pair_snapshots.get(mbox);
+			if (snapshot) {
+				auto pairs = std::make_shared<std::vector<index_pair>>(*snapshot);
+
+				index_pair rp = p;
+				rp.ready = ready;
+
+				auto found = std::find_if(pairs->begin(), pairs->end(),
+						[&] (const index_pair &e) {return e.id() == rp.id();});
+				if (found != pairs->end())
+					*found = rp;
+				else
+					pairs->push_back(rp);
+
+				m_pair_snapshots.insert(mbox, pairs);
+			}
+
+			return elliptics::error_info();
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "pairs registry: %s: exception: %s",
+					rname.str().c_str(), e.what());
+		}
+	}
+
+	// Registers pair as being built, so that indexing starts updating it, then intersects its two indexes
+	// and inserts every found document into the pair index, and finally marks pair ready.
+	// Documents indexed while pair is being built are inserted by the indexing, documents indexed before
+	// the registration are found by the intersection, since it starts after that.
+	elliptics::error_info build_pair(const std::string &mbox, const index_pair &p) {
+		ribosome::timer tm;
+
+		elliptics::error_info err = register_pair(mbox, p, false);
+		if (err)
+			return err;
+
+		std::vector<std::string> names{p.first.str(), p.second.str()};
+		std::sort(names.begin(), names.end());
+
+		greylock::intersect::query q(std::vector<greylock::eurl>{p.first, p.second});
+		greylock::intersect::intersector inter(*bucket());
+
+		std::string cookie;
+		size_t num_keys = 0;
+		bool completed = false;
+
+		// indexes are only locked while the next batch is being read, cookie resumes intersection after that
+		while (!completed) {
+			greylock::intersect::result res;
+
+			try {
+				ribosome::locker<http_server> l1(this, names[0]);
+				std::unique_lock<ribosome::locker<http_server>> lk1(l1);
+				ribosome::locker<http_server> l2(this, names[1]);
+				std::unique_lock<ribosome::locker<http_server>> lk2(l2);
+
+				auto st = greylock::intersect::state::open(*bucket(), q, cookie);
+				res = inter.intersect(*st, cookie, pair_build_batch,
+						[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) {return true;});
+			} catch (const std::exception &e) {
+				return elliptics::create_error(-EINVAL, "pair index: %s: intersection failed: %s",
+						p.index.str().c_str(), e.what());
+			}
+
+			completed = res.completed;
+			if (res.docs.empty())
+				continue;
+
+			// pair index is trimmed by the retention together with all other indexes of the mailbox
+			err = register_partition_index(mbox, -1, p.index);
+			if (err)
+				return err;
+
+			try {
+				ribosome::locker<http_server> l(this, p.index.str());
+				std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+				greylock::read_write_index index(*bucket(), p.index);
+				for (auto &rs: res.docs) {
+					err = index.insert(rs.doc);
+					if (err)
+						return err;
+				}
+			} catch (const std::exception &e) {
+				return elliptics::create_error(-EINVAL, "pair index: %s: exception: %s",
+						p.index.str().c_str(), e.what());
+			}
+
+			num_keys += res.docs.size();
+		}
+
+		err = register_pair(mbox, p, true);
+		if (err)
+			return err;
+
+		ILOG_INFO("build_pair: mailbox: %s, pair index: %s, keys: %d, duration: %d ms",
+				mbox, p.index.str(), num_keys, tm.elapsed());
+		return elliptics::error_info();
+	}
+
+	// builds pair index in the background by @m_pair_builders unless it is already being built by this server,
+	// pair is never built by the calling thread, since that would stall the search or indexing request
+	void request_pair(const std::string &mbox, const index_pair &p) {
+		const std::string name = mbox + std::string(1, '\0') + p.id();
+		{
+			std::lock_guard<std::mutex> guard(m_pairs_lock);
+			if (!m_pairs_building.insert(name).second)
+				return;
+		}
+
+		greylock::worker_pool::task_t task = [this, mbox, p, name] () {
+			elliptics::error_info err;
+			try {
+				err = build_pair(mbox, p);
+			} catch (const std::exception &e) {
+				err = elliptics::create_error(-EINVAL, "%s", e.what());
+			}
+
+			if (err) {
+				ILOG_ERROR("build_pair: mailbox: %s, pair index: %s: could not build pair index: %s [%d]",
+						mbox, p.index.str(), err.message(), err.code());
+			}
+
+			std::lock_guard<std::mutex> guard(m_pairs_lock);
+			m_pairs_building.erase(name);
+		};
+
+		if (!m_pair_builders.submit(std::move(task))) {
+			ILOG_ERROR("build_pair: mailbox: %s, pair index: %s: pair builders are not running",
+					mbox, p.index.str());
+
+			std::lock_guard<std::mutex> guard(m_pairs_lock);
+			m_pairs_building.erase(name);
 		}
-	};
+	}
 
-	std::shared_ptr<ebucket::bucket_processor> bucket() {
-		return m_bucket;
+	// pairs of the mailbox indexes listed in "pair-indexes" config
+	std::vector<index_pair> configured_pairs(const std::string &mbox) {
+		std::vector<index_pair> ret;
+		for (const auto &c: m_pair_config) {
+			greylock::eurl a, b;
+			a.bucket = b.bucket = meta_bucket_name();
+			a.key = index_name(mbox, c.aname, c.first);
+			b.key = index_name(mbox, c.aname, c.second);
+			ret.push_back(pair_of(a, b));
+		}
+
+		return ret;
 	}
 
-	void lock(const std::string &key) {
-		m_lock.lock(key);
+	// counts searches which required given pair, returns true once pair has become hot
+	bool hot_pair(const std::string &mbox, const index_pair &p) {
+		if (!m_pair_hot_queries)
+			return false;
+
+		const std::string name = mbox + std::string(1, '\0') + p.id();
+		auto hits = m_pair_hits.get(name);
+		if (!hits) {
+			hits = std::make_shared<pair_hits>();
+			m_pair_hits.insert(name, hits);
+		}
+
+		return ++hits->count >= m_pair_hot_queries;
 	}
 
-	void unlock(const std::string &key) {
-		m_lock.unlock(key);
+	// Adds ready pair indexes of the required query indexes to the query hints.
+	// Pair which is configured or has been required by many searches is built for the following searches.
+	void pair_hints(const std::string &mbox, indexes_request &ireq) {
+		if (!pairs_enabled() || (ireq.indexes.size() < 2))
+			return;
+
+		std::vector<index_pair> pairs;
+		elliptics::error_info err = list_pairs(mbox, pairs);
+		if (err) {
+			// hints only speed search up, it goes on without them
+			ILOG_ERROR("pair_hints: mailbox: %s: could not list pair indexes: %s [%d]",
+					mbox.c_str(), err.message().c_str(), err.code());
+			return;
+		}
+
+		std::vector<index_pair> configured = configured_pairs(mbox);
+
+		// the number of pairs grows quadratically, only the first query words are paired
+		size_t num = std::min<size_t>(ireq.indexes.size(), pair_max_words);
+		for (size_t i = 0; i < num; ++i) {
+			for (size_t j = i + 1; j < num; ++j) {
+				index_pair p = pair_of(ireq.indexes[i], ireq.indexes[j]);
+
+				auto found = std::find_if(pairs.begin(), pairs.end(),
+						[&] (const index_pair &e) {return e.id() == p.id();});
+				if ((found != pairs.end()) && found->ready) {
+					ireq.hints.push_back(found->index);
+					continue;
+				}
+
+				bool is_configured = std::any_of(configured.begin(), configured.end(),
+						[&] (const index_pair &e) {return e.id() == p.id();});
+				if (is_configured || hot_pair(mbox, p))
+					request_pair(mbox, p);
+			}
+		}
 	}
 
-	const std::string &meta_bucket_name() const {
-		return m_meta_bucket;
+	// Inserts posting of the document into every pair index whose both indexes are among @indexes,
+	// configured pairs which have not been built for this mailbox yet are requested.
+	elliptics::error_info update_pairs(const std::string &mbox, const greylock::key &posting,
+			const std::vector<greylock::eurl> &indexes) {
+		if (!pairs_enabled())
+			return elliptics::error_info();
+
+		auto has = [&] (const greylock::eurl &url) {
+			return std::find(indexes.begin(), indexes.end(), url) != indexes.end();
+		};
+
+		std::vector<index_pair> pairs;
+		elliptics::error_info err = list_pairs(mbox, pairs);
+		if (err)
+			return err;
+
+		greylock::key k = posting;
+		k.positions.clear();
+
+		for (const auto &p: pairs) {
+			if (!has(p.first) || !has(p.second))
+				continue;
+
+			ribosome::locker<http_server> l(this, p.index.str());
+			std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+			try {
+				greylock::read_write_index index(*bucket(), p.index);
+
+				elliptics::error_info err = index.insert(k);
+				if (err)
+					return err;
+			} catch (const std::exception &e) {
+				return elliptics::create_error(-EINVAL, "pair index: %s: exception: %s",
+						p.index.str().c_str(), e.what());
+			}
+		}
+
+		for (const auto &p: configured_pairs(mbox)) {
+			if (!has(p.first) || !has(p.second))
+				continue;
+
+			auto found = std::find_if(pairs.begin(), pairs.end(),
+					[&] (const index_pair &e) {return e.id() == p.id();});
+			if (found == pairs.end())
+				request_pair(mbox, p);
+		}
+
+		return elliptics::error_info();
+	}
+
+	// list of all partitions of the mailbox, key timestamp is the partition start time
+	greylock::eurl partitions_index(const std::string &mbox) {
+		greylock::eurl ret;
+		ret.bucket = meta_bucket_name();
+		ret.key = index_name(mbox, "@partitions", "");
+		return ret;
+	}
+
+	std::string encode_partition_cookie(long partition, const std::string &cookie) const {
+		return std::to_string(partition) + ":" + cookie;
+	}
+
+	// cookie which does not start with partition is ignored, iteration starts from the first partition
+	void decode_partition_cookie(const std::string &data, long *partition, std::string *cookie) const {
+		*partition = -1;
+		cookie->clear();
+
+		size_t pos = data.find(':');
+		if (pos == std::string::npos || pos == 0)
+			return;
+
+		char *end;
+		long p = strtol(data.c_str(), &end, 10);
+		if (end != data.c_str() + pos || p < 0)
+			return;
+
+		*partition = p;
+		cookie->assign(data.substr(pos + 1));
+	}
+
+	// returns start times of the mailbox partitions which overlap with @range, in ascending order
+	std::vector<long> list_partitions(const std::string &mbox, const greylock::intersect::time_range &range) {
+		std::vector<long> ret;
+
+		greylock::eurl pname = partitions_index(mbox);
+		ribosome::locker<http_server> l(this, pname.str());
+		std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+		try {
+			greylock::read_only_index pindex(*bucket(), pname);
+
+			for (auto it = pindex.begin(), end = pindex.end(); it != end; ++it) {
+				long tsec, tnsec;
+				it->get_timestamp(&tsec, &tnsec);
+
+				greylock::key last;
+				last.set_timestamp(tsec + m_partition_period, 0);
+
+				if (it->timestamp > range.end)
+					break;
+				if (last.timestamp <= range.start)
+					continue;
+
+				ret.push_back(tsec);
+			}
+		} catch (const std::exception &e) {
+			// there is no partitions index, mailbox does not have any documents yet
+		}
+
+		return ret;
+	}
+
+	// Adds partition index into partition directory and partition directory into the list of mailbox partitions
+	// unless they are already there. It is called before every insertion into the index, so that registration
+	// interrupted by a failure is completed by the next insertion, indexes which have been registered
+	// by this server are remembered in @m_registered and are not looked up again.
+	elliptics::error_info register_partition_index(const std::string &mbox, long partition, const greylock::eurl &iname) {
+		if (m_registered.get(iname.str()))
+			return elliptics::error_info();
+
+		greylock::eurl dname = partition_directory(mbox, partition);
+
+		greylock::key k;
+		k.id = iname.key;
+		k.url = iname;
+
+		elliptics::error_info err = register_key(dname, k);
+		if (err)
+			return err;
+
+		if (partition >= 0) {
+			greylock::key pk;
+			pk.id = std::to_string(partition);
+			pk.url = dname;
+			pk.set_timestamp(partition, 0);
+
+			err = register_key(partitions_index(mbox), pk);
+			if (err)
+				return err;
+		}
+
+		m_registered.insert(iname.str(), std::make_shared<long>(partition));
+		return elliptics::error_info();
+	}
+
+	// inserts @k into the index @iname if it is not there yet
+	elliptics::error_info register_key(const greylock::eurl &iname, const greylock::key &k) {
+		ribosome::locker<http_server> l(this, iname.str());
+		std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+		try {
+			greylock::read_only_index existing(*bucket(), iname);
+			if (existing.search(k) == k)
+				return elliptics::error_info();
+		} catch (const std::exception &e) {
+			// there is no such index yet, it is created below
+		}
+
+		try {
+			greylock::read_write_index index(*bucket(), iname);
+
+			elliptics::error_info err = index.insert(k);
+			if (err)
+				return err;
+
+			ILOG_INFO("register_key: index: %s, key: %s: has been registered, created: %d",
+					iname.str(), k.str(), index.created());
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "index: %s: exception: %s",
+					iname.str().c_str(), e.what());
+		}
+
+		return elliptics::error_info();
+	}
+
+	// drops all indexes of the partition, its directory, and then removes partition from the list,
+	// if some index could not be dropped, partition stays in the list and drop can be retried
+	elliptics::error_info drop_partition(const std::string &mbox, long partition) {
+		greylock::eurl dname = partition_directory(mbox, partition);
+		size_t num_indexes = 0;
+
+		try {
+			ribosome::locker<http_server> l(this, dname.str());
+			std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+			greylock::read_write_index dir(*bucket(), dname);
+
+			for (auto it = dir.begin(), end = dir.end(); it != end; ++it) {
+				ribosome::locker<http_server> il(this, it->url.str());
+				std::unique_lock<ribosome::locker<http_server>> ilk(il);
+
+				greylock::read_write_index index(*bucket(), it->url);
+				elliptics::error_info err = index.drop();
+				if (err)
+					return err;
+
+				m_registered.remove(it->url.str());
+				++num_indexes;
+			}
+
+			elliptics::error_info err = dir.drop();
+			if (err)
+				return err;
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "partition directory: %s: exception: %s",
+					dname.str().c_str(), e.what());
+		}
+
+		greylock::eurl pname = partitions_index(mbox);
+
+		try {
+			ribosome::locker<http_server> l(this, pname.str());
+			std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+			greylock::read_write_index pindex(*bucket(), pname);
+
+			greylock::key k;
+			k.id = std::to_string(partition);
+			k.url = dname;
+			k.set_timestamp(partition, 0);
+
+			elliptics::error_info err = pindex.remove(k);
+			if (err)
+				return err;
+		} catch (const std::exception &e) {
+			return elliptics::create_error(-EINVAL, "partitions index: %s: exception: %s",
+					pname.str().c_str(), e.what());
+		}
+
+		ILOG_INFO("drop_partition: mailbox: %s, partition: %ld, dropped indexes: %d", mbox, partition, num_indexes);
+		return elliptics::error_info();
+	}
+
+	// removes keys within @range from every index listed in the directory,
+	// indexes are trimmed in place, they are not removed even if they become empty
+	elliptics::error_info trim_directory(const greylock::eurl &dname, const greylock::intersect::time_range &range,
+			size_t *num_keys) {
+		*num_keys = 0;
+
+		ribosome::locker<http_server> l(this, dname.str());
+		std::unique_lock<ribosome::locker<http_server>> lk(l);
+
+		std::vector<greylock::key> indexes;
+		try {
+			greylock::read_only_index dir(*bucket(), dname);
+			indexes = dir.keys();
+		} catch (const std::exception &e) {
+			// there is no directory, nothing has been indexed yet
+			return elliptics::error_info();
+		}
+
+		for (auto it = indexes.begin(), end = indexes.end(); it != end; ++it) {
+			ribosome::locker<http_server> il(this, it->url.str());
+			std::unique_lock<ribosome::locker<http_server>> ilk(il);
+
+			try {
+				greylock::read_write_index index(*bucket(), it->url);
+
+				size_t removed = 0;
+				elliptics::error_info err = index.remove_range(range.start_key(), range.end_key(), &removed);
+				if (err)
+					return err;
+
+				*num_keys += removed;
+			} catch (const std::exception &e) {
+				return elliptics::create_error(-EINVAL, "index: %s: exception: %s",
+						it->url.str().c_str(), e.what());
+			}
+		}
+
+		ILOG_INFO("trim_directory: directory: %s, range: %s, indexes: %d, removed keys: %d",
+				dname.str(), range.str(), indexes.size(), *num_keys);
+		return elliptics::error_info();
 	}
 
 	indexes_request get_indexes(const std::string &mbox, const rapidjson::Value &idxs) {
@@ -733,11 +2546,15 @@ public:
 					ireq.positions.push_back(v);
 					ireq.indexes.push_back(url);
 
-					sa.ivec.push_back(pos);
+					sa.ivec.push_back(sa.apos.size());
+					sa.apos.push_back(ireq.indexes.size() - 1);
 				} else {
+					// index name contains attribute name, thus repeated word belongs to the current attribute
 					size_t idx = std::distance(ireq.indexes.begin(), f);
 					ireq.positions[idx].push_back(pos);
-					sa.ivec.push_back(idx);
+
+					auto a = std::find(sa.apos.begin(), sa.apos.end(), idx);
+					sa.ivec.push_back(std::distance(sa.apos.begin(), a));
 				}
 			}
 
@@ -757,16 +2574,78 @@ public:
 
 
 private:
-	ribosome::vector_lock m_lock;
+	greylock::shared_vector_lock m_lock;
 
 	std::shared_ptr<elliptics::node> m_node;
 
 	std::string m_meta_bucket;
 	std::shared_ptr<ebucket::bucket_processor> m_bucket;
 
+	greylock::lru_cache<std::string, search_session> m_sessions;
+
+	greylock::lru_cache<std::string, cached_search> m_search_cache;
+	size_t m_search_cache_max_documents = 1000;
+	size_t m_search_top_max = 1000;
+	std::mutex m_session_rng_lock;
+	std::mt19937_64 m_session_rng{std::random_device()()};
+
 	long m_read_timeout = 60;
 	long m_write_timeout = 60;
 
+	long m_partition_period = 0;
+
+	// indexes which are known to be listed in their directories (see @register_partition_index()),
+	// value is the partition of the index
+	greylock::lru_cache<std::string, long> m_registered;
+
+	bool m_document_ordinals = false;
+
+	// pairs of words of the same attribute which have pair indexes in every mailbox, see @index_pair
+	struct pair_config {
+		std::string aname;
+		std::string first, second;
+	};
+	std::vector<pair_config> m_pair_config;
+
+	enum {
+		// documents are inserted into the pair index being built in batches of this size
+		pair_build_batch = 1000,
+
+		// only pairs of this many first required query words are used and counted
+		pair_max_words = 4,
+	};
+
+	// pair is built once it has been required by this number of searches, zero disables hot pairs
+	long m_pair_hot_queries = 0;
+	greylock::lru_cache<std::string, pair_hits> m_pair_hits;
+
+	// pairs which are being built by this server
+	std::mutex m_pairs_lock;
+	std::set<std::string> m_pairs_building;
+
+	// pairs of the mailbox registries, see @list_pairs()
+	greylock::lru_cache<std::string, const std::vector<index_pair>> m_pair_snapshots;
+
+	// percentage of the mailbox documents and the number of keys index must have to become dense
+	unsigned long long m_dense_term_ratio = 0;
+	unsigned long long m_dense_term_min_keys = 10000;
+
+	// when true, every index modified by ingestion gets filters of its document ids
+	bool m_id_filters = false;
+
+	// when true, indexes of every document are recorded in the forward index of its mailbox
+	bool m_forward_index = false;
+
+	// when true, indexing removes previous postings of the document
+	bool m_upsert = false;
+
+	// threads which build pair indexes, see @request_pair()
+	greylock::worker_pool m_pair_builders;
+
+	// CPU bound search processing, it is declared last, since its threads use all other members
+	// and have to be stopped first
+	greylock::worker_pool m_workers;
+
 	bool elliptics_init(const rapidjson::Value &config) {
 		dnet_config node_config;
 		memset(&node_config, 0, sizeof(node_config));
@@ -919,6 +2798,181 @@ private:
 				ioremap::greylock::default_reserve_size = ps.GetInt();
 		}
 
+		// search sessions are disabled by default
+		long session_max = greylock::get_int64(config, "search-session-max", 0);
+		long session_timeout = greylock::get_int64(config, "search-session-timeout", 60);
+		if (session_max < 0 || session_timeout <= 0) {
+			ILOG_ERROR("\"application.search-session-max\" must be non-negative "
+					"and \"application.search-session-timeout\" must be positive");
+			return false;
+		}
+		m_sessions.configure(session_max, session_timeout);
+
+		// search result cache is disabled by default
+		long cache_max = greylock::get_int64(config, "search-cache-max", 0);
+		long cache_timeout = greylock::get_int64(config, "search-cache-timeout", 60);
+		long cache_max_documents = greylock::get_int64(config, "search-cache-max-documents", 1000);
+		if (cache_max < 0 || cache_timeout <= 0 || cache_max_documents < 0) {
+			ILOG_ERROR("\"application.search-cache-max\" and \"application.search-cache-max-documents\" "
+					"must be non-negative and \"application.search-cache-timeout\" must be positive");
+			return false;
+		}
+		m_search_cache.configure(cache_max, cache_timeout);
+		m_search_cache_max_documents = cache_max_documents;
+
+		long top_max = greylock::get_int64(config, "search-top-max", 1000);
+		if (top_max <= 0) {
+			ILOG_ERROR("\"application.search-top-max\" must be positive");
+			return false;
+		}
+		m_search_top_max = top_max;
+
+		// small indexes are read from the storage by every search by default
+		long posting_max = greylock::get_int64(config, "posting-cache-max", 0);
+		long posting_timeout = greylock::get_int64(config, "posting-cache-timeout", 600);
+		long posting_max_keys = greylock::get_int64(config, "posting-cache-max-keys", 1024);
+		long posting_max_leaves = greylock::get_int64(config, "posting-cache-max-leaves", 3);
+		if (posting_max < 0 || posting_timeout <= 0 || posting_max_keys < 0 || posting_max_leaves < 0) {
+			ILOG_ERROR("\"application.posting-cache-max\", \"application.posting-cache-max-keys\" and "
+					"\"application.posting-cache-max-leaves\" must be non-negative and "
+					"\"application.posting-cache-timeout\" must be positive");
+			return false;
+		}
+		greylock::posting_cache::instance().configure(posting_max, posting_timeout, posting_max_keys, posting_max_leaves);
+
+		// indexes are not partitioned by default
+		m_partition_period = greylock::get_int64(config, "partition-period", 0);
+		if (m_partition_period < 0) {
+			ILOG_ERROR("\"application.partition-period\" must be non-negative");
+			return false;
+		}
+
+		// every index is looked up in its directory once per hour by default
+		long registered_max = greylock::get_int64(config, "registered-indexes-max", 65536);
+		long registered_timeout = greylock::get_int64(config, "registered-indexes-timeout", 3600);
+		if (registered_max < 0 || registered_timeout <= 0) {
+			ILOG_ERROR("\"application.registered-indexes-max\" must be non-negative "
+					"and \"application.registered-indexes-timeout\" must be positive");
+			return false;
+		}
+		m_registered.configure(registered_max, registered_timeout);
+
+		// new documents are indexed with their ids and urls in every posting by default,
+		// documents indexed before this option has been turned on keep their postings
+		m_document_ordinals = greylock::get_bool(config, "document-ordinals", false);
+
+		// indexes never become dense by default, only documents with ordinals are put into bitmaps
+		long dense_ratio = greylock::get_int64(config, "dense-term-ratio", 0);
+		long dense_min_keys = greylock::get_int64(config, "dense-term-min-keys", 10000);
+		if (dense_ratio < 0 || dense_ratio > 100 || dense_min_keys < 0) {
+			ILOG_ERROR("\"application.dense-term-ratio\" must be within [0, 100] and "
+					"\"application.dense-term-min-keys\" must be non-negative");
+			return false;
+		}
+		m_dense_term_ratio = dense_ratio;
+		m_dense_term_min_keys = dense_min_keys;
+
+		// indexes do not have id filters by default, when turned on, filters of the existing index
+		// are built by its next modification
+		m_id_filters = greylock::get_bool(config, "id-filters", false);
+
+		// there is no forward index by default and documents can not be deleted,
+		// documents indexed before it has been turned on are not in the forward index
+		m_forward_index = greylock::get_bool(config, "forward-index", false);
+
+		// document indexed again gets one more posting by default, unless its timestamp has not changed,
+		// without forward index previous postings are looked up by posting id, which is not the document id
+		// when ordinals are turned on
+		m_upsert = greylock::get_bool(config, "index-upsert", false);
+		if (m_upsert && !m_forward_index && m_document_ordinals) {
+			ILOG_ERROR("\"application.index-upsert\" requires \"application.forward-index\" "
+					"when \"application.document-ordinals\" is turned on");
+			return false;
+		}
+
+		// there are no pair indexes by default, every "pair-indexes" entry is an object like search query,
+		// every its attribute has two words, for example {"to": "john smith"}
+		const rapidjson::Value &pairs = greylock::get_array(config, "pair-indexes");
+		if (pairs.IsArray()) {
+			ribosome::split spl;
+			for (auto it = pairs.Begin(), end = pairs.End(); it != end; ++it) {
+				if (!it->IsObject()) {
+					ILOG_ERROR("\"application.pair-indexes\" entries must be objects");
+					return false;
+				}
+
+				for (auto m = it->MemberBegin(), mend = it->MemberEnd(); m != mend; ++m) {
+					pair_config pc;
+					pc.aname = m->name.GetString();
+
+					if (m->value.IsString()) {
+						std::vector<ribosome::lstring> words =
+							spl.convert_split_words(m->value.GetString(), m->value.GetStringLength());
+						if (words.size() == 2) {
+							pc.first = ribosome::lconvert::to_string(words[0]);
+							pc.second = ribosome::lconvert::to_string(words[1]);
+						}
+					}
+
+					if (pc.first.empty() || (pc.first == pc.second)) {
+						ILOG_ERROR("\"application.pair-indexes\": attribute: %s: must be a string of two different words",
+								pc.aname);
+						return false;
+					}
+
+					m_pair_config.push_back(pc);
+				}
+			}
+		}
+
+		// pairs are not built from the searches by default
+		m_pair_hot_queries = greylock::get_int64(config, "pair-index-hot-queries", 0);
+		long hot_max = greylock::get_int64(config, "pair-index-hot-max", 65536);
+		long hot_timeout = greylock::get_int64(config, "pair-index-hot-timeout", 86400);
+		if (m_pair_hot_queries < 0 || hot_max < 0 || hot_timeout <= 0) {
+			ILOG_ERROR("\"application.pair-index-hot-queries\" and \"application.pair-index-hot-max\" "
+					"must be non-negative and \"application.pair-index-hot-timeout\" must be positive");
+			return false;
+		}
+		m_pair_hits.configure(hot_max, hot_timeout);
+
+		if (m_partition_period && pairs_enabled()) {
+			ILOG_ERROR("pair indexes are not supported for partitioned indexes, they are disabled");
+			m_pair_config.clear();
+			m_pair_hot_queries = 0;
+		}
+
+		long snapshot_max = greylock::get_int64(config, "pair-registry-max", 65536);
+		long snapshot_timeout = greylock::get_int64(config, "pair-registry-timeout", 3600);
+		long pair_builders = greylock::get_int64(config, "pair-index-builders", 1);
+		if (snapshot_max < 0 || snapshot_timeout <= 0 || pair_builders < 0) {
+			ILOG_ERROR("\"application.pair-registry-max\" and \"application.pair-index-builders\" "
+					"must be non-negative and \"application.pair-registry-timeout\" must be positive");
+			return false;
+		}
+		m_pair_snapshots.configure(snapshot_max, snapshot_timeout);
+
+		if (pairs_enabled() && !pair_builders) {
+			ILOG_ERROR("there are no pair index builders, pair indexes are disabled");
+			m_pair_config.clear();
+			m_pair_hot_queries = 0;
+		}
+
+		if (pairs_enabled())
+			m_pair_builders.start(pair_builders, false);
+
+		// searches are processed in request threads by default
+		long cpu_threads = greylock::get_int64(config, "cpu-threads", 0);
+		if (cpu_threads < 0) {
+			ILOG_ERROR("\"application.cpu-threads\" must be non-negative");
+			return false;
+		}
+
+		bool cpu_pin = greylock::get_bool(config, "cpu-pin", false);
+		if (!m_workers.start(cpu_threads, cpu_pin)) {
+			ILOG_ERROR("could not pin %ld CPU worker threads to cores, threads are not pinned", cpu_threads);
+		}
+
 		return true;
 	}
 
@@ -1,12 +1,18 @@
 #include <algorithm>
 #include <iostream>
+#include <set>
+#include <thread>
 
+#include "greylock/dictionary.hpp"
+#include "greylock/forward.hpp"
 #include "greylock/intersection.hpp"
+#include "greylock/relevance.hpp"
 
 #include <ebucket/bucket_processor.hpp>
 
 #include <boost/program_options.hpp>
 
+#include <ribosome/distance.hpp>
 #include <ribosome/timer.hpp>
 
 using namespace ioremap;
@@ -24,6 +30,19 @@ public:
 		greylock::read_write_index idx(bp, start);
 
 		test::run(this, func(&test::test_remove_some_keys, bp, 10000));
+		test::run(this, func(&test::test_reverse_iterator, bp, 10000));
+		test::run(this, func(&test::test_remove_range, bp, 10000));
+		test::run(this, func(&test::test_id_filters, bp, 10000));
+		test::run(this, func(&test::test_page_reader, bp, 8));
+		test::run(this, func(&test::test_document_dictionary, bp, 1000));
+		test::run(this, func(&test::test_forward_index, bp, 1000));
+		test::run(this, func(&test::test_match_positions));
+		test::run(this, func(&test::test_top_k, 10000, 50));
+		test::run(this, func(&test::test_relevance_distance, 10000));
+		test::run(this, func(&test::test_key_prefix, 100000));
+		test::run(this, func(&test::test_block_lower_bound, 100000));
+		test::run(this, func(&test::test_ordinal_bitmap, 100000));
+		test::run(this, func(&test::test_dense_index, bp, 3000));
 
 		std::vector<greylock::key> keys;
 		test::run(this, func(&test::test_index_recovery, bp, 10000));
@@ -152,6 +171,795 @@ private:
 		}
 	}
 
+	// every document gets its own ordinal, the same document keeps it, id and url are restored from dictionary
+	void test_document_dictionary(ebucket::bucket_processor &bp, int max) {
+		greylock::eurl name;
+		name.key = "dictionary-test." + elliptics::lexical_cast(rand());
+		name.bucket = m_bucket;
+
+		greylock::document_dictionary dict(bp, name);
+
+		std::vector<greylock::key> docs, postings;
+		for (int i = 0; i < max; ++i) {
+			greylock::key k;
+			k.id = elliptics::lexical_cast(rand()) + ".dictionary-key." + elliptics::lexical_cast(i);
+			k.url.key = "dictionary-data." + elliptics::lexical_cast(i);
+			k.url.bucket = m_bucket;
+			k.set_timestamp(rand() % 10, 0);
+
+			greylock::key posting = k;
+			elliptics::error_info err = dict.assign(posting);
+			if (err || (posting.id != greylock::document_dictionary::ordinal_id(i)) || !posting.url.key.empty()) {
+				std::ostringstream ss;
+				ss << "dictionary: could not assign ordinal " << i << " to " << k.str() << ": " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+
+			docs.push_back(k);
+			postings.push_back(posting);
+		}
+
+		for (size_t i = 0; i < docs.size(); ++i) {
+			greylock::key again = docs[i];
+			dict.assign(again);
+
+			greylock::key restored = postings[i];
+			elliptics::error_info err = dict.hydrate(restored);
+
+			if (err || (again.id != postings[i].id) ||
+					(restored.id != docs[i].id) || (restored.url != docs[i].url)) {
+				std::ostringstream ss;
+				ss << "dictionary: document: " << docs[i].str() <<
+					", assigned again: " << (again.id == postings[i].id) <<
+					", restored: " << restored.str() << ": " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
+	void test_forward_index(ebucket::bucket_processor &bp, int max) {
+		greylock::eurl name;
+		name.key = "forward-test." + elliptics::lexical_cast(rand());
+		name.bucket = m_bucket;
+
+		greylock::forward_index fwd(bp, name);
+
+		auto indexes_of = [&] (int i) {
+			std::vector<greylock::eurl> ret;
+			for (int j = 0; j <= i % 7; ++j) {
+				greylock::eurl iname;
+				iname.key = "forward-test-index." + elliptics::lexical_cast((i + j) % 13);
+				iname.bucket = m_bucket;
+				ret.push_back(iname);
+			}
+			std::sort(ret.begin(), ret.end());
+			return ret;
+		};
+
+		std::vector<greylock::key> docs;
+		for (int i = 0; i < max; ++i) {
+			greylock::key k;
+			k.id = elliptics::lexical_cast(rand()) + ".forward-key." + elliptics::lexical_cast(i);
+			k.url.key = "forward-data." + elliptics::lexical_cast(i);
+			k.url.bucket = m_bucket;
+			k.set_timestamp(rand() % 10, 0);
+
+			// every other document references an ordinal
+			greylock::key posting = k;
+			if (i % 2)
+				posting.set_id(greylock::document_dictionary::ordinal_id(i));
+
+			elliptics::error_info err = fwd.insert(k, posting, indexes_of(i));
+			if (err) {
+				std::ostringstream ss;
+				ss << "forward index: could not insert " << k.str() << ": " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+
+			docs.push_back(k);
+		}
+
+		// index list is stored in the record, tree has one key per document
+		{
+			greylock::read_only_index idx(bp, name);
+			if (idx.meta().num_keys != (unsigned long long)max) {
+				std::ostringstream ss;
+				ss << "forward index: keys: " << idx.meta().num_keys << ", must be: " << max;
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		for (int i = 0; i < max; ++i) {
+			std::vector<greylock::forward_index::document> found;
+			elliptics::error_info err = fwd.find(docs[i].id, found);
+
+			std::vector<greylock::eurl> indexes;
+			if (found.size() == 1) {
+				indexes = found[0].indexes;
+				std::sort(indexes.begin(), indexes.end());
+			}
+
+			std::string posting_id = (i % 2) ? greylock::document_dictionary::ordinal_id(i) : docs[i].id;
+			if (err || (found.size() != 1) || (found[0].doc != docs[i]) || (found[0].doc.url != docs[i].url) ||
+					(found[0].posting.id != posting_id) || (indexes != indexes_of(i))) {
+				std::ostringstream ss;
+				ss << "forward index: document: " << docs[i].str() << ", found: " << found.size() <<
+					", indexes: " << indexes.size() << ": " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+
+			if (i % 3)
+				continue;
+
+			err = fwd.remove(found[0]);
+			if (!err)
+				err = fwd.find(docs[i].id, found);
+			if (err || !found.empty()) {
+				std::ostringstream ss;
+				ss << "forward index: document: " << docs[i].str() << ", found after removal: " << found.size() <<
+					": " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		greylock::key from, to;
+		to.timestamp = ~0ULL;
+		elliptics::error_info err = fwd.remove_range(from, to);
+		for (int i = 0; !err && (i < max); ++i) {
+			std::vector<greylock::forward_index::document> found;
+			err = fwd.find(docs[i].id, found);
+			if (!err && !found.empty()) {
+				std::ostringstream ss;
+				ss << "forward index: document: " << docs[i].str() << ", found after range removal: " << found.size();
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		if (err) {
+			std::ostringstream ss;
+			ss << "forward index: range removal: " << err.message();
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_reverse_iterator(ebucket::bucket_processor &bp, int max) {
+		greylock::eurl start;
+		start.key = "reverse-test-index." + elliptics::lexical_cast(rand());
+		start.bucket = m_bucket;
+
+		greylock::read_write_index idx(bp, start);
+		std::vector<greylock::key> keys;
+
+		for (int i = 0; i < max; ++i) {
+			greylock::key k;
+
+			char buf[128];
+
+			snprintf(buf, sizeof(buf), "%08x.reverse-test.%08d", rand(), i);
+			k.id = std::string(buf);
+
+			snprintf(buf, sizeof(buf), "some-data.%08d", i);
+			k.url.key = std::string(buf);
+			k.url.bucket = m_bucket;
+
+			k.set_timestamp(i + 1, 0);
+			keys.push_back(k);
+		}
+
+		// insert keys in random order, so that pages are split in the middle of the index
+		std::random_shuffle(keys.begin(), keys.end());
+		for (auto it = keys.begin(), end = keys.end(); it != end; ++it) {
+			elliptics::error_info err = idx.insert(*it);
+			if (err) {
+				std::ostringstream ss;
+				ss << "failed to insert key: " << it->str() << ": " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		std::sort(keys.begin(), keys.end());
+
+		size_t num = 0;
+		auto kit = keys.rbegin();
+		for (auto it = idx.rbegin(), end = idx.rend(); it != end; ++it, ++kit) {
+			if (kit == keys.rend()) {
+				std::ostringstream ss;
+				ss << "reverse iterator: returned more keys than inserted: " << keys.size() <<
+					", extra key: " << it->str();
+				throw std::runtime_error(ss.str());
+			}
+
+			if (*it != *kit) {
+				std::ostringstream ss;
+				ss << "reverse iterator: key mismatch at position " << num <<
+					": iterated: " << it->str() <<
+					", must be: " << kit->str();
+				throw std::runtime_error(ss.str());
+			}
+
+			num++;
+		}
+
+		if (num != keys.size()) {
+			std::ostringstream ss;
+			ss << "reverse iterator: iterated number mismatch: keys: " << keys.size() << ", iterated: " << num;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_remove_range(ebucket::bucket_processor &bp, int max) {
+		greylock::eurl start;
+		start.key = "remove-range-test-index." + elliptics::lexical_cast(rand());
+		start.bucket = m_bucket;
+
+		greylock::read_write_index idx(bp, start);
+		std::vector<greylock::key> keys;
+
+		for (int i = 0; i < max; ++i) {
+			greylock::key k;
+
+			char buf[128];
+
+			snprintf(buf, sizeof(buf), "%08x.remove-range-test.%08d", rand(), i);
+			k.id = std::string(buf);
+
+			snprintf(buf, sizeof(buf), "some-data.%08d", i);
+			k.url.key = std::string(buf);
+			k.url.bucket = m_bucket;
+
+			k.set_timestamp(i + 1, 0);
+			keys.push_back(k);
+		}
+
+		std::random_shuffle(keys.begin(), keys.end());
+		for (auto it = keys.begin(), end = keys.end(); it != end; ++it) {
+			elliptics::error_info err = idx.insert(*it);
+			if (err) {
+				std::ostringstream ss;
+				ss << "failed to insert key: " << it->str() << ": " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		std::sort(keys.begin(), keys.end());
+
+		// remove the middle half of the keys, so that both boundary leaves are trimmed
+		greylock::key from, to;
+		from.set_timestamp(max / 4 + 1, 0);
+		to.set_timestamp(max / 4 * 3 + 1, 0);
+
+		ribosome::timer tm;
+		size_t removed = 0;
+		elliptics::error_info err = idx.remove_range(from, to, &removed);
+		if (err) {
+			std::ostringstream ss;
+			ss << "remove-range-test: failed to remove range: " << err.message();
+			throw std::runtime_error(ss.str());
+		}
+		printf("remove-range-test: meta after remove: %s, removed entries: %zd, time: %ld ms\n",
+				idx.meta().str().c_str(), removed, tm.elapsed());
+
+		std::vector<greylock::key> rest;
+		for (auto it = keys.begin(), end = keys.end(); it != end; ++it) {
+			if (*it < from || !(*it < to))
+				rest.push_back(*it);
+		}
+
+		// keys of the leaves fully covered by the range are estimated, leaves are at least half full
+		size_t must_be = keys.size() - rest.size();
+		if ((idx.meta().num_keys + removed != keys.size()) || (removed < must_be / 2) || (removed > must_be * 2)) {
+			std::ostringstream ss;
+			ss << "remove-range-test: number of keys mismatch: meta: " << idx.meta().str() <<
+				", removed: " << removed << ", must be about: " << must_be;
+			throw std::runtime_error(ss.str());
+		}
+
+		std::vector<greylock::key> forward = idx.keys();
+		if (forward != rest) {
+			std::ostringstream ss;
+			ss << "remove-range-test: forward iteration mismatch: iterated: " << forward.size() <<
+				", must be: " << rest.size();
+			throw std::runtime_error(ss.str());
+		}
+
+		std::vector<greylock::key> backward;
+		for (auto it = idx.rbegin(), end = idx.rend(); it != end; ++it) {
+			backward.push_back(*it);
+		}
+		std::reverse(backward.begin(), backward.end());
+		if (backward != rest) {
+			std::ostringstream ss;
+			ss << "remove-range-test: reverse iteration mismatch: iterated: " << backward.size() <<
+				", must be: " << rest.size();
+			throw std::runtime_error(ss.str());
+		}
+
+		// every remaining key must still be reachable from the root
+		for (auto it = rest.begin(), end = rest.end(); it != end; ++it) {
+			greylock::key found = idx.search(*it);
+			if (!found) {
+				std::ostringstream ss;
+				ss << "remove-range-test: could not find key: " << it->str();
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
+	void test_id_filters(ebucket::bucket_processor &bp, int max) {
+		greylock::eurl start;
+		start.key = "id-filters-test-index." + elliptics::lexical_cast(rand());
+		start.bucket = m_bucket;
+
+		std::vector<greylock::key> keys;
+		for (int i = 0; i < max; ++i) {
+			greylock::key k;
+
+			char buf[128];
+
+			snprintf(buf, sizeof(buf), "%08x.id-filters-test.%08d", rand(), i);
+			k.id = std::string(buf);
+
+			snprintf(buf, sizeof(buf), "some-data.%08d", i);
+			k.url.key = std::string(buf);
+			k.url.bucket = m_bucket;
+
+			k.set_timestamp(i + 1, 0);
+			keys.push_back(k);
+		}
+
+		// the same document with the other timestamp
+		greylock::key moved = keys[0];
+		moved.set_timestamp(max + 1, 0);
+
+		std::vector<greylock::key> removed;
+
+		{
+			greylock::read_write_index idx(bp, start);
+
+			// the first half gets filters in bulk, the second half is maintained by the inserts
+			for (int i = 0; i < max / 2; ++i) {
+				elliptics::error_info err = idx.insert(keys[i]);
+				if (err) {
+					std::ostringstream ss;
+					ss << "id-filters-test: failed to insert key: " << keys[i].str() << ": " << err.message();
+					throw std::runtime_error(ss.str());
+				}
+			}
+
+			elliptics::error_info err = idx.enable_filters();
+			if (err) {
+				std::ostringstream ss;
+				ss << "id-filters-test: failed to build filters: " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+
+			for (int i = max / 2; i < max; ++i) {
+				err = idx.insert(keys[i]);
+				if (err) {
+					std::ostringstream ss;
+					ss << "id-filters-test: failed to insert key: " << keys[i].str() << ": " << err.message();
+					throw std::runtime_error(ss.str());
+				}
+			}
+			idx.insert(moved);
+
+			for (int i = 1; i < max; i += 10) {
+				idx.remove(keys[i]);
+				removed.push_back(keys[i]);
+			}
+
+			greylock::key from, to;
+			from.set_timestamp(max / 4 + 1, 0);
+			to.set_timestamp(max / 4 + 1 + max / 10, 0);
+			idx.remove_range(from, to);
+			for (auto &k: keys) {
+				if (!(k < from) && (k < to))
+					removed.push_back(k);
+			}
+		}
+
+		// filters have been written by the index object above
+		greylock::read_only_index idx(bp, start);
+		if (!idx.has_filters()) {
+			std::ostringstream ss;
+			ss << "id-filters-test: index does not have filters: " << idx.meta().str();
+			throw std::runtime_error(ss.str());
+		}
+
+		std::sort(removed.begin(), removed.end());
+
+		ribosome::timer tm;
+		for (auto &k: keys) {
+			std::vector<greylock::key> expected;
+			if (!std::binary_search(removed.begin(), removed.end(), k))
+				expected.push_back(k);
+			if (k.id == moved.id)
+				expected.push_back(moved);
+
+			std::vector<greylock::key> found;
+			elliptics::error_info err = idx.find_id(k.id, found);
+			if (err) {
+				std::ostringstream ss;
+				ss << "id-filters-test: failed to find id: " << k.id << ": " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+
+			if (found != expected) {
+				std::ostringstream ss;
+				ss << "id-filters-test: id: " << k.id << ": found keys: " << found.size() <<
+					", must be: " << expected.size();
+				throw std::runtime_error(ss.str());
+			}
+
+			if (!expected.empty() && !idx.may_contain_id(k.id)) {
+				std::ostringstream ss;
+				ss << "id-filters-test: filters do not contain id: " << k.id;
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		int false_positives = 0;
+		for (int i = 0; i < max; ++i) {
+			if (idx.may_contain_id("id-filters-test.missing." + elliptics::lexical_cast(i)))
+				false_positives++;
+		}
+
+		printf("id-filters-test: meta: %s, lookups: %d, time: %ld ms, false positives: %d/%d\n",
+				idx.meta().str().c_str(), max, tm.elapsed(), false_positives, max);
+
+		// every leaf filter gives about 0.01% of false positives (see @id_filter), lookup checks all of them,
+		// allow a few times more than expected to keep the test stable
+		const int expected_false_positives = max * idx.meta().num_leaf_pages / 10000;
+		if (false_positives > expected_false_positives * 4 + 10) {
+			std::ostringstream ss;
+			ss << "id-filters-test: too many false positives: " << false_positives << "/" << max <<
+				", expected about: " << expected_false_positives;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_page_reader(ebucket::bucket_processor &bp, int num_readers) {
+		greylock::eurl start;
+		start.key = "page-reader-test-index." + elliptics::lexical_cast(rand());
+		start.bucket = m_bucket;
+
+		// index is small enough to fit into a single leaf
+		const int num_keys = 10;
+		{
+			greylock::read_write_index idx(bp, start);
+			for (int i = 0; i < num_keys; ++i) {
+				greylock::key k;
+				k.id = "page-reader-test." + elliptics::lexical_cast(i);
+				k.url.key = "some-data." + elliptics::lexical_cast(i);
+				k.url.bucket = m_bucket;
+				k.set_timestamp(i + 1, 0);
+
+				elliptics::error_info err = idx.insert(k);
+				if (err) {
+					std::ostringstream ss;
+					ss << "page-reader-test: failed to insert key: " << k.str() << ": " << err.message();
+					throw std::runtime_error(ss.str());
+				}
+			}
+		}
+
+		greylock::read_only_index idx(bp, start);
+		const greylock::eurl leaf = idx.begin().url();
+
+		auto &reader = greylock::page_reader::instance();
+		const unsigned long long reads = reader.reads();
+		const unsigned long long joined = reader.joined();
+
+		// the first read is held until all other readers have joined it,
+		// the wait is bounded, so that broken single-flight fails the check below instead of hanging
+		reader.set_send_hook([&] (const greylock::eurl &) {
+				ribosome::timer tm;
+				while ((reader.joined() - joined < (unsigned long long)num_readers - 1) && (tm.elapsed() < 10000))
+					std::this_thread::yield();
+			});
+
+		std::vector<elliptics::error_info> errors(num_readers);
+		std::vector<greylock::page> pages(num_readers);
+
+		std::vector<std::thread> readers;
+		for (int i = 0; i < num_readers; ++i) {
+			readers.emplace_back([&, i] () {
+				errors[i] = reader.read(bp, leaf, pages[i]);
+			});
+		}
+
+		for (auto &t: readers) {
+			t.join();
+		}
+
+		reader.set_send_hook(std::function<void (const greylock::eurl &)>());
+
+		for (int i = 0; i < num_readers; ++i) {
+			if (errors[i] || !pages[i].is_leaf() || (pages[i].objects.size() != (size_t)num_keys)) {
+				std::ostringstream ss;
+				ss << "page-reader-test: reader: " << i << ", page: " << pages[i].str() <<
+					", error: " << errors[i].message();
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		if ((reader.reads() - reads != 1) || (reader.joined() - joined != (unsigned long long)num_readers - 1)) {
+			std::ostringstream ss;
+			ss << "page-reader-test: readers: " << num_readers << ", storage reads: " << reader.reads() - reads <<
+				", must be: 1, joined reads: " << reader.joined() - joined << ", must be: " << num_readers - 1;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	void test_match_positions() {
+		// "new york is a big city, york is old, new is new"
+		//   0    1   2  3  4   5     6   7  8    9  10 11
+		std::vector<size_t> fresh = {0, 9, 11};
+		std::vector<size_t> york = {1, 6};
+		std::vector<size_t> city = {5};
+
+		std::vector<const std::vector<size_t> *> phrase = {&fresh, &york};
+		if (!greylock::intersect::phrase_match(phrase))
+			throw std::runtime_error("match-test: 'new york' phrase has not been found");
+
+		std::vector<const std::vector<size_t> *> reversed = {&york, &fresh};
+		if (greylock::intersect::phrase_match(reversed))
+			throw std::runtime_error("match-test: 'york new' phrase must not be found");
+
+		std::vector<const std::vector<size_t> *> near = {&fresh, &city};
+		// the closest pair is "city" at 5 and "new" at 9
+		if (!greylock::intersect::proximity_match(near, 4))
+			throw std::runtime_error("match-test: 'new' and 'city' must be within 4 words");
+		if (greylock::intersect::proximity_match(near, 3))
+			throw std::runtime_error("match-test: 'new' and 'city' must not be within 3 words");
+	}
+
+	void test_top_k(int max, size_t k) {
+		greylock::intersect::top_k top(k, [] (greylock::intersect::single_doc_result &rs) {
+				rs.relevance = (float)std::stoi(rs.doc.id);
+			});
+
+		std::vector<int> ids;
+		for (int i = 0; i < max; ++i) {
+			ids.push_back(rand() % max);
+		}
+
+		for (auto id: ids) {
+			greylock::intersect::single_doc_result rs;
+			rs.doc.id = elliptics::lexical_cast(id);
+			top.insert(rs);
+		}
+
+		std::sort(ids.begin(), ids.end(), std::greater<int>());
+
+		std::vector<greylock::intersect::single_doc_result> docs = top.extract();
+		if (docs.size() != k) {
+			std::ostringstream ss;
+			ss << "top-k: number of selected documents mismatch: k: " << k << ", selected: " << docs.size();
+			throw std::runtime_error(ss.str());
+		}
+
+		for (size_t i = 0; i < k; ++i) {
+			if (docs[i].relevance != (float)ids[i]) {
+				std::ostringstream ss;
+				ss << "top-k: document " << i << " relevance mismatch: " << docs[i].relevance <<
+					", must be: " << ids[i];
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
+	void test_relevance_distance(int max) {
+		greylock::relevance_kernel kernel;
+
+		for (int i = 0; i < max; ++i) {
+			size_t alphabet = 1 + rand() % 6;
+
+			// every tenth pattern is longer than machine word
+			std::vector<size_t> pattern(1 + rand() % ((i % 10) ? 10 : 100));
+			std::vector<size_t> text(rand() % (pattern.size() + 3));
+			for (auto &w: pattern)
+				w = rand() % alphabet;
+			for (auto &w: text)
+				w = rand() % alphabet;
+
+			kernel.prepare(pattern, alphabet);
+			int dist = kernel.distance(pattern, text.data(), text.size());
+			int must = ribosome::distance::levenstein(pattern, text, INT_MAX);
+			if (dist != must) {
+				std::ostringstream ss;
+				ss << "relevance: distance mismatch: pattern size: " << pattern.size() <<
+					", text size: " << text.size() << ", distance: " << dist << ", must be: " << must;
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
+	// keys with id prefixes must be ordered exactly as keys compared by whole ids
+	void test_key_prefix(int max) {
+		auto random_id = [] () {
+			// short ids and bytes above 0x7f check padding and unsigned byte order
+			std::string id(rand() % 12, 0);
+			for (auto &c: id)
+				c = "a\x00\x7f\x80\xff"[rand() % 5];
+			return id;
+		};
+
+		for (int i = 0; i < max; ++i) {
+			greylock::key k1, k2;
+			k1.id = random_id();
+			k2.id = (i % 3) ? random_id() : k1.id + random_id();
+			k1.timestamp = rand() % 2;
+			k2.timestamp = rand() % 2;
+
+			greylock::key p1 = k1, p2 = k2;
+			p1.update_prefix();
+			p2.update_prefix();
+
+			if (((p1 < p2) != (k1 < k2)) || ((p1 <= p2) != (k1 <= k2)) || ((p1 == p2) != (k1 == k2)) ||
+					((p1 < k2) != (k1 < k2))) {
+				std::ostringstream ss;
+				ss << "key prefix: comparison mismatch: " << k1.str() << " vs " << k2.str();
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
+	// block kernel must find the same bounds as binary search over keys
+	void test_block_lower_bound(int max) {
+		auto random_key = [] () {
+			greylock::key k;
+			k.timestamp = rand() % 4;
+			k.id = std::string(rand() % 10, 0);
+			for (auto &c: k.id)
+				c = "a\x00\x80\xff"[rand() % 4];
+			if (rand() % 2)
+				k.update_prefix();
+			return k;
+		};
+
+		for (int i = 0; i < max; ++i) {
+			std::vector<greylock::key> keys(rand() % 70);
+			for (auto &k: keys)
+				k = random_key();
+			std::sort(keys.begin(), keys.end());
+
+			greylock::block::columns columns;
+			columns.assign(keys);
+
+			greylock::key k = random_key();
+			size_t first = rand() % (keys.size() + 1);
+			ssize_t last = (ssize_t)(rand() % (keys.size() + 1)) - 1;
+
+			size_t lb = greylock::block::lower_bound(keys, columns, first, k);
+			size_t lb_must = std::lower_bound(keys.begin() + first, keys.end(), k) - keys.begin();
+			ssize_t rlb = greylock::block::rlower_bound(keys, columns, last, k);
+			ssize_t rlb_must = (std::upper_bound(keys.begin(), keys.begin() + last + 1, k) - keys.begin()) - 1;
+
+			if ((lb != lb_must) || (rlb != rlb_must)) {
+				std::ostringstream ss;
+				ss << "block: bound mismatch: keys: " << keys.size() << ", key: " << k.str() <<
+					", lower bound: " << lb << ", must be: " << lb_must <<
+					", reverse lower bound: " << rlb << ", must be: " << rlb_must;
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
+	// bitmap must contain exactly the same ordinals as the set, both before and after it has been saved,
+	// ordinals are clustered, so that containers switch between arrays and bitmaps
+	void test_ordinal_bitmap(int max) {
+		greylock::ordinal_bitmap bm;
+		std::set<uint64_t> must;
+
+		for (int i = 0; i < max; ++i) {
+			uint64_t ordinal = (rand() % 3) * 65536 + rand() % 12000;
+			bool add = (rand() % 3) != 0;
+
+			bool changed = add ? bm.add(ordinal) : bm.remove(ordinal);
+			bool must_change = add ? must.insert(ordinal).second : (must.erase(ordinal) != 0);
+			if (changed != must_change) {
+				std::ostringstream ss;
+				ss << "bitmap: " << (add ? "add" : "remove") << ": ordinal: " << ordinal <<
+					", changed: " << changed << ", must be: " << must_change;
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		std::string data = bm.save();
+		greylock::ordinal_bitmap loaded;
+		loaded.load(data.data(), data.size());
+
+		for (uint64_t ordinal = 0; ordinal < 4 * 65536; ++ordinal) {
+			bool found = must.count(ordinal) != 0;
+			if ((bm.contains(ordinal) != found) || (loaded.contains(ordinal) != found) ||
+					(loaded.cardinality() != must.size())) {
+				std::ostringstream ss;
+				ss << "bitmap: ordinal: " << ordinal << ", contains: " << bm.contains(ordinal) <<
+					", loaded contains: " << loaded.contains(ordinal) << ", must be: " << found <<
+					", cardinality: " << loaded.cardinality() << ", must be: " << must.size();
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
+	void test_dense_index(ebucket::bucket_processor &bp, int max) {
+		greylock::eurl start;
+		start.key = "dense-test-index." + elliptics::lexical_cast(rand());
+		start.bucket = m_bucket;
+
+		// ordinals are spread over several bitmap containers
+		auto posting = [] (int i) {
+			greylock::key k;
+			k.id = greylock::document_dictionary::ordinal_id((i % 5) * 65536 + i);
+			k.set_timestamp(i + 1, 0);
+			return k;
+		};
+
+		std::set<uint64_t> must;
+		{
+			greylock::read_write_index idx(bp, start);
+			for (int i = 0; i < max / 2; ++i) {
+				greylock::key k = posting(i);
+				elliptics::error_info err = idx.insert(k);
+				if (err) {
+					std::ostringstream ss;
+					ss << "dense-test: failed to insert key: " << k.str() << ": " << err.message();
+					throw std::runtime_error(ss.str());
+				}
+
+				must.insert((i % 5) * 65536 + i);
+			}
+
+			elliptics::error_info err = idx.make_dense();
+			if (err) {
+				std::ostringstream ss;
+				ss << "dense-test: failed to make index dense: " << err.message();
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		// only some containers are touched by the second writer, the other ones must be kept as they are
+		{
+			greylock::read_write_index idx(bp, start);
+			for (int i = max / 2; i < max; i += 5) {
+				greylock::key k = posting(i);
+				elliptics::error_info err = idx.insert(k);
+				if (err) {
+					std::ostringstream ss;
+					ss << "dense-test: failed to insert key: " << k.str() << ": " << err.message();
+					throw std::runtime_error(ss.str());
+				}
+
+				must.insert((i % 5) * 65536 + i);
+			}
+
+			for (int i = 1; i < max / 2; i += 5) {
+				idx.remove(posting(i));
+				must.erase((i % 5) * 65536 + i);
+			}
+		}
+
+		greylock::read_only_index idx(bp, start);
+		std::shared_ptr<const greylock::ordinal_bitmap> bm = idx.bitmap();
+		if (!idx.dense() || !bm) {
+			std::ostringstream ss;
+			ss << "dense-test: could not read bitmap: " << idx.meta().str();
+			throw std::runtime_error(ss.str());
+		}
+
+		for (uint64_t ordinal = 0; ordinal < 5 * 65536 + (uint64_t)max; ++ordinal) {
+			bool found = must.count(ordinal) != 0;
+			if ((bm->contains(ordinal) != found) || (bm->cardinality() != must.size())) {
+				std::ostringstream ss;
+				ss << "dense-test: ordinal: " << ordinal << ", contains: " << bm->contains(ordinal) <<
+					", must be: " << found << ", cardinality: " << bm->cardinality() <<
+					", must be: " << must.size();
+				throw std::runtime_error(ss.str());
+			}
+		}
+	}
+
 	void test_index_recovery(ebucket::bucket_processor &bp, int max) {
 		(void) bp;
 		(void) max;
@@ -409,6 +1217,81 @@ private:
 
 		check_intersection();
 
+		// the same intersection over the state opened via elliptics callbacks
+		{
+			std::string start;
+			auto st = greylock::intersect::state::open(bp, greylock::intersect::query(indexes), start);
+			res = inter.intersect(*st, start, INT_MAX,
+					[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) {return true;});
+			check_intersection();
+		}
+
+		// the same intersection over indexes decoded by the posting cache, paginated via cookies,
+		// the second pass reads cached lists
+		greylock::posting_cache::instance().configure(num_indexes, 60, same_num + different_num, ~0ULL);
+		for (int pass = 0; pass < 2; ++pass) {
+			std::string start;
+			size_t num_found = 0;
+			while (true) {
+				auto st = greylock::intersect::state::open(bp, greylock::intersect::query(indexes), start);
+				res = inter.intersect(*st, start, same_num / 3,
+						[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) {return true;});
+				num_found += res.docs.size();
+
+				if (res.completed || res.docs.empty())
+					break;
+			}
+
+			if ((num_found != same_num) || (greylock::posting_cache::instance().size() != (size_t)num_indexes)) {
+				std::ostringstream ss;
+				ss << "cached intersection failed: pass: " << pass <<
+					", found keys: " << num_found << ", must be: " << same_num <<
+					", cached indexes: " << greylock::posting_cache::instance().size() <<
+					", must be: " << num_indexes;
+				throw std::runtime_error(ss.str());
+			}
+		}
+		greylock::posting_cache::instance().configure(0, 60, 0, 0);
+
+		// the same intersection led by the hint which contains only the common documents, paginated via cookies,
+		// hint is not stored in the cookie, it is resumed from the positions of the required indexes
+		{
+			greylock::eurl hint;
+			hint.bucket = m_bucket;
+			hint.key = "intersection-hint." + elliptics::lexical_cast(rand());
+
+			{
+				greylock::read_write_index idx(bp, hint);
+				for (auto it = same.begin(); it != same.end(); ++it) {
+					idx.insert(*it);
+				}
+			}
+
+			greylock::intersect::query q(indexes);
+			q.hints.push_back(hint);
+
+			std::string start;
+			size_t num_found = 0;
+			while (true) {
+				auto st = greylock::intersect::state::open(bp, q, start);
+				res = inter.intersect(*st, start, same_num / 3,
+						[] (const std::vector<greylock::eurl> &, greylock::intersect::result &) {return true;});
+				num_found += res.docs.size();
+
+				// hint is not returned among document indexes
+				index_checker c(res, indexes, res.docs.size());
+
+				if (res.completed || res.docs.empty())
+					break;
+			}
+
+			if (num_found != same_num) {
+				std::ostringstream ss;
+				ss << "hinted intersection failed: found keys: " << num_found << ", must be: " << same_num;
+				throw std::runtime_error(ss.str());
+			}
+		}
+
 		greylock::intersect::intersector p(bp);
 		std::string start("\0");
 		size_t num = same_num / 10;